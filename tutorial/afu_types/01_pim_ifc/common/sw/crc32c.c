@@ -0,0 +1,230 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// The hardware path follows Mark Adler's crc32c.c. The crc32 instruction
+// has a latency of three cycles and a throughput of one per cycle, so the
+// buffer is split into three blocks that are checksummed in parallel.
+// The CRCs of the first two blocks are then shifted past the bytes that
+// follow them, which is a multiplication in GF(2) done with tables, and
+// combined.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_HW
+#endif
+
+// Reflected CRC-32C polynomial
+#define POLY 0x82f63b78
+
+// Block sizes for the interleaved hardware path. Must be powers of two.
+#define LONG 8192
+#define SHORT 256
+
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
+static uint32_t s_table[256];
+static bool s_use_hw;
+
+#ifdef CRC32C_HAVE_HW
+// Tables to shift a CRC past LONG and SHORT zero bytes
+static uint32_t s_long_shift[4][256];
+static uint32_t s_short_shift[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec)
+    {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Operator that applies len zero bytes to a CRC. len must be a power of
+// two.
+static void zeros_op(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+    uint32_t row = 1;
+
+    // Operator for one zero bit in odd
+    odd[0] = POLY;
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    // Two zero bits in even, then four in odd
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    // Square until the operator covers len bytes. The first square in the
+    // loop produces the operator for one byte.
+    do
+    {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    }
+    while (len);
+
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zeros_table(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t op[32];
+
+    zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = buf;
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;
+
+    crc0 = crc ^ 0xffffffff;
+
+    // Align to 8 bytes
+    while (len && ((uintptr_t)next & 7))
+    {
+        crc0 = _mm_crc32_u8(crc0, *next);
+        next++;
+        len--;
+    }
+
+    // Three LONG blocks at a time, then three SHORT blocks
+    while (len >= LONG * 3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do
+        {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + LONG));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + 2 * LONG));
+            next += 8;
+        }
+        while (next < end);
+        crc0 = shift(s_long_shift, crc0) ^ crc1;
+        crc0 = shift(s_long_shift, crc0) ^ crc2;
+        next += LONG * 2;
+        len -= LONG * 3;
+    }
+
+    while (len >= SHORT * 3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do
+        {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + SHORT));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + 2 * SHORT));
+            next += 8;
+        }
+        while (next < end);
+        crc0 = shift(s_short_shift, crc0) ^ crc1;
+        crc0 = shift(s_short_shift, crc0) ^ crc2;
+        next += SHORT * 2;
+        len -= SHORT * 3;
+    }
+
+    // Remaining 8 byte words, then bytes
+    end = next + (len - (len & 7));
+    while (next < end)
+    {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+        next += 8;
+    }
+    len &= 7;
+
+    while (len)
+    {
+        crc0 = _mm_crc32_u8(crc0, *next);
+        next++;
+        len--;
+    }
+
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+#endif
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = buf;
+
+    crc = ~crc;
+    while (len--)
+        crc = (crc >> 8) ^ s_table[(crc ^ *next++) & 0xff];
+
+    return ~crc;
+}
+
+static void crc32c_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        s_table[n] = crc;
+    }
+
+#ifdef CRC32C_HAVE_HW
+    zeros_table(s_long_shift, LONG);
+    zeros_table(s_short_shift, SHORT);
+    s_use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&s_init_once, crc32c_init);
+
+#ifdef CRC32C_HAVE_HW
+    if (s_use_hw)
+        return crc32c_hw(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
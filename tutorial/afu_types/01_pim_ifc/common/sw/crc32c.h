@@ -0,0 +1,21 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+//
+// CRC-32C (Castagnoli), as used by iSCSI and ext4. On x86 CPUs with SSE4.2
+// the crc32 instruction is used on three interleaved streams, which runs
+// several times faster than a single stream. Other CPUs use a table.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Extend crc with len bytes of buf. Start with a crc of 0. The result of
+// one call may be passed as crc to the next to checksum a buffer in
+// pieces.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif // __CRC32C_H__
@@ -0,0 +1,119 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "latency_hist.h"
+
+static uint32_t bucket_idx(uint64_t v)
+{
+    if (v < LATENCY_HIST_SUB_BUCKETS) return v;
+
+    // Position of the most significant bit picks the power of two. The
+    // next LATENCY_HIST_SUB_BITS bits pick the linear bucket within it.
+    uint32_t msb = 63 - __builtin_clzll(v);
+    if (msb > LATENCY_HIST_MAX_BITS)
+        return LATENCY_HIST_NUM_BUCKETS - 1;
+
+    uint32_t shift = msb - LATENCY_HIST_SUB_BITS;
+    return ((shift + 1) << LATENCY_HIST_SUB_BITS) +
+           ((v >> shift) & (LATENCY_HIST_SUB_BUCKETS - 1));
+}
+
+// Smallest value that maps to bucket idx
+static uint64_t bucket_low(uint32_t idx)
+{
+    if (idx < LATENCY_HIST_SUB_BUCKETS) return idx;
+
+    uint32_t shift = (idx >> LATENCY_HIST_SUB_BITS) - 1;
+    uint64_t sub = idx & (LATENCY_HIST_SUB_BUCKETS - 1);
+    return (LATENCY_HIST_SUB_BUCKETS + sub) << shift;
+}
+
+// Largest value that maps to bucket idx
+static uint64_t bucket_high(uint32_t idx)
+{
+    if (idx < LATENCY_HIST_SUB_BUCKETS) return idx;
+
+    uint32_t shift = (idx >> LATENCY_HIST_SUB_BITS) - 1;
+    return bucket_low(idx) + (1UL << shift) - 1;
+}
+
+
+void latency_hist_reset(t_latency_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+
+void latency_hist_record(t_latency_hist *h, uint64_t value)
+{
+    h->count += 1;
+    h->sum += value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+    h->buckets[bucket_idx(value)] += 1;
+}
+
+
+uint64_t latency_hist_percentile(const t_latency_hist *h, double pct)
+{
+    if (h->count == 0) return 0;
+
+    uint64_t target = (uint64_t)((pct / 100.0) * h->count + 0.5);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_HIST_NUM_BUCKETS; i += 1)
+    {
+        seen += h->buckets[i];
+        if (seen >= target)
+        {
+            // Report the bucket's upper edge, clipped to the real maximum
+            uint64_t v = bucket_high(i);
+            return (v < h->max) ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+void latency_hist_print(const t_latency_hist *h, const char *name, FILE *f)
+{
+    fprintf(f, "%s latency (ns): count %ld, mean %0.0f, p50 %ld, p99 %ld, p99.9 %ld, max %ld\n",
+            name, h->count,
+            h->count ? (double)h->sum / h->count : 0.0,
+            latency_hist_percentile(h, 50.0),
+            latency_hist_percentile(h, 99.0),
+            latency_hist_percentile(h, 99.9),
+            h->max);
+}
+
+
+void latency_hist_write_json(const t_latency_hist *h, FILE *f)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"count\": %ld,\n", h->count);
+    fprintf(f, "  \"min_ns\": %ld,\n", h->count ? h->min : 0);
+    fprintf(f, "  \"mean_ns\": %0.1f,\n", h->count ? (double)h->sum / h->count : 0.0);
+    fprintf(f, "  \"p50_ns\": %ld,\n", latency_hist_percentile(h, 50.0));
+    fprintf(f, "  \"p90_ns\": %ld,\n", latency_hist_percentile(h, 90.0));
+    fprintf(f, "  \"p99_ns\": %ld,\n", latency_hist_percentile(h, 99.0));
+    fprintf(f, "  \"p999_ns\": %ld,\n", latency_hist_percentile(h, 99.9));
+    fprintf(f, "  \"max_ns\": %ld,\n", h->max);
+
+    // Non-empty buckets as [low, high, count]
+    fprintf(f, "  \"buckets\": [");
+    const char *sep = "";
+    for (uint32_t i = 0; i < LATENCY_HIST_NUM_BUCKETS; i += 1)
+    {
+        if (h->buckets[i] == 0) continue;
+        fprintf(f, "%s\n    [%ld, %ld, %ld]", sep, bucket_low(i), bucket_high(i), h->buckets[i]);
+        sep = ",";
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
@@ -0,0 +1,57 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#ifndef __LATENCY_HIST_H__
+#define __LATENCY_HIST_H__
+
+//
+// Log-linear latency histogram in the style of HdrHistogram. Each power of
+// two is split into LATENCY_HIST_SUB_BUCKETS linear buckets, so recorded
+// values keep about 3% precision from nanoseconds to minutes with a fixed
+// amount of memory and O(1) recording.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_HIST_SUB_BITS 5
+#define LATENCY_HIST_SUB_BUCKETS (1 << LATENCY_HIST_SUB_BITS)
+// Values below 2^(LATENCY_HIST_MAX_BITS + 1) are recorded exactly to their
+// bucket. Larger values are counted in the last bucket.
+#define LATENCY_HIST_MAX_BITS 40
+#define LATENCY_HIST_NUM_BUCKETS \
+    ((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 2) * LATENCY_HIST_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATENCY_HIST_NUM_BUCKETS];
+}
+t_latency_hist;
+
+// Wall clock time in nanoseconds, not subject to NTP adjustment
+static inline uint64_t latency_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void latency_hist_reset(t_latency_hist *h);
+
+void latency_hist_record(t_latency_hist *h, uint64_t value);
+
+// Value at or below which pct percent of the samples fall.
+uint64_t latency_hist_percentile(const t_latency_hist *h, double pct);
+
+// One line summary: count, mean, p50, p99, p99.9 and max.
+void latency_hist_print(const t_latency_hist *h, const char *name, FILE *f);
+
+// Write the summary and the non-empty buckets as a JSON object.
+void latency_hist_write_json(const t_latency_hist *h, FILE *f);
+
+#endif // __LATENCY_HIST_H__
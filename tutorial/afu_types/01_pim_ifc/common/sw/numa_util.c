@@ -0,0 +1,145 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+// sched_setaffinity() and syscall()
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include <opae/fpga.h>
+#include "numa_util.h"
+
+// From linux/mempolicy.h
+#define MPOL_DEFAULT 0
+#define MPOL_BIND    2
+#define MPOL_F_NODE  (1 << 0)
+#define MPOL_F_ADDR  (1 << 1)
+
+#define NUMA_MAX_NODES (16 * 8 * sizeof(unsigned long))
+
+
+// Read a single integer from a sysfs file. Returns -1 on failure.
+static int read_sysfs_int(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (NULL == f) return -1;
+
+    int v;
+    if (1 != fscanf(f, "%d", &v)) v = -1;
+    fclose(f);
+
+    return v;
+}
+
+
+int fpga_numa_node(fpga_handle accel_handle)
+{
+    fpga_properties props;
+    uint16_t segment;
+    uint8_t bus, device, function;
+
+    if (FPGA_OK != fpgaGetPropertiesFromHandle(accel_handle, &props))
+        return -1;
+
+    fpga_result r = fpgaPropertiesGetSegment(props, &segment);
+    if (FPGA_OK == r) r = fpgaPropertiesGetBus(props, &bus);
+    if (FPGA_OK == r) r = fpgaPropertiesGetDevice(props, &device);
+    if (FPGA_OK == r) r = fpgaPropertiesGetFunction(props, &function);
+    fpgaDestroyProperties(&props);
+    if (FPGA_OK != r) return -1;
+
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%d/numa_node",
+             segment, bus, device, function);
+
+    // The kernel reports -1 when the platform doesn't describe the node
+    return read_sysfs_int(path);
+}
+
+
+int numa_num_nodes(void)
+{
+    char path[64];
+    int n = 0;
+
+    while ((size_t)n < NUMA_MAX_NODES)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+        if (access(path, F_OK)) break;
+        n += 1;
+    }
+
+    return n ? n : 1;
+}
+
+
+int numa_bind_thread(int node)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *f = fopen(path, "r");
+    if (NULL == f) return -1;
+
+    // The list is comma separated ranges, e.g. "0-15,32-47"
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int first, last;
+    while (1 == fscanf(f, "%d", &first))
+    {
+        last = first;
+        if (fgetc(f) == '-')
+        {
+            if (1 != fscanf(f, "%d", &last)) break;
+            fgetc(f);
+        }
+        for (int c = first; (c <= last) && (c < CPU_SETSIZE); c += 1)
+            CPU_SET(c, &cpus);
+    }
+    fclose(f);
+
+    if (0 == CPU_COUNT(&cpus)) return -1;
+    return sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+
+int numa_bind_memory(int node, t_numa_policy *saved)
+{
+    if ((node < 0) || ((size_t)node >= NUMA_MAX_NODES)) return -1;
+
+    if (syscall(SYS_get_mempolicy, &saved->mode, saved->mask, NUMA_MAX_NODES,
+                NULL, 0))
+        return -1;
+
+    unsigned long mask[16];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    return syscall(SYS_set_mempolicy, MPOL_BIND, mask, NUMA_MAX_NODES);
+}
+
+
+void numa_restore_policy(const t_numa_policy *saved)
+{
+    if (MPOL_DEFAULT == saved->mode)
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    else
+        syscall(SYS_set_mempolicy, saved->mode, saved->mask, NUMA_MAX_NODES);
+}
+
+
+int numa_node_of_addr(const volatile void *addr)
+{
+    int node;
+
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR))
+        return -1;
+
+    return node;
+}
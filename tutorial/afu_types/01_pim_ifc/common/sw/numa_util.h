@@ -0,0 +1,47 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#ifndef __NUMA_UTIL_H__
+#define __NUMA_UTIL_H__
+
+//
+// NUMA placement helpers. On multi-socket hosts the FPGA is attached to
+// one socket, and host buffers or submitting threads on another socket
+// send every DMA and MMIO access across the inter-socket link. These
+// helpers find the card's node and keep memory and threads on it. They
+// use the kernel interfaces directly, so libnuma is not required.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <opae/fpga.h>
+
+// Saved memory policy of the calling thread
+typedef struct
+{
+    int mode;
+    unsigned long mask[16];
+}
+t_numa_policy;
+
+// NUMA node of the PCIe device behind accel_handle, from sysfs. Returns -1
+// when the node is unknown, as in ASE or on single node hosts.
+int fpga_numa_node(fpga_handle accel_handle);
+
+// Number of NUMA nodes on the host
+int numa_num_nodes(void);
+
+// Restrict the calling thread to the CPUs of node. Returns 0 on success.
+int numa_bind_thread(int node);
+
+// Allocate the calling thread's future memory from node only, saving the
+// previous policy for numa_restore_policy(). Returns 0 on success.
+int numa_bind_memory(int node, t_numa_policy *saved);
+
+void numa_restore_policy(const t_numa_policy *saved);
+
+// Node holding the page at addr, or -1 if it is unknown
+int numa_node_of_addr(const volatile void *addr);
+
+#endif // __NUMA_UTIL_H__
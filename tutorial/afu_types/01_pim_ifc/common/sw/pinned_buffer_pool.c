@@ -0,0 +1,254 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "pinned_buffer_pool.h"
+#include "numa_util.h"
+
+typedef struct t_free_buf
+{
+    t_pinned_buffer buf;
+    struct t_free_buf *next;
+}
+t_free_buf;
+
+struct pinned_buffer_pool
+{
+    fpga_handle accel_handle;
+    pthread_mutex_t lock;
+
+    // Node new buffers are allocated from, -1 for the default policy
+    int numa_node;
+
+    t_free_buf *free_list[PINNED_BUF_NUM_CLASSES];
+    uint32_t num_free[PINNED_BUF_NUM_CLASSES];
+
+    t_pinned_buffer_pool_stats stats;
+};
+
+static const uint64_t s_class_size[PINNED_BUF_NUM_CLASSES] =
+{
+    4096,
+    2 * 1024 * 1024,
+    1024 * 1024 * 1024
+};
+
+// Number of released buffers cached per class. Beyond this, released
+// buffers are unpinned to bound the amount of locked memory.
+static const uint32_t s_class_max_free[PINNED_BUF_NUM_CLASSES] =
+{
+    256,
+    64,
+    4
+};
+
+
+static int size_class(uint64_t size)
+{
+    for (int c = 0; c < PINNED_BUF_NUM_CLASSES; c += 1)
+    {
+        if (size <= s_class_size[c]) return c;
+    }
+
+    return -1;
+}
+
+
+t_pinned_buffer_pool* pinned_buffer_pool_create(fpga_handle accel_handle)
+{
+    t_pinned_buffer_pool *pool = calloc(1, sizeof(t_pinned_buffer_pool));
+    if (NULL == pool) return NULL;
+
+    pool->accel_handle = accel_handle;
+    pool->numa_node = -1;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+
+void pinned_buffer_pool_set_numa_node(t_pinned_buffer_pool *pool, int node)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->numa_node = node;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void pinned_buffer_pool_destroy(t_pinned_buffer_pool *pool)
+{
+    if (NULL == pool) return;
+
+    if (pool->stats.in_use_bytes)
+    {
+        fprintf(stderr, "Pinned buffer pool destroyed with %ld bytes in use!\n",
+                pool->stats.in_use_bytes);
+    }
+
+    for (int c = 0; c < PINNED_BUF_NUM_CLASSES; c += 1)
+    {
+        t_free_buf *f = pool->free_list[c];
+        while (f)
+        {
+            t_free_buf *next = f->next;
+            fpgaReleaseBuffer(pool->accel_handle, f->buf.wsid);
+            free(f);
+            f = next;
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+
+int pinned_buffer_acquire(t_pinned_buffer_pool *pool,
+                          uint64_t size,
+                          t_pinned_buffer *buf)
+{
+    int c = size_class(size);
+    if (c < 0) return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.acquires += 1;
+
+    t_free_buf *f = pool->free_list[c];
+    if (f)
+    {
+        pool->free_list[c] = f->next;
+        pool->num_free[c] -= 1;
+        pool->stats.hits += 1;
+        pool->stats.in_use_bytes += s_class_size[c];
+        pthread_mutex_unlock(&pool->lock);
+
+        *buf = f->buf;
+        free(f);
+        return 0;
+    }
+
+    pool->stats.misses += 1;
+    const int node = pool->numa_node;
+    pthread_mutex_unlock(&pool->lock);
+
+    // Pin outside the lock. fpgaPrepareBuffer() picks huge pages when
+    // the size is 2MB or 1GB. It allocates and faults in the pages itself,
+    // so placement is controlled with the thread's memory policy rather
+    // than by binding an existing range.
+    fpga_result r;
+    void *ptr;
+    t_numa_policy saved_policy;
+    const bool bound = (node >= 0) && !numa_bind_memory(node, &saved_policy);
+    r = fpgaPrepareBuffer(pool->accel_handle, s_class_size[c], &ptr, &buf->wsid, 0);
+    if (bound)
+    {
+        numa_restore_policy(&saved_policy);
+
+        // The node may be out of huge pages. A remote buffer is better
+        // than none.
+        if (FPGA_OK != r)
+            r = fpgaPrepareBuffer(pool->accel_handle, s_class_size[c], &ptr,
+                                  &buf->wsid, 0);
+    }
+    if (FPGA_OK == r)
+    {
+        r = fpgaGetIOAddress(pool->accel_handle, buf->wsid, &buf->pa);
+        if (FPGA_OK != r) fpgaReleaseBuffer(pool->accel_handle, buf->wsid);
+    }
+    const int placed_node = ((FPGA_OK == r) && (node >= 0)) ? numa_node_of_addr(ptr) : -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (FPGA_OK != r)
+    {
+        pool->stats.failures += 1;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    if (node >= 0)
+    {
+        if (placed_node == node)
+            pool->stats.numa_local_bytes += s_class_size[c];
+        else
+            pool->stats.numa_remote_bytes += s_class_size[c];
+    }
+
+    pool->stats.pinned_bytes += s_class_size[c];
+    if (pool->stats.pinned_bytes > pool->stats.peak_pinned_bytes)
+        pool->stats.peak_pinned_bytes = pool->stats.pinned_bytes;
+    pool->stats.in_use_bytes += s_class_size[c];
+    pthread_mutex_unlock(&pool->lock);
+
+    buf->ptr = ptr;
+    buf->size = s_class_size[c];
+    return 0;
+}
+
+
+void pinned_buffer_release(t_pinned_buffer_pool *pool,
+                           const t_pinned_buffer *buf)
+{
+    int c = size_class(buf->size);
+    assert(c >= 0);
+
+    t_free_buf *f = malloc(sizeof(t_free_buf));
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.in_use_bytes -= s_class_size[c];
+
+    if (f && (pool->num_free[c] < s_class_max_free[c]))
+    {
+        f->buf = *buf;
+        f->buf.size = s_class_size[c];
+        f->next = pool->free_list[c];
+        pool->free_list[c] = f;
+        pool->num_free[c] += 1;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    pool->stats.pinned_bytes -= s_class_size[c];
+    pthread_mutex_unlock(&pool->lock);
+
+    free(f);
+    fpgaReleaseBuffer(pool->accel_handle, buf->wsid);
+}
+
+
+void pinned_buffer_pool_get_stats(t_pinned_buffer_pool *pool,
+                                  t_pinned_buffer_pool_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void pinned_buffer_pool_print_stats(t_pinned_buffer_pool *pool, FILE *f)
+{
+    t_pinned_buffer_pool_stats stats;
+    pinned_buffer_pool_get_stats(pool, &stats);
+
+    fprintf(f, "Pinned buffer pool:\n");
+    fprintf(f, "  Acquires: %ld (hit rate %0.1f%%)\n", stats.acquires,
+            stats.acquires ? (100.0 * stats.hits) / stats.acquires : 0.0);
+    fprintf(f, "  Allocation failures: %ld\n", stats.failures);
+    fprintf(f, "  Pinned bytes: %ld (peak %ld)\n",
+            stats.pinned_bytes, stats.peak_pinned_bytes);
+
+    pthread_mutex_lock(&pool->lock);
+    const int node = pool->numa_node;
+    pthread_mutex_unlock(&pool->lock);
+    if (node >= 0)
+    {
+        fprintf(f, "  NUMA node %d: %ld bytes pinned locally, %ld remote\n",
+                node, stats.numa_local_bytes, stats.numa_remote_bytes);
+    }
+}
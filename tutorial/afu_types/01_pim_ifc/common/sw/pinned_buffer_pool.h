@@ -0,0 +1,84 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#ifndef __PINNED_BUFFER_POOL_H__
+#define __PINNED_BUFFER_POOL_H__
+
+//
+// Pool of host buffers that are pinned and mapped for FPGA access. Pinning
+// and IOMMU mapping are expensive compared to small transfers, so released
+// buffers are kept mapped, along with their IOVAs, and handed out again.
+// Buffers come in three size classes: a 4KB page, a 2MB huge page and a
+// 1GB huge page. Acquire and release are thread safe.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <opae/fpga.h>
+
+typedef struct
+{
+    volatile char *ptr;
+    uint64_t wsid;
+    uint64_t pa;
+    // Size of the pinned buffer (its size class), not of the request
+    uint64_t size;
+}
+t_pinned_buffer;
+
+typedef enum
+{
+    PINNED_BUF_4KB = 0,
+    PINNED_BUF_2MB,
+    PINNED_BUF_1GB,
+    PINNED_BUF_NUM_CLASSES
+}
+e_pinned_buf_class;
+
+typedef struct
+{
+    uint64_t acquires;
+    // Acquires satisfied from the free lists without pinning
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t failures;
+    // Bytes currently pinned, both in use and cached
+    uint64_t pinned_bytes;
+    uint64_t peak_pinned_bytes;
+    uint64_t in_use_bytes;
+    // Bytes pinned, over the life of the pool, on the pool's NUMA node and
+    // elsewhere. Remote buffers send every DMA across sockets.
+    uint64_t numa_local_bytes;
+    uint64_t numa_remote_bytes;
+}
+t_pinned_buffer_pool_stats;
+
+typedef struct pinned_buffer_pool t_pinned_buffer_pool;
+
+t_pinned_buffer_pool* pinned_buffer_pool_create(fpga_handle accel_handle);
+
+// Allocate buffers pinned from now on from NUMA node, normally the node of
+// the FPGA. -1 restores the default policy. Cached buffers are not moved.
+void pinned_buffer_pool_set_numa_node(t_pinned_buffer_pool *pool, int node);
+
+// Release every cached buffer and free the pool. All buffers must have
+// been returned.
+void pinned_buffer_pool_destroy(t_pinned_buffer_pool *pool);
+
+// Get a pinned buffer of at least size bytes. Returns 0 on success.
+int pinned_buffer_acquire(t_pinned_buffer_pool *pool,
+                          uint64_t size,
+                          t_pinned_buffer *buf);
+
+// Return a buffer to the pool. It stays pinned for reuse unless the free
+// list for its size class is full. buf->size may be either the size class
+// or the size originally requested.
+void pinned_buffer_release(t_pinned_buffer_pool *pool,
+                           const t_pinned_buffer *buf);
+
+void pinned_buffer_pool_get_stats(t_pinned_buffer_pool *pool,
+                                  t_pinned_buffer_pool_stats *stats);
+
+void pinned_buffer_pool_print_stats(t_pinned_buffer_pool *pool, FILE *f);
+
+#endif // __PINNED_BUFFER_POOL_H__
@@ -1,177 +1,283 @@
 // Copyright (C) 2022 Intel Corporation
 // SPDX-License-Identifier: MIT
 
+//
+// Host driver for the copy engine: opening an engine, its buffers, and
+// runs that set the command parameters and completion method.
+//
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <assert.h>
 #include <poll.h>
 #include <pthread.h>
 
 #include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+#include "pinned_buffer_pool.h"
+#include "numa_util.h"
 
-typedef struct
-{
-    volatile char *ptr;
-    uint64_t wsid;
-    uint64_t pa;
-}
-t_pinned_buffer;
+// Default benchmark run length. Shorter runs for ASE.
+#define TOTAL_COPY_COMMANDS(is_ase_sim) ((is_ase_sim) ? 1500L : 1000000L)
 
-static fpga_handle s_accel_handle;
-static bool s_is_ase_sim;
-static volatile uint64_t *s_mmio_buf;
 
-// Shorter runs for ASE
-#define TOTAL_COPY_COMMANDS (s_is_ase_sim ? 1500L : 1000000L)
-
-//
-// Allocate a buffer in I/O memory, shared with the FPGA.
-//
-static volatile void* alloc_buffer(fpga_handle accel_handle,
-                                   ssize_t size,
-                                   uint64_t *wsid,
-                                   uint64_t *io_addr)
+t_ce_dev *ce_dev_open(fpga_handle accel_handle, bool is_ase_sim,
+                      bool csr_model)
 {
-    fpga_result r;
-    volatile void* buf;
+    t_ce_dev *dev = calloc(1, sizeof(t_ce_dev));
+    if (NULL == dev) return NULL;
 
-    r = fpgaPrepareBuffer(accel_handle, size, (void*)&buf, wsid, 0);
-    if (FPGA_OK != r) return NULL;
+    dev->accel_handle = accel_handle;
+    dev->is_ase_sim = is_ase_sim;
+    dev->csr_model = csr_model;
+    dev->numa_node = -1;
+    atomic_init(&dev->busy, false);
+    pthread_mutex_init(&dev->copy_lock, NULL);
 
-    // Get the physical address of the buffer in the accelerator
-    r = fpgaGetIOAddress(accel_handle, *wsid, io_addr);
-    assert(FPGA_OK == r);
-
-    return buf;
-}
-
-
-//
-// Allocate a group of pinned buffers that will be used round-robin in
-// the command loop.
-//
-static t_pinned_buffer* alloc_buffer_group(fpga_handle accel_handle,
-                                           ssize_t size,
-                                           uint32_t num_bufs)
-{
-    t_pinned_buffer *bufs;
-    bufs = malloc(sizeof(t_pinned_buffer) * num_bufs);
-    assert(NULL != bufs);
+    if (csr_model)
+    {
+        dev->model = ce_model_create();
+        if (NULL == dev->model)
+        {
+            ce_dev_close(dev);
+            return NULL;
+        }
+    }
+    else if (!is_ase_sim)
+    {
+        // Get a pointer to the MMIO buffer for direct access. The OPAE
+        // functions will be used with ASE since true MMIO isn't detected
+        // by the SW simulator.
+        uint64_t *tmp_ptr;
+        if (FPGA_OK != fpgaMapMMIO(accel_handle, 0, &tmp_ptr))
+        {
+            fprintf(stderr, "Unable to map the copy engine CSRs\n");
+            ce_dev_close(dev);
+            return NULL;
+        }
+        dev->mmio_buf = tmp_ptr;
+    }
 
-    for (uint32_t i = 0; i < num_bufs; i += 1)
+    // Get AFU info
+    uint64_t v = readMMIO64(dev, 5);
+    dev->clock_mhz = v & 0xffff;
+    dev->data_bus_num_bytes = (v >> 16) & 0xff;
+    dev->num_interrupt_ids = (v >> 24) & 0xff;
+    dev->max_avail_reqs_in_flight = (v >> 32) & 0xffff;
+    dev->max_burst_len = (v >> 48) & 0xffff;
+
+    if (!csr_model)
     {
-        // Allocate a single page memory buffer
-        bufs[i].ptr = (volatile char*)alloc_buffer(accel_handle, size,
-                                                   &bufs[i].wsid, &bufs[i].pa);
-        if (NULL == bufs[i].ptr)
+        dev->buf_pool = pinned_buffer_pool_create(accel_handle);
+        if (NULL == dev->buf_pool)
         {
-            fprintf(stderr, "Pinned buffer allocation failed!\n");
-            free(bufs);
+            ce_dev_close(dev);
             return NULL;
         }
 
-        bufs[i].ptr[0] = 0;
+        // Allocate buffers from the FPGA's NUMA node
+        dev->numa_node = is_ase_sim ? -1 : fpga_numa_node(accel_handle);
+        if (dev->numa_node >= 0)
+            pinned_buffer_pool_set_numa_node(dev->buf_pool, dev->numa_node);
     }
 
-    return bufs;
+    return dev;
 }
 
 
-static void free_buffer_group(fpga_handle accel_handle,
-                              uint32_t num_bufs,
-                              t_pinned_buffer* bufs)
+void ce_dev_close(t_ce_dev *dev)
 {
+    if (NULL == dev) return;
 
-    for (uint32_t i = 0; i < num_bufs; i += 1)
+    ce_copy_release(dev);
+    ce_stream_release(dev);
+
+    if (dev->buf_pool)
     {
-        fpgaReleaseBuffer(accel_handle, bufs[i].wsid);
+        if (!dev->quiet) pinned_buffer_pool_print_stats(dev->buf_pool, stdout);
+        pinned_buffer_pool_destroy(dev->buf_pool);
     }
+    if (dev->mmio_buf) fpgaUnmapMMIO(dev->accel_handle, 0);
+    ce_model_destroy(dev->model);
+    pthread_mutex_destroy(&dev->copy_lock);
+    free(dev);
+}
 
-    free(bufs);
+
+void ce_dev_set_quiet(t_ce_dev *dev, bool quiet)
+{
+    dev->quiet = quiet;
 }
 
 
-//
-// Read a 64 bit CSR. When a pointer to CSR buffer is available, read directly.
-// Direct reads can be significantly faster.
-//
-static inline uint64_t readMMIO64(uint32_t idx)
+int ce_dev_numa_node(const t_ce_dev *dev)
 {
-    if (s_mmio_buf)
+    return dev->numa_node;
+}
+
+
+int ce_buffer_acquire(t_ce_dev *dev, uint64_t size, t_pinned_buffer *buf)
+{
+    if (dev->csr_model)
     {
-        return s_mmio_buf[idx];
+        // The model takes host virtual addresses as IOVAs
+        void *ptr;
+        memset(buf, 0, sizeof(*buf));
+        if (posix_memalign(&ptr, sysconf(_SC_PAGESIZE), size))
+            return -1;
+        buf->ptr = ptr;
+        buf->pa = (uint64_t)(uintptr_t)ptr;
+        buf->size = size;
+        return 0;
     }
+
+    return pinned_buffer_acquire(dev->buf_pool, size, buf);
+}
+
+
+void ce_buffer_release(t_ce_dev *dev, const t_pinned_buffer *buf)
+{
+    if (dev->csr_model)
+        free((void*)buf->ptr);
     else
-    {
-        fpga_result r;
-        uint64_t v;
-        r = fpgaReadMMIO64(s_accel_handle, 0, 8 * idx, &v);
-        assert(FPGA_OK == r);
-        return v;
-    }
+        pinned_buffer_release(dev->buf_pool, buf);
 }
 
 
 //
-// Write a 64 bit CSR. When a pointer to CSR buffer is available, write directly.
+// Allocate a group of buffers that will be used round-robin in the
+// command loop. The group is carved from a single pinned buffer, so
+// it takes one huge page instead of a page per entry.
 //
-static inline void writeMMIO64(uint32_t idx, uint64_t v)
+static t_pinned_buffer* alloc_buffer_group(t_ce_dev *dev,
+                                           uint64_t size,
+                                           uint32_t num_bufs,
+                                           t_pinned_buffer *mem)
 {
-    if (s_mmio_buf)
+    if (ce_buffer_acquire(dev, size * num_bufs, mem))
     {
-        s_mmio_buf[idx] = v;
+        fprintf(stderr, "Pinned buffer allocation failed!\n");
+        return NULL;
     }
-    else
+
+    t_pinned_buffer *bufs;
+    bufs = calloc(num_bufs, sizeof(t_pinned_buffer));
+    assert(NULL != bufs);
+
+    for (uint32_t i = 0; i < num_bufs; i += 1)
+    {
+        bufs[i].ptr = mem->ptr + i * size;
+        bufs[i].wsid = mem->wsid;
+        bufs[i].pa = mem->pa + i * size;
+        bufs[i].size = size;
+        bufs[i].ptr[0] = 0;
+    }
+
+    return bufs;
+}
+
+
+static void free_buffer_group(t_ce_dev *dev,
+                              t_pinned_buffer* bufs,
+                              t_pinned_buffer *mem)
+{
+    ce_buffer_release(dev, mem);
+    free(bufs);
+}
+
+
+int ce_run_alloc_bufs(t_ce_run *run)
+{
+    run->num_bufs = 32;
+    run->src_bufs = alloc_buffer_group(run->dev, run->chunk_size,
+                                       run->num_bufs, &run->src_mem);
+    if (NULL == run->src_bufs) return -1;
+    run->dst_bufs = alloc_buffer_group(run->dev, run->chunk_size,
+                                       run->num_bufs, &run->dst_mem);
+    if (NULL == run->dst_bufs)
     {
-        fpgaWriteMMIO64(s_accel_handle, 0, 8 * idx, v);
+        free_buffer_group(run->dev, run->src_bufs, &run->src_mem);
+        run->src_bufs = NULL;
+        return -1;
     }
+
+    return 0;
 }
 
 
-static fpga_event_handle intr_handle;
+// Poll timeout for interrupts, after which the thread assumes one may have
+// been lost and reconciles with the line counters
+#define CE_INTR_TIMEOUT_MS 10
 
 //
 // Thread created by pthread to handle interrupts and update the credit count.
 //
+// Each interrupt only wakes the thread. The count of commands processed,
+// published in status_line[0], comes from the engine's lines-written counter
+// (register 7), so credits reflect everything the engine has done, not just
+// the commands that requested a completion. Counts above 1 from the eventfd,
+// where interrupts were merged, are accepted. The count of interrupts
+// received goes in status_line[1].
+//
 static void* intr_wait_thread(void *args)
 {
-    fpga_result result;
-
-    volatile uint64_t *num_intrs_rcvd = args;
-
-    int fd;
-    result = fpgaGetOSObjectFromEventHandle(intr_handle, &fd);
-    assert(FPGA_OK == result);
+    const t_ce_run *run = args;
+    const t_ce_dev *dev = run->dev;
+    volatile uint64_t *status_line = run->status_line;
+    const uint64_t lines_per_cmd = run->chunk_size / run->data_bus_num_bytes;
+    const uint64_t base_lines = run->base_wr_lines;
+    const uint64_t base_cmds = run->cpl_base[0];
+    const int fd = run->intr_fd;
 
     while (true)
     {
-        uint64_t count;
-        ssize_t bytes_read = read(fd, &count, sizeof(count));
-        if (bytes_read <= 0)
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int n = poll(&pfd, 1, CE_INTR_TIMEOUT_MS);
+        if ((n < 0) && (errno != EINTR))
         {
-            fprintf(stderr, "read error: %s\n",
-                    (bytes_read < 0 ? strerror(errno) : "zero bytes read"));
+            fprintf(stderr, "poll error: %s\n", strerror(errno));
             pthread_exit((void*)1);
         }
 
-        // Count should be 1. The AFU is expected to wait for the MMIO write
-        // to register 12 below before sending another interrupt. PCIe does
-        // not guarantee to deliver all interrupts unless each one is
-        // acknowledged by software. (See PCIe spec. 6.1.4.6)
-        // You could, in theory, modify the AFU and protocol here to
-        // handle missed delivery of interrupts, though using a host memory
-        // location to signal completion remains a faster option than
-        // interrupts.
-        if (count != 1)
+        uint64_t count = 0;
+        if (n > 0)
         {
-            fprintf(stderr, "count error: %ld\n", count);
-            pthread_exit((void*)1);
+            ssize_t bytes_read = read(fd, &count, sizeof(count));
+            if (bytes_read <= 0)
+            {
+                fprintf(stderr, "read error: %s\n",
+                        (bytes_read < 0 ? strerror(errno) : "zero bytes read"));
+                pthread_exit((void*)1);
+            }
         }
 
-        *num_intrs_rcvd += 1;
-        writeMMIO64(12, 0);
+        // The AFU waits for the MMIO write to register 12 before sending
+        // another interrupt, since PCIe does not guarantee to deliver all
+        // interrupts unless each one is acknowledged by software. (See PCIe
+        // spec. 6.1.4.6) The ACK is a flag, so one write covers any number
+        // of merged interrupts. It is also written after a timeout: if an
+        // interrupt was lost, the AFU would otherwise wait forever for its
+        // ACK. An ACK with no interrupt outstanding is harmless. ACK before
+        // reading the counters so the next interrupt is already on its way.
+        if ((count != 0) || (n == 0))
+            writeMMIO64(dev, 12, 0);
+
+        status_line[1] += count;
+
+        // Reconcile with the lines the engine has written. Write data
+        // leaves the engine before it commits, which is enough to free the
+        // command's slot.
+        const uint64_t cmds = base_cmds +
+                              (readMMIO64(dev, 7) - base_lines) / lines_per_cmd;
+        if (cmds > status_line[0]) status_line[0] = cmds;
+
+        ce_wait_wake(run);
     }
 
     // Success
@@ -179,48 +285,21 @@ static void* intr_wait_thread(void *args)
 }
 
 
-int copy_engine(
-    fpga_handle accel_handle, bool is_ase_sim,
-    uint32_t chunk_size,
-    uint32_t completion_freq,
-    bool use_interrupts,
-    uint32_t max_reqs_in_flight)
+int ce_run_open(t_ce_dev *dev,
+                uint32_t chunk_size,
+                uint32_t completion_freq,
+                bool use_interrupts,
+                uint32_t max_reqs_in_flight,
+                t_ce_run *run)
 {
     fpga_result r;
-    pthread_t intr_thread = 0;
-
-    s_accel_handle = accel_handle;
-    s_is_ase_sim = is_ase_sim;
 
-    // Get a pointer to the MMIO buffer for direct access. The OPAE functions will
-    // be used with ASE since true MMIO isn't detected by the SW simulator.
-    if (is_ase_sim)
-    {
-        s_mmio_buf = NULL;
-    }
-    else
-    {
-        uint64_t *tmp_ptr;
-        r = fpgaMapMMIO(accel_handle, 0, &tmp_ptr);
-        assert(FPGA_OK == r);
-        s_mmio_buf = tmp_ptr;
-    }
+    const uint32_t data_bus_num_bytes = dev->data_bus_num_bytes;
+    const uint32_t max_avail_reqs_in_flight = dev->max_avail_reqs_in_flight;
+    const uint32_t max_burst_len = dev->max_burst_len;
 
-    // Get AFU info
-    uint64_t v = readMMIO64(5);
-    const uint32_t clock_mhz = v & 0xffff;
-    const uint32_t data_bus_num_bytes = (v >> 16) & 0xff;
-    const uint32_t num_interrupt_ids = (v >> 24) & 0xff;
-    const uint32_t max_avail_reqs_in_flight = (v >> 32) & 0xffff;
-    const uint32_t max_burst_len = (v >> 48) & 0xffff;
-
-    printf("AFU properties:\n");
-    printf("  Clock MHz: %d\n", clock_mhz);
-    printf("  Data bus number of bytes: %d\n", data_bus_num_bytes);
-    printf("  Number of interrupt IDs available: %d\n", num_interrupt_ids);
-    printf("  Maximum burst length: %d\n", max_burst_len);
-    printf("  Maximum allowed requests in flight: %d\n", max_avail_reqs_in_flight);
-    printf("\n");
+    // Zero picks the largest burst
+    if (chunk_size == 0) chunk_size = max_burst_len * data_bus_num_bytes;
 
     uint32_t rounded_chunk_size = (chunk_size + data_bus_num_bytes - 1) &
                                   ~(data_bus_num_bytes - 1);
@@ -228,12 +307,8 @@ int copy_engine(
     {
         rounded_chunk_size = max_burst_len * data_bus_num_bytes;
     }
-    if (rounded_chunk_size != chunk_size)
-    {
-        printf("Aligned requested chunk size to bus: %d -> %d\n",
-               chunk_size, rounded_chunk_size);
-        chunk_size = rounded_chunk_size;
-    }
+    const uint32_t requested_chunk_size = chunk_size;
+    chunk_size = rounded_chunk_size;
 
     if ((max_reqs_in_flight == 0) || (max_reqs_in_flight > max_avail_reqs_in_flight))
         max_reqs_in_flight = max_avail_reqs_in_flight;
@@ -262,177 +337,183 @@ int copy_engine(
         return -1;
     }
 
+    // Registers 8 to 13 belong to one run at a time
+    if (atomic_exchange(&dev->busy, true))
+    {
+        fprintf(stderr, "Copy engine is already in use\n");
+        return -1;
+    }
 
-    printf("Test parameters:\n");
-    printf("  Chunk size (bytes per read or write request): %d\n", chunk_size);
-    printf("  Completion frequency (commands between completions): %d\n", completion_freq);
-    printf("  Use interrupts: %s\n", use_interrupts ? "Yes" : "No");
-    printf("  Maximum requests in flight: %d\n", max_reqs_in_flight);
-    printf("\n");
-
-
-    t_pinned_buffer *src_bufs;
-    t_pinned_buffer *dst_bufs;
-    const uint32_t num_bufs = 32;
-
-    // Use 4KB buffers as long as they are large enough for each copy command.
-    // When copies are longer than 4KB, request 2MB pages instead. Of course
-    // this algorithm could be improved and is wasting most of the 2MB pages,
-    // but it works for an example. Runs will fail if 2MB huge pages aren't
-    // available.
-    ssize_t buf_size = sysconf(_SC_PAGESIZE);
-    if (chunk_size > buf_size) buf_size *= 512;
+    memset(run, 0, sizeof(*run));
+    run->dev = dev;
+    run->progress = aligned_alloc(64, 64 * ((sizeof(t_ce_progress) + 63) / 64));
+    assert(NULL != run->progress);
+    memset(run->progress, 0, sizeof(t_ce_progress));
 
-    src_bufs = alloc_buffer_group(accel_handle, buf_size, num_bufs);
-    if (NULL == src_bufs) return -1;
-    dst_bufs = alloc_buffer_group(accel_handle, buf_size, num_bufs);
-    if (NULL == dst_bufs) {
-        free_buffer_group(accel_handle, num_bufs, src_bufs);
-        return -1;
+    if (dev->csr_model)
+    {
+        if (!dev->quiet) printf("Running on the host memory model of the CSRs\n\n");
+        ce_model_reset(dev->model);
     }
 
+    if (!dev->quiet)
+    {
+        printf("AFU properties:\n");
+        printf("  Clock MHz: %d\n", dev->clock_mhz);
+        printf("  Data bus number of bytes: %d\n", data_bus_num_bytes);
+        printf("  Number of interrupt IDs available: %d\n", dev->num_interrupt_ids);
+        printf("  Maximum burst length: %d\n", max_burst_len);
+        printf("  Maximum allowed requests in flight: %d\n", max_avail_reqs_in_flight);
+        printf("\n");
+
+        if (requested_chunk_size != chunk_size)
+            printf("Aligned requested chunk size to bus: %d -> %d\n",
+                   requested_chunk_size, chunk_size);
+
+        printf("Test parameters:\n");
+        printf("  Chunk size (bytes per read or write request): %d\n", chunk_size);
+        printf("  Completion frequency (commands between completions): %d\n", completion_freq);
+        printf("  Use interrupts: %s\n", use_interrupts ? "Yes" : "No");
+        printf("  Maximum requests in flight: %d\n", max_reqs_in_flight);
+        printf("\n");
+    }
 
-    volatile uint64_t *status_line;
-    uint64_t status_wsid = 0;
-    uint64_t status_line_pa = 0;
+    run->clock_mhz = dev->clock_mhz;
+    run->data_bus_num_bytes = data_bus_num_bytes;
+    run->num_interrupt_ids = dev->num_interrupt_ids;
+    run->max_avail_reqs_in_flight = max_avail_reqs_in_flight;
+    run->max_burst_len = max_burst_len;
+
+    run->chunk_size = chunk_size;
+    run->completion_freq = completion_freq;
+    run->max_reqs_in_flight = max_reqs_in_flight;
+    run->use_interrupts = use_interrupts;
+    run->wait_policy = CE_WAIT_SPIN;
+    run->num_cmds = TOTAL_COPY_COMMANDS(dev->is_ase_sim);
+
+    // The line counters and the completion count are never reset.
+    // Measure the run from their current values.
+    run->base_rd_lines = readMMIO64(dev, 6);
+    run->base_wr_lines = readMMIO64(dev, 7);
+    run->cpl_base[0] = dev->cmds_issued;
+
+    if ((dev->numa_node >= 0) && !dev->quiet)
+        printf("  FPGA NUMA node: %d\n", dev->numa_node);
+
+    if (use_interrupts || dev->csr_model)
+    {
+        run->host_status = aligned_alloc(64, 64 * ((sizeof(t_ce_host_status) + 63) / 64));
+        assert(NULL != run->host_status);
+        memset(run->host_status, 0, sizeof(t_ce_host_status));
+    }
 
     if (use_interrupts)
     {
         // Interrupt mode. The status line is managed in the intr_wait_thread.
-        static uint64_t local_status_line;
-        status_line = &local_status_line;
+        run->status_line = run->host_status->status_line;
+        run->status_line[0] = run->cpl_base[0];
 
-        // Allocate a handle
-        r = fpgaCreateEventHandle(&intr_handle);
-        assert(FPGA_OK == r);
+        // Sleeping waiters are woken by the interrupt thread
+        t_ce_cpl_wake *cpl_wake = &run->host_status->cpl_wake;
+        atomic_init(&cpl_wake->seq, 0);
+        atomic_init(&cpl_wake->num_sleepers, 0);
+        run->cpl_wake = cpl_wake;
 
-        // Register user interrupt with event handle
-        r = fpgaRegisterEvent(accel_handle, FPGA_EVENT_INTERRUPT, intr_handle, 0);
-        assert(FPGA_OK == r);
+        if (dev->csr_model)
+        {
+            run->intr_fd = ce_model_intr_fd(dev->model);
+            assert(run->intr_fd >= 0);
+            // Interrupts, not status line writes
+            writeMMIO64(dev, 13, 0);
+        }
+        else
+        {
+            // Allocate a handle
+            r = fpgaCreateEventHandle(&run->intr_handle);
+            assert(FPGA_OK == r);
+
+            // Register user interrupt with event handle
+            r = fpgaRegisterEvent(dev->accel_handle, FPGA_EVENT_INTERRUPT,
+                                  run->intr_handle, 0);
+            assert(FPGA_OK == r);
+
+            r = fpgaGetOSObjectFromEventHandle(run->intr_handle, &run->intr_fd);
+            assert(FPGA_OK == r);
+        }
 
         // An external thread will wait for interrupts and update the
         // count of committed commands in status_line[0].
-        pthread_create(&intr_thread, NULL, &intr_wait_thread, (void*)status_line);
+        pthread_create(&run->intr_thread, NULL, &intr_wait_thread, run);
+    }
+    else if (dev->csr_model)
+    {
+        // The model writes completions through the status line pointer
+        run->status_line = run->host_status->status_line;
+        run->status_line[0] = run->cpl_base[0];
+        writeMMIO64(dev, 13, (uint64_t)(uintptr_t)run->status_line | 1);
     }
     else
     {
         // No interrupts. The status line will be written only by the FPGA.
-        status_line = (volatile uint64_t*)alloc_buffer(accel_handle, sysconf(_SC_PAGESIZE),
-                                                       &status_wsid, &status_line_pa);
-        assert(NULL != status_line);
+        int alloc_status = ce_buffer_acquire(dev, sysconf(_SC_PAGESIZE),
+                                             &run->status_buf);
+        assert(0 == alloc_status);
+        run->status_line = (volatile uint64_t*)run->status_buf.ptr;
 
-        status_line[0] = 0;
+        run->status_line[0] = run->cpl_base[0];
         // Set the completion status line address in the AFU. This tells it
         // to use host memory writes for completion notification instead of
         // interrupts.
-        writeMMIO64(13, status_line_pa | 1);
+        writeMMIO64(dev, 13, run->status_buf.pa | 1);
     }
 
 
     // AXI-MM request length: number of bus-width beats minus 1
     const uint64_t burst_len = (chunk_size / data_bus_num_bytes) - 1;
     // Set the length by writing CSRs
-    writeMMIO64(8, burst_len);
-    writeMMIO64(10, burst_len);
-
-    // Required credit to send a new request. When interrupts are not used, the
-    // status line updates are always the total number of commands processed,
-    // independent of the frequency with which status updates are written.
-    uint64_t required_credit = max_reqs_in_flight;
-    if (use_interrupts)
-    {
-        // When interrupts are used, status_line[0] is the count of interrupts
-        // and not the count of commands processed. Both values here are
-        // guaranteed to be powers of 2.
-        required_credit = max_reqs_in_flight / completion_freq;
-    }
-
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-
-
-    // ====================================================================
-    //
-    // Primary command loop
-    //
-    // ====================================================================
-
-    uint64_t credits_used = 0;
-    for (uint64_t i = 0; i < TOTAL_COPY_COMMANDS; i += 1)
-    {
-        // Wait until the credit threshold says more commands can be written.
-        // The status line will be updated either by writes from the FPGA or,
-        // in interrupt mode, by intr_wait_thread() above.
-        while ((credits_used - status_line[0]) >= required_credit) {};
-
-        // Read command. Writing the address triggers the read.
-        uint32_t buf_idx = i & (num_bufs - 1);
-        writeMMIO64(9, src_bufs[buf_idx].pa);
-
-        // Bit 0 of the write command indicates whether to generate a
-        // completion (interrupt or status line write).
-        uint32_t need_cpl = (i & (completion_freq-1)) == (completion_freq-1);
-        // A completion is always required on the last command.
-        if (i == TOTAL_COPY_COMMANDS-1) need_cpl = 1;
-        writeMMIO64(11, dst_bufs[buf_idx].pa | need_cpl);
-
-        if (use_interrupts)
-            // For interrupts, each command requesting an interrupt consumes a credit
-            credits_used += need_cpl;
-        else
-            // For status line credit updates, each command consumes a credit
-            credits_used += 1;
-    }
+    writeMMIO64(dev, 8, burst_len);
+    writeMMIO64(dev, 10, burst_len);
 
+    return 0;
+}
 
-    // Wait for the last command to finish
-    while (credits_used != status_line[0]) {};
 
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    double total_sec = end_time.tv_sec - start_time.tv_sec +
-                       1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+void ce_run_close(t_ce_run *run)
+{
+    fpga_result r;
+    t_ce_dev *dev = run->dev;
 
-    if (use_interrupts)
+    if (run->intr_thread)
     {
-        pthread_cancel(intr_thread);
+        pthread_cancel(run->intr_thread);
         void *retval = NULL;
-        pthread_join(intr_thread, &retval);
+        pthread_join(run->intr_thread, &retval);
         if (PTHREAD_CANCELED != retval)
         {
             fprintf(stderr, "pthread_cancel failed!\n");
         }
 
-        r = fpgaUnregisterEvent(accel_handle, FPGA_EVENT_INTERRUPT, intr_handle);
-        assert(FPGA_OK == r);
-    }
-
-    // Gather statistics
-    const uint64_t rd_lines = readMMIO64(6);
-    printf("Total lines read: %ld\n", rd_lines);
-    const uint64_t wr_lines = readMMIO64(7);
-    printf("Total lines written: %ld\n", wr_lines);
-    const uint64_t total_bytes = (rd_lines + wr_lines) * data_bus_num_bytes;
-    const double total_gb = total_bytes / 1073741824.0;
-    printf("Total data moved (GB): %f\n", total_gb);
-    printf("Total time: %f (sec)\n", total_sec);
-    printf("Throughput %0.2f GB/s\n", total_gb / total_sec);
-
-    // What was the expected total data?
-
-    const uint64_t total_expected_bytes = TOTAL_COPY_COMMANDS * 2 * chunk_size;
-    if (total_expected_bytes != total_bytes)
-    {
-        printf("\n*** Expected %ld bytes but counted %ld ***\n",
-               total_expected_bytes, total_bytes);
-    }
-    if (rd_lines != wr_lines)
-    {
-        printf("\n*** Mismatch between read lines (%ld) and write lines (%ld) ***\n",
-               rd_lines, wr_lines);
+        if (!dev->csr_model)
+        {
+            r = fpgaUnregisterEvent(dev->accel_handle, FPGA_EVENT_INTERRUPT,
+                                    run->intr_handle);
+            assert(FPGA_OK == r);
+            fpgaDestroyEventHandle(&run->intr_handle);
+        }
+        run->intr_thread = 0;
     }
 
-    free_buffer_group(accel_handle, num_bufs, src_bufs);
-    free_buffer_group(accel_handle, num_bufs, dst_bufs);
-
-    return 0;
+    if (run->src_bufs) free_buffer_group(dev, run->src_bufs, &run->src_mem);
+    if (run->dst_bufs) free_buffer_group(dev, run->dst_bufs, &run->dst_mem);
+    run->src_bufs = NULL;
+    run->dst_bufs = NULL;
+    if (run->status_buf.ptr) ce_buffer_release(dev, &run->status_buf);
+    run->status_buf.ptr = NULL;
+    free(run->host_status);
+    run->host_status = NULL;
+    dev->cmds_issued += atomic_load(&run->progress->cmds_issued);
+    free(run->progress);
+    run->progress = NULL;
+
+    atomic_store(&dev->busy, false);
 }
@@ -4,11 +4,284 @@
 #ifndef __COPY_ENGINE_H__
 #define __COPY_ENGINE_H__
 
+//
+// libcopyengine: host driver for the copy engine AFU, plus the benchmarks
+// built on it.
+//
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <opae/fpga.h>
+
+//
+// An open engine. Each accelerator handle, or instance of the host memory
+// model of the CSRs, gets its own context, so several engines may be open
+// in one process and used from different threads.
+//
+// An engine takes commands from one source at a time: a benchmark, the
+// ce_copy() API or the ce_stream_*() API. Starting a second one while the
+// first is open fails. ce_copy() may be called from any number of
+// threads. The stream API is for one reading and one writing thread.
+//
+typedef struct t_ce_dev t_ce_dev;
+
+//
+// Map the CSRs and read the AFU's properties. When csr_model is set,
+// commands go to a host memory model of the CSRs instead of the FPGA and
+// accel_handle may be NULL. Returns NULL on failure.
+//
+t_ce_dev *ce_dev_open(fpga_handle accel_handle, bool is_ase_sim,
+                      bool csr_model);
+
+// Release the ce_copy() and ce_stream_*() state and close the engine. The
+// accelerator handle stays open.
+void ce_dev_close(t_ce_dev *dev);
+
+// Stop printing the AFU properties and run parameters each time the
+// engine is opened for a run, and buffer pool statistics on close
+void ce_dev_set_quiet(t_ce_dev *dev, bool quiet);
+
+// The FPGA's NUMA node, where the engine's buffers are allocated, or -1
+// when unknown. The library doesn't move the calling threads. Callers
+// choose whether to run there, e.g. with numa_bind_thread().
+int ce_dev_numa_node(const t_ce_dev *dev);
+
+// Upper limit on threads in the multi-threaded submission benchmark
+#define CE_MT_BENCH_MAX_THREADS 64
+
+//
+// How software waits for completions when it is out of credits. Each
+// policy after spin adds a tier, entered when the wait outlasts the one
+// before it:
+//
+//   spin    Busy loop reading the status line (the original behavior)
+//   pause   Busy loop with a PAUSE between reads
+//   umwait  PAUSE, then UMWAIT on the status line. Same as pause on CPUs
+//           without WAITPKG.
+//   sleep   PAUSE, UMWAIT, then sleep. With interrupts, sleepers block on
+//           a futex the interrupt thread wakes. Otherwise they sleep for
+//           a fixed interval, since FPGA status line writes can't wake
+//           a thread.
+//
+typedef enum
+{
+    CE_WAIT_SPIN,
+    CE_WAIT_PAUSE,
+    CE_WAIT_UMWAIT,
+    CE_WAIT_SLEEP,
+    CE_WAIT_NUM_POLICIES
+}
+e_ce_wait_policy;
+
+const char *ce_wait_policy_name(e_ce_wait_policy policy);
+// Returns 0 and sets *policy when name is one of the names above
+int ce_wait_policy_from_name(const char *name, e_ce_wait_policy *policy);
+
+//
+// Telemetry sampled while copy_engine() runs
+//
+typedef struct
+{
+    // Time series file: JSON when the name ends in .json, otherwise CSV.
+    // "-" writes CSV to stdout. NULL for none.
+    const char *path;
+    // UNIX socket serving the latest sample in Prometheus text format,
+    // or NULL
+    const char *prom_socket;
+    // Sampling interval. 0 picks 100ms.
+    uint32_t interval_ms;
+}
+t_ce_telemetry_cfg;
+
+//
+// Benchmark: issue copy commands round-robin over a group of buffers.
+// With adaptive_cpl, completion_freq is only the starting point and a
+// controller adjusts it as the run progresses. telemetry may be NULL.
+//
 int copy_engine(
-    fpga_handle accel_handle, bool is_ase_sim,
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight,
+    bool adaptive_cpl,
+    e_ce_wait_policy wait_policy,
+    const t_ce_telemetry_cfg *telemetry);
+
+//
+// Run copy_engine() once with each wait policy and compare run time,
+// the CPU time consumed and time spent waiting for credits.
+//
+int copy_engine_wait_bench(
+    t_ce_dev *dev,
     uint32_t chunk_size,
     uint32_t completion_freq,
     bool use_interrupts,
     uint32_t max_reqs_in_flight);
 
+//
+// Issue copy commands from 1, 2, 4, ... max_threads threads sharing one
+// credit window and report commands per second at each step.
+//
+int copy_engine_mt_bench(
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight,
+    uint32_t max_threads,
+    e_ce_wait_policy wait_policy);
+
+//
+// Search chunk sizes, requests in flight and completion frequencies, up
+// to the AFU's maximum burst and request limit, measuring throughput and
+// the host CPU time of each configuration. The Pareto front of the two,
+// fastest first, is written to profile_path for ce_profile_load().
+// Interrupts and the wait policy are fixed for the search, since they
+// set the CPU cost of waiting.
+//
+int copy_engine_autotune(
+    t_ce_dev *dev,
+    bool use_interrupts,
+    e_ce_wait_policy wait_policy,
+    const char *profile_path);
+
+//
+// One configuration in an autotune profile
+//
+typedef struct
+{
+    uint32_t chunk_size;
+    uint32_t max_reqs_in_flight;
+    uint32_t completion_freq;
+    bool use_interrupts;
+    e_ce_wait_policy wait_policy;
+    // Measured throughput, counting reads and writes, and CPU time of the
+    // whole process as a percentage of one CPU
+    double gbps;
+    double cpu_pct;
+}
+t_ce_profile_point;
+
+// Load the fastest configuration in a profile that uses at most
+// max_cpu_pct of a CPU, or the fastest overall when max_cpu_pct is 0.
+// Returns 0 on success.
+int ce_profile_load(const char *path, double max_cpu_pct,
+                    t_ce_profile_point *point);
+
+
+//
+// Copy API for arbitrary user buffers.
+//
+typedef struct
+{
+    uint64_t copies;
+    uint64_t bytes;
+    // Bytes moved between the user buffers directly
+    uint64_t direct_bytes;
+    // Bytes moved through the staging buffers
+    uint64_t staged_bytes;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+    uint64_t pin_failures;
+    // User memory currently pinned by the IOVA cache
+    uint64_t pinned_bytes;
+}
+t_ce_copy_stats;
+
+// Open the engine for ce_copy(), with the largest bursts the AFU allows
+int ce_copy_init(t_ce_dev *dev);
+
+// Wait for outstanding copies and unpin everything in the IOVA cache
+void ce_copy_release(t_ce_dev *dev);
+
+//
+// Copy len bytes from src to dst through the AFU and wait for the copy to
+// finish. dst receives the output of the AFU's data engine, which is the
+// inverse of src with the placeholder engine. src and dst must be aligned
+// to the data bus width. Copies on one engine are serialized, so ce_copy()
+// may be called from any thread. Returns 0 on success.
+//
+int ce_copy(t_ce_dev *dev, void *dst, const void *src, size_t len);
+
+//
+// Pinned pages stay mapped in the IOVA cache after ce_copy() returns.
+// Call this before freeing or unmapping memory passed to ce_copy(), or
+// a later buffer at the same address would be copied through the old
+// pages.
+//
+void ce_iova_cache_invalidate(t_ce_dev *dev, const void *addr, size_t len);
+
+void ce_copy_get_stats(t_ce_dev *dev, t_ce_copy_stats *stats);
+
+// Check ce_copy() on a range of sizes and alignments and measure its
+// bandwidth with cached mappings
+int ce_copy_test(t_ce_dev *dev);
+
+
+//
+// Decoupled read and write command streams. The engine's read and write
+// command queues are independent: each write takes its data from the
+// oldest read whose data hasn't been written. Reads may run ahead of
+// writes, for example to prefetch the input of a pipeline, and every
+// command carries its own length. The length of a write must match the
+// read that feeds it.
+//
+// Addresses are IOVAs of pinned buffers (fpgaPrepareBuffer() and
+// fpgaGetIOAddress()) aligned to the data bus width. Lengths are a
+// multiple of the bus width up to ce_stream_max_cmd_bytes().
+//
+// One thread may issue reads while another issues writes. Neither call
+// is safe from more than one thread at a time. ce_stream_*() and
+// ce_copy() can't be open on the same engine together.
+//
+
+// Returned when the command can't be issued until more writes are
+// issued: a write with no read to feed it or a read with no credit that
+// the writes already issued will return.
+#define CE_STREAM_AGAIN 1
+
+int ce_stream_init(t_ce_dev *dev);
+// Wait for the writes issued to complete and close the streams
+void ce_stream_release(t_ce_dev *dev);
+
+uint64_t ce_stream_max_cmd_bytes(t_ce_dev *dev);
+
+// Queue a read of len bytes at src_iova. Waits for a credit when one
+// will come. Returns 0, CE_STREAM_AGAIN or -1 on an invalid command.
+int ce_stream_read(t_ce_dev *dev, uint64_t src_iova, uint64_t len);
+
+// Queue a write of len bytes to dst_iova, fed by the oldest read not yet
+// written. With flush set, the write reports completion, so that
+// ce_stream_wait() can see it. Returns 0, CE_STREAM_AGAIN or -1.
+int ce_stream_write(t_ce_dev *dev, uint64_t dst_iova, uint64_t len,
+                    bool flush);
+
+// Copy len bytes, any multiple of the bus width, as matched reads and
+// writes of the largest burst and one shorter burst for the remainder.
+// Every read must already have its write. Returns 0 or -1.
+int ce_stream_copy(t_ce_dev *dev, uint64_t dst_iova, uint64_t src_iova,
+                   uint64_t len, bool flush);
+
+// Writes completed, counting from ce_stream_init(). Writes complete in
+// order, so everything below the count has reached memory.
+uint64_t ce_stream_writes_completed(t_ce_dev *dev);
+
+// Wait until num_writes writes have completed. Returns CE_STREAM_AGAIN
+// without waiting when no write issued so far will report it.
+int ce_stream_wait(t_ce_dev *dev, uint64_t num_writes);
+
+// Drive the streams with reads running ahead of writes, with varying
+// command lengths, and check the data
+int ce_stream_pipeline_test(t_ce_dev *dev);
+
+// Copy a mix of small and large requests, first rounded up to whole
+// chunks of the largest burst, as with a length fixed for the run, then
+// with each request split into the fewest bursts of its own length.
+// Reports requests per second and bandwidth for each.
+int ce_stream_mixed_bench(t_ce_dev *dev);
+
 #endif // __COPY_ENGINE_H__
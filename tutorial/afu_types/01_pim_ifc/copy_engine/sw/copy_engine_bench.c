@@ -0,0 +1,479 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Benchmark command loops: commands issued round-robin over a group of
+// buffers with a fixed or adaptive completion frequency.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+
+//
+// Issue run->num_cmds commands, requesting a completion every
+// completion_freq commands.
+//
+static void fixed_cpl_loop(const t_ce_run *run, t_ce_wait_stats *wait_stats)
+{
+    const uint32_t completion_freq = run->completion_freq;
+    const uint32_t max_reqs_in_flight = run->max_reqs_in_flight;
+    const bool use_interrupts = run->use_interrupts;
+    const uint64_t num_cmds = run->num_cmds;
+    const uint32_t num_bufs = run->num_bufs;
+    const t_pinned_buffer *src_bufs = run->src_bufs;
+    const t_pinned_buffer *dst_bufs = run->dst_bufs;
+    const t_ce_dev *dev = run->dev;
+
+    // ====================================================================
+    //
+    // Primary command loop
+    //
+    // ====================================================================
+
+    uint64_t num_cpls = 0;
+    for (uint64_t i = 0; i < num_cmds; i += 1)
+    {
+        // Wait until the credit threshold says more commands can be written.
+        // status_line[0] is the total number of commands processed, counted
+        // from cpl_base[0]. It is updated either by writes from the FPGA
+        // or, in interrupt mode, by intr_wait_thread() in copy_engine.c.
+        ce_wait_cpl(run, 0, i - max_reqs_in_flight + 1, wait_stats);
+
+        // The AFU sends one interrupt at a time and counts the ones waiting
+        // to be sent. Commands run ahead of the interrupts, so keep that
+        // count within the limit too. status_line[1] is the number of
+        // interrupts received.
+        if (use_interrupts)
+            ce_wait_cpl(run, 1, num_cpls - max_reqs_in_flight + 1, wait_stats);
+
+        // Read command. Writing the address triggers the read.
+        uint32_t buf_idx = i & (num_bufs - 1);
+        writeMMIO64(dev, 9, src_bufs[buf_idx].pa);
+
+        // Bit 0 of the write command indicates whether to generate a
+        // completion (interrupt or status line write).
+        uint32_t need_cpl = (i & (completion_freq-1)) == (completion_freq-1);
+        // A completion is always required on the last command.
+        if (i == num_cmds-1) need_cpl = 1;
+        writeMMIO64(dev, 11, dst_bufs[buf_idx].pa | need_cpl);
+        num_cpls += need_cpl;
+        ce_progress_issued(run, i + 1);
+    }
+
+
+    // Wait for the last command to finish. In interrupt mode the command
+    // count comes from register 7, which counts write data before it
+    // commits, so also wait for the last interrupt. Leaving it unreceived
+    // and unacknowledged would hold off interrupts in the next run.
+    ce_wait_cpl(run, 0, num_cmds, wait_stats);
+    if (use_interrupts)
+        ce_wait_cpl(run, 1, num_cpls, wait_stats);
+}
+
+
+//
+// Completion frequency controller. Requesting completions less often cuts
+// status line writes or interrupts, but credits come back in larger, later
+// steps and the command loop starts to stall waiting for them. Each window
+// of commands the controller measures the command rate and the fraction of
+// time spent waiting for credits. It doubles the frequency while stalls
+// stay under CE_CPL_TUNE_STALL_PCT and halves it when they don't. A step
+// that doesn't help is undone and the frequency held for a while before
+// probing again, so the controller settles instead of oscillating when the
+// FPGA, not the credit window, is the limit.
+//
+#define CE_CPL_TUNE_WINDOW(is_ase_sim) ((is_ase_sim) ? 128L : 16384L)
+#define CE_CPL_TUNE_STALL_PCT 2.0
+// A step must change the command rate by this much to count
+#define CE_CPL_TUNE_RATE_TOL 0.02
+// Windows to hold a settled frequency before probing again
+#define CE_CPL_TUNE_HOLD_WINDOWS 16
+
+typedef enum
+{
+    CPL_TUNE_HOLD,
+    CPL_TUNE_UP,
+    CPL_TUNE_DOWN
+}
+e_cpl_tune_step;
+
+typedef struct
+{
+    uint32_t freq;
+    uint32_t max_freq;
+    e_cpl_tune_step last_step;
+    double last_rate;
+    uint32_t hold_windows;
+    uint32_t window;
+}
+t_cpl_tuner;
+
+
+static void cpl_tuner_init(t_cpl_tuner *t, const t_ce_run *run)
+{
+    memset(t, 0, sizeof(*t));
+    t->freq = run->completion_freq;
+    // Keep at least half the credit window usable between completions
+    t->max_freq = run->max_reqs_in_flight / 2;
+    if (t->max_freq == 0) t->max_freq = 1;
+    if (t->freq > t->max_freq) t->freq = t->max_freq;
+    t->last_step = CPL_TUNE_HOLD;
+}
+
+
+//
+// Pick the completion frequency for the next window, given the length of
+// the window that just ended and the time spent stalled for credits.
+//
+static uint32_t cpl_tuner_update(t_cpl_tuner *t, uint64_t cmds,
+                                 double window_sec, double stall_sec)
+{
+    const double rate = cmds / window_sec;
+    const double stall_pct = 100.0 * stall_sec / window_sec;
+    const bool stalled = stall_pct > CE_CPL_TUNE_STALL_PCT;
+    const uint32_t old_freq = t->freq;
+    e_cpl_tune_step step = CPL_TUNE_HOLD;
+    const char *why = NULL;
+
+    if (t->hold_windows)
+    {
+        t->hold_windows -= 1;
+    }
+    else if (t->last_step == CPL_TUNE_UP)
+    {
+        if (stalled || (rate < t->last_rate * (1 - CE_CPL_TUNE_RATE_TOL)))
+        {
+            t->freq /= 2;
+            why = "undo increase";
+        }
+        else if (t->freq < t->max_freq)
+        {
+            t->freq *= 2;
+            step = CPL_TUNE_UP;
+            why = "few stalls";
+        }
+    }
+    else if (t->last_step == CPL_TUNE_DOWN)
+    {
+        if (rate <= t->last_rate * (1 + CE_CPL_TUNE_RATE_TOL))
+        {
+            // More completions didn't help. The stalls are the FPGA's
+            // own throughput limit.
+            t->freq *= 2;
+            why = "undo decrease";
+        }
+        else if (stalled && (t->freq > 1))
+        {
+            t->freq /= 2;
+            step = CPL_TUNE_DOWN;
+            why = "credit stalls";
+        }
+    }
+    else if (stalled && (t->freq > 1))
+    {
+        t->freq /= 2;
+        step = CPL_TUNE_DOWN;
+        why = "credit stalls";
+    }
+    else if (!stalled && (t->freq < t->max_freq))
+    {
+        t->freq *= 2;
+        step = CPL_TUNE_UP;
+        why = "few stalls";
+    }
+
+    // Settled, either at a limit or after undoing a step
+    if ((step == CPL_TUNE_HOLD) && (t->last_step != CPL_TUNE_HOLD))
+    {
+        t->hold_windows = CE_CPL_TUNE_HOLD_WINDOWS;
+        if (!why) why = "settled";
+    }
+
+    if (why)
+    {
+        printf("  Window %d: %0.2f Mcommands/s, %0.1f%% credit stalls, "
+               "completion freq %d -> %d (%s)\n",
+               t->window, rate * 1e-6, stall_pct, old_freq, t->freq, why);
+    }
+
+    t->last_step = step;
+    t->last_rate = rate;
+    t->window += 1;
+
+    return t->freq;
+}
+
+
+static inline double elapsed_sec(const struct timespec *start,
+                                 const struct timespec *end)
+{
+    return end->tv_sec - start->tv_sec +
+           1e-9 * (end->tv_nsec - start->tv_nsec);
+}
+
+
+//
+// Issue run->num_cmds commands with the completion frequency chosen
+// by the controller.
+//
+static void adaptive_cpl_loop(const t_ce_run *run, t_ce_wait_stats *wait_stats)
+{
+    const uint32_t max_reqs_in_flight = run->max_reqs_in_flight;
+    const bool use_interrupts = run->use_interrupts;
+    const uint64_t num_cmds = run->num_cmds;
+    const uint32_t num_bufs = run->num_bufs;
+    const t_pinned_buffer *src_bufs = run->src_bufs;
+    const t_pinned_buffer *dst_bufs = run->dst_bufs;
+    const t_ce_dev *dev = run->dev;
+    const uint64_t tune_window = CE_CPL_TUNE_WINDOW(dev->is_ase_sim);
+
+    uint64_t num_cpls = 0;
+
+    t_cpl_tuner tuner;
+    cpl_tuner_init(&tuner, run);
+    uint32_t completion_freq = tuner.freq;
+
+    if (!dev->quiet) printf("Completion frequency controller:\n");
+
+    struct timespec window_start, now;
+    clock_gettime(CLOCK_MONOTONIC, &window_start);
+    double stall_sec = 0;
+
+    uint64_t completed = 0;
+    for (uint64_t i = 0; i < num_cmds; i += 1)
+    {
+        if ((i - completed) >= max_reqs_in_flight)
+        {
+            completed = ce_cpl_count(run, 0);
+        }
+        if (((i - completed) >= max_reqs_in_flight) ||
+            (use_interrupts && ((num_cpls - ce_cpl_count(run, 1)) >= max_reqs_in_flight)))
+        {
+            // Stalled for credit. Time it, off the fast path.
+            struct timespec stall_start;
+            clock_gettime(CLOCK_MONOTONIC, &stall_start);
+            ce_wait_cpl(run, 0, i - max_reqs_in_flight + 1, wait_stats);
+            if (use_interrupts)
+                ce_wait_cpl(run, 1, num_cpls - max_reqs_in_flight + 1,
+                            wait_stats);
+            completed = ce_cpl_count(run, 0);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            stall_sec += elapsed_sec(&stall_start, &now);
+        }
+
+        uint32_t buf_idx = i & (num_bufs - 1);
+        writeMMIO64(dev, 9, src_bufs[buf_idx].pa);
+
+        uint32_t need_cpl = (i & (completion_freq-1)) == (completion_freq-1);
+        if (i == num_cmds-1) need_cpl = 1;
+        writeMMIO64(dev, 11, dst_bufs[buf_idx].pa | need_cpl);
+
+        num_cpls += need_cpl;
+        ce_progress_issued(run, i + 1);
+
+        if (((i + 1) % tune_window) == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            completion_freq = cpl_tuner_update(&tuner, tune_window,
+                                               elapsed_sec(&window_start, &now),
+                                               stall_sec);
+            window_start = now;
+            stall_sec = 0;
+        }
+    }
+
+    // Wait for the last command and, in interrupt mode, its interrupt
+    // (see fixed_cpl_loop())
+    ce_wait_cpl(run, 0, num_cmds, wait_stats);
+    if (use_interrupts)
+        ce_wait_cpl(run, 1, num_cpls, wait_stats);
+
+    if (!dev->quiet) printf("Final completion frequency: %d\n\n", completion_freq);
+}
+
+
+static inline double process_cpu_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+int ce_bench_run(
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight,
+    bool adaptive_cpl,
+    e_ce_wait_policy wait_policy,
+    uint64_t num_cmds,
+    const t_ce_telemetry_cfg *telemetry_cfg,
+    t_ce_run_result *result)
+{
+    t_ce_run run;
+
+    memset(result, 0, sizeof(*result));
+
+    if (ce_run_open(dev, chunk_size, completion_freq, use_interrupts,
+                    max_reqs_in_flight, &run))
+        return -1;
+    if (ce_run_alloc_bufs(&run))
+    {
+        ce_run_close(&run);
+        return -1;
+    }
+
+    run.wait_policy = wait_policy;
+    if (num_cmds) run.num_cmds = num_cmds;
+    if (!dev->quiet) printf("Wait policy: %s\n\n", ce_wait_policy_name(wait_policy));
+
+    chunk_size = run.chunk_size;
+    result->chunk_size = run.chunk_size;
+    result->completion_freq = run.completion_freq;
+    result->max_reqs_in_flight = run.max_reqs_in_flight;
+    const uint32_t data_bus_num_bytes = run.data_bus_num_bytes;
+
+    t_ce_telemetry *telemetry = ce_telemetry_start(&run, telemetry_cfg);
+    if (telemetry_cfg && (telemetry_cfg->path || telemetry_cfg->prom_socket) &&
+        !telemetry)
+    {
+        ce_run_close(&run);
+        return -1;
+    }
+
+    struct timespec start_time, end_time;
+    const double start_cpu_sec = process_cpu_sec();
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (adaptive_cpl)
+        adaptive_cpl_loop(&run, &result->wait);
+    else
+        fixed_cpl_loop(&run, &result->wait);
+
+    ce_telemetry_stop(telemetry);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double total_sec = end_time.tv_sec - start_time.tv_sec +
+                       1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+    result->total_sec = total_sec;
+    result->cpu_sec = process_cpu_sec() - start_cpu_sec;
+
+    // Gather statistics for this run
+    const uint64_t rd_lines = readMMIO64(dev, 6) - run.base_rd_lines;
+    const uint64_t wr_lines = readMMIO64(dev, 7) - run.base_wr_lines;
+    const uint64_t total_bytes = (rd_lines + wr_lines) * data_bus_num_bytes;
+    const double total_gb = total_bytes / 1073741824.0;
+    result->total_bytes = total_bytes;
+    if (!dev->quiet)
+    {
+        printf("Total lines read: %ld\n", rd_lines);
+        printf("Total lines written: %ld\n", wr_lines);
+        printf("Total data moved (GB): %f\n", total_gb);
+        printf("Total time: %f (sec)\n", total_sec);
+        printf("Throughput %0.2f GB/s\n", total_gb / total_sec);
+        printf("CPU time: %f (sec), %0.1f%% of one CPU\n",
+               result->cpu_sec, 100.0 * result->cpu_sec / total_sec);
+        printf("Credit waits: %ld, %f (sec), %ld umwaits, %ld sleeps\n",
+               result->wait.waits, 1e-9 * result->wait.wait_ns,
+               result->wait.umwaits, result->wait.sleeps);
+    }
+
+    // What was the expected total data?
+    int status = 0;
+
+    const uint64_t total_expected_bytes = run.num_cmds * 2 * chunk_size;
+    if (total_expected_bytes != total_bytes)
+    {
+        printf("\n*** Expected %ld bytes but counted %ld ***\n",
+               total_expected_bytes, total_bytes);
+        status = -1;
+    }
+    if (rd_lines != wr_lines)
+    {
+        printf("\n*** Mismatch between read lines (%ld) and write lines (%ld) ***\n",
+               rd_lines, wr_lines);
+        status = -1;
+    }
+
+    ce_run_close(&run);
+
+    return status;
+}
+
+
+int copy_engine(
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight,
+    bool adaptive_cpl,
+    e_ce_wait_policy wait_policy,
+    const t_ce_telemetry_cfg *telemetry)
+{
+    t_ce_run_result result;
+
+    // Data mismatches are reported but, as before, not returned as errors
+    if (ce_bench_run(dev, chunk_size, completion_freq, use_interrupts,
+                     max_reqs_in_flight, adaptive_cpl, wait_policy, 0,
+                     telemetry, &result) &&
+        (result.total_sec == 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+int copy_engine_wait_bench(
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight)
+{
+    t_ce_run_result results[CE_WAIT_NUM_POLICIES];
+    int status = 0;
+
+    for (int p = 0; p < CE_WAIT_NUM_POLICIES; p += 1)
+    {
+        if (ce_bench_run(dev, chunk_size, completion_freq, use_interrupts,
+                         max_reqs_in_flight, false, p, 0, NULL, &results[p]))
+        {
+            status = -1;
+            break;
+        }
+        printf("\n");
+    }
+    if (status) return status;
+
+    // Added time and CPU saved are relative to spinning. Time spent
+    // waiting rises with the later tiers because a waiter notices the
+    // completion late, which is the latency the policy adds.
+    printf("%8s %10s %8s %10s %8s %10s %12s %12s\n",
+           "policy", "time (s)", "GB/s", "CPU (s)", "CPU %",
+           "waits", "avg wait us", "added ms");
+    for (int p = 0; p < CE_WAIT_NUM_POLICIES; p += 1)
+    {
+        const t_ce_run_result *r = &results[p];
+        printf("%8s %10.3f %8.2f %10.3f %8.1f %10ld %12.2f %12.2f\n",
+               ce_wait_policy_name(p), r->total_sec,
+               r->total_bytes / r->total_sec / 1073741824.0,
+               r->cpu_sec, 100.0 * r->cpu_sec / r->total_sec,
+               r->wait.waits,
+               r->wait.waits ? 1e-3 * r->wait.wait_ns / r->wait.waits : 0.0,
+               1e3 * (r->total_sec - results[CE_WAIT_SPIN].total_sec));
+    }
+
+    return 0;
+}
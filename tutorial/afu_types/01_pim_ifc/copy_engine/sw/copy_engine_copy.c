@@ -0,0 +1,574 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Copy API for arbitrary user buffers. Buffers are pinned in place and
+// their IOVAs are kept in a small cache, so repeated copies from the same
+// buffers skip pinning. Copies are split into commands of the largest
+// burst the AFU accepts. Buffers that can't be pinned, such as read-only
+// mappings or any buffer in ASE, and the partial line at the end of a
+// copy go through pinned staging buffers instead.
+//
+// The engine writes whatever the data engine produces. The placeholder
+// in data_stream_engine.sv inverts every bit.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+// Pinned user regions remembered
+#define CE_IOVA_CACHE_ENTRIES   64
+// Size of each staging buffer for data that can't be moved in place
+#define CE_COPY_STAGE_BYTES     (2 * 1024 * 1024)
+
+typedef struct
+{
+    // Page aligned user region
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t wsid;
+    uint64_t iova;
+    uint64_t last_use;
+}
+t_ce_iova_entry;
+
+// ce_copy() state of an engine, guarded by dev->copy_lock
+struct t_ce_copy_ctx
+{
+    t_ce_dev *dev;
+    t_ce_run run;
+
+    uint64_t line_bytes;
+    uint64_t max_cmd_bytes;
+    // Commands written since ce_copy_init()
+    uint64_t cmds_issued;
+    // Bytes per command currently set in registers 8 and 10
+    uint64_t cmd_bytes;
+
+    t_ce_iova_entry cache[CE_IOVA_CACHE_ENTRIES];
+    uint32_t num_entries;
+    uint64_t use_clock;
+
+    t_pinned_buffer stage_src;
+    t_pinned_buffer stage_dst;
+
+    t_ce_copy_stats stats;
+};
+
+typedef struct t_ce_copy_ctx t_ce_copy_ctx;
+
+
+static void iova_entry_unpin(t_ce_copy_ctx *c, uint32_t idx)
+{
+    t_ce_iova_entry *e = &c->cache[idx];
+
+    fpgaReleaseBuffer(c->dev->accel_handle, e->wsid);
+    c->stats.pinned_bytes -= e->end - e->start;
+
+    c->num_entries -= 1;
+    *e = c->cache[c->num_entries];
+}
+
+
+static void iova_cache_invalidate(t_ce_copy_ctx *c, uintptr_t start,
+                                  uintptr_t end)
+{
+    uint32_t i = 0;
+    while (i < c->num_entries)
+    {
+        if ((c->cache[i].start < end) && (start < c->cache[i].end))
+            iova_entry_unpin(c, i);
+        else
+            i += 1;
+    }
+}
+
+
+//
+// Find the IOVA of a user address, pinning the pages around [ptr, ptr+len)
+// on a miss. Returns 0 on success.
+//
+static int iova_lookup(t_ce_copy_ctx *c, const volatile void *ptr,
+                       uint64_t len, uint64_t *iova)
+{
+    // The model takes host virtual addresses
+    if (c->dev->csr_model)
+    {
+        *iova = (uint64_t)(uintptr_t)ptr;
+        return 0;
+    }
+
+    const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    const uintptr_t addr = (uintptr_t)ptr;
+    uintptr_t start = addr & ~page_mask;
+    uintptr_t end = (addr + len + page_mask) & ~page_mask;
+
+    for (uint32_t i = 0; i < c->num_entries; i += 1)
+    {
+        t_ce_iova_entry *e = &c->cache[i];
+        if ((e->start <= start) && (end <= e->end))
+        {
+            e->last_use = ++c->use_clock;
+            c->stats.cache_hits += 1;
+            *iova = e->iova + (addr - e->start);
+            return 0;
+        }
+    }
+
+    c->stats.cache_misses += 1;
+
+    // ASE can only share buffers it allocates
+    if (c->dev->is_ase_sim) return -1;
+
+    // A region can be pinned only once. Merge overlapping entries into
+    // the new one.
+    bool merged;
+    do
+    {
+        merged = false;
+        for (uint32_t i = 0; i < c->num_entries; i += 1)
+        {
+            t_ce_iova_entry *e = &c->cache[i];
+            if ((e->start < end) && (start < e->end))
+            {
+                if (e->start < start) start = e->start;
+                if (e->end > end) end = e->end;
+                iova_entry_unpin(c, i);
+                merged = true;
+                break;
+            }
+        }
+    }
+    while (merged);
+
+    // Evict the least recently used region
+    if (c->num_entries == CE_IOVA_CACHE_ENTRIES)
+    {
+        uint32_t lru = 0;
+        for (uint32_t i = 1; i < c->num_entries; i += 1)
+        {
+            if (c->cache[i].last_use < c->cache[lru].last_use)
+                lru = i;
+        }
+        iova_entry_unpin(c, lru);
+        c->stats.cache_evictions += 1;
+    }
+
+    t_ce_iova_entry *e = &c->cache[c->num_entries];
+    void *buf_addr = (void*)start;
+    if (FPGA_OK != fpgaPrepareBuffer(c->dev->accel_handle, end - start,
+                                     &buf_addr, &e->wsid,
+                                     FPGA_BUF_PREALLOCATED))
+    {
+        c->stats.pin_failures += 1;
+        return -1;
+    }
+    if (FPGA_OK != fpgaGetIOAddress(c->dev->accel_handle, e->wsid, &e->iova))
+    {
+        fpgaReleaseBuffer(c->dev->accel_handle, e->wsid);
+        c->stats.pin_failures += 1;
+        return -1;
+    }
+
+    e->start = start;
+    e->end = end;
+    e->last_use = ++c->use_clock;
+    c->num_entries += 1;
+    c->stats.pinned_bytes += end - start;
+
+    *iova = e->iova + (addr - start);
+    return 0;
+}
+
+
+//
+// Issue commands moving len bytes, a multiple of the line size, from
+// src_iova to dst_iova. With flush set, the last command requests a
+// completion so that wait_idle() can see it finish.
+//
+static void issue_copy(t_ce_copy_ctx *c, uint64_t dst_iova, uint64_t src_iova,
+                       uint64_t len, bool flush)
+{
+    const t_ce_run *run = &c->run;
+    const t_ce_dev *dev = c->dev;
+    const uint64_t cpl_mask = run->completion_freq - 1;
+
+    uint64_t off = 0;
+    while (off < len)
+    {
+        uint64_t n = len - off;
+        if (n > c->max_cmd_bytes) n = c->max_cmd_bytes;
+
+        // Wait for a credit
+        ce_wait_cpl(run, 0, c->cmds_issued - run->max_reqs_in_flight + 1,
+                    NULL);
+
+        // The length is latched along with each address, so commands
+        // already queued keep the old one.
+        if (n != c->cmd_bytes)
+        {
+            c->cmd_bytes = n;
+            writeMMIO64(dev, 8, n / c->line_bytes - 1);
+            writeMMIO64(dev, 10, n / c->line_bytes - 1);
+        }
+
+        uint64_t need_cpl = (c->cmds_issued & cpl_mask) == cpl_mask;
+        if (flush && (off + n == len)) need_cpl = 1;
+
+        writeMMIO64(dev, 9, src_iova + off);
+        writeMMIO64(dev, 11, (dst_iova + off) | need_cpl);
+        c->cmds_issued += 1;
+        ce_progress_issued(run, c->cmds_issued);
+        off += n;
+    }
+}
+
+
+//
+// Wait for every issued command to commit. The status line holds the
+// total number of commands completed, so it catches up as soon as the
+// last command, which requested a completion, commits.
+//
+static void wait_idle(t_ce_copy_ctx *c)
+{
+    ce_wait_cpl(&c->run, 0, c->cmds_issued, NULL);
+}
+
+
+int ce_copy_init(t_ce_dev *dev)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&dev->copy_lock);
+
+    if (dev->copy)
+    {
+        fprintf(stderr, "ce_copy_init: already initialized\n");
+        pthread_mutex_unlock(&dev->copy_lock);
+        return -1;
+    }
+
+    t_ce_copy_ctx *c = calloc(1, sizeof(t_ce_copy_ctx));
+    assert(NULL != c);
+    c->dev = dev;
+
+    // Largest bursts, default completion frequency and status line
+    // completions
+    if (ce_run_open(dev, 0, 0, false, 0, &c->run))
+    {
+        free(c);
+        pthread_mutex_unlock(&dev->copy_lock);
+        return -1;
+    }
+    if (dev->csr_model) ce_model_set_move_data(dev->model, true);
+
+    c->line_bytes = c->run.data_bus_num_bytes;
+    c->max_cmd_bytes = c->run.chunk_size;
+    c->cmd_bytes = c->run.chunk_size;
+
+    if (ce_buffer_acquire(dev, CE_COPY_STAGE_BYTES, &c->stage_src))
+    {
+        status = -1;
+    }
+    else if (ce_buffer_acquire(dev, CE_COPY_STAGE_BYTES, &c->stage_dst))
+    {
+        ce_buffer_release(dev, &c->stage_src);
+        status = -1;
+    }
+
+    if (status)
+    {
+        fprintf(stderr, "ce_copy_init: staging buffer allocation failed\n");
+        ce_run_close(&c->run);
+        free(c);
+    }
+    else
+    {
+        dev->copy = c;
+    }
+
+    pthread_mutex_unlock(&dev->copy_lock);
+    return status;
+}
+
+
+void ce_copy_release(t_ce_dev *dev)
+{
+    pthread_mutex_lock(&dev->copy_lock);
+
+    t_ce_copy_ctx *c = dev->copy;
+    if (c)
+    {
+        wait_idle(c);
+
+        while (c->num_entries)
+        {
+            iova_entry_unpin(c, 0);
+        }
+
+        ce_buffer_release(dev, &c->stage_src);
+        ce_buffer_release(dev, &c->stage_dst);
+        ce_run_close(&c->run);
+        free(c);
+        dev->copy = NULL;
+    }
+
+    pthread_mutex_unlock(&dev->copy_lock);
+}
+
+
+int ce_copy(t_ce_dev *dev, void *dst, const void *src, size_t len)
+{
+    pthread_mutex_lock(&dev->copy_lock);
+
+    t_ce_copy_ctx *c = dev->copy;
+    if (NULL == c)
+    {
+        fprintf(stderr, "ce_copy: not initialized\n");
+        pthread_mutex_unlock(&dev->copy_lock);
+        return -1;
+    }
+
+    const uint64_t line_mask = c->line_bytes - 1;
+    if (((uintptr_t)dst | (uintptr_t)src) & line_mask)
+    {
+        fprintf(stderr, "ce_copy: buffers must be aligned to %ld bytes\n",
+                c->line_bytes);
+        pthread_mutex_unlock(&dev->copy_lock);
+        return -1;
+    }
+
+    // Whole lines can be written in place. The engine reads whole lines
+    // too, but a partial last line is still within the source's last page.
+    const uint64_t body = len & ~line_mask;
+    uint64_t src_iova = 0;
+    uint64_t dst_iova = 0;
+    bool src_pinned = (len == 0) || !iova_lookup(c, src, len, &src_iova);
+    const bool dst_pinned = (body == 0) || !iova_lookup(c, dst, body, &dst_iova);
+    // Pinning dst may have merged the source's region into a new one or
+    // evicted it. If pinning it again fails, the source is staged.
+    if (src_pinned && (len != 0) && (body != 0))
+        src_pinned = !iova_lookup(c, src, len, &src_iova);
+
+    uint64_t off = 0;
+    if (src_pinned && dst_pinned)
+    {
+        issue_copy(c, dst_iova, src_iova, body, body == len);
+        c->stats.direct_bytes += body;
+        off = body;
+    }
+
+    // Everything else is staged, one staging buffer at a time
+    while (off < len)
+    {
+        uint64_t n = len - off;
+        if (n > CE_COPY_STAGE_BYTES) n = CE_COPY_STAGE_BYTES;
+        const uint64_t n_lines = (n + line_mask) & ~line_mask;
+
+        uint64_t s = src_iova + off;
+        if (!src_pinned)
+        {
+            memcpy((void*)c->stage_src.ptr, (const char*)src + off, n);
+            s = c->stage_src.pa;
+        }
+
+        const bool in_place = dst_pinned && (n == n_lines);
+        const uint64_t d = in_place ? dst_iova + off : c->stage_dst.pa;
+
+        issue_copy(c, d, s, n_lines, true);
+        wait_idle(c);
+
+        if (!in_place)
+            memcpy((char*)dst + off, (const void*)c->stage_dst.ptr, n);
+
+        c->stats.staged_bytes += n;
+        off += n;
+    }
+
+    wait_idle(c);
+
+    c->stats.copies += 1;
+    c->stats.bytes += len;
+
+    pthread_mutex_unlock(&dev->copy_lock);
+    return 0;
+}
+
+
+void ce_iova_cache_invalidate(t_ce_dev *dev, const void *addr, size_t len)
+{
+    const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+    pthread_mutex_lock(&dev->copy_lock);
+    if (dev->copy)
+    {
+        iova_cache_invalidate(dev->copy, (uintptr_t)addr & ~page_mask,
+                              ((uintptr_t)addr + len + page_mask) & ~page_mask);
+    }
+    pthread_mutex_unlock(&dev->copy_lock);
+}
+
+
+void ce_copy_get_stats(t_ce_dev *dev, t_ce_copy_stats *stats)
+{
+    pthread_mutex_lock(&dev->copy_lock);
+    if (dev->copy)
+        *stats = dev->copy->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+    pthread_mutex_unlock(&dev->copy_lock);
+}
+
+
+static void fill_random(uint8_t *buf, size_t len, uint64_t seed)
+{
+    uint64_t x = seed | 1;
+    for (size_t i = 0; i < len; i += 1)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x;
+    }
+}
+
+
+//
+// Copy len bytes at the given offsets into fresh buffers and check the
+// result and the bytes just past the end of dst.
+//
+static int copy_test_one(t_ce_dev *dev, size_t len, size_t src_off,
+                         size_t dst_off)
+{
+    const size_t guard = 64;
+    uint8_t *src, *dst;
+    int status = 0;
+
+    if (posix_memalign((void**)&src, 4096, src_off + len + guard) ||
+        posix_memalign((void**)&dst, 4096, dst_off + len + guard))
+    {
+        fprintf(stderr, "Buffer allocation failed\n");
+        return -1;
+    }
+
+    fill_random(src + src_off, len, len);
+    memset(dst, 0x5a, dst_off + len + guard);
+
+    if (ce_copy(dev, dst + dst_off, src + src_off, len))
+    {
+        status = -1;
+    }
+    else
+    {
+        for (size_t i = 0; i < len; i += 1)
+        {
+            const uint8_t expect = (uint8_t)(~src[src_off + i]);
+            if (dst[dst_off + i] != expect)
+            {
+                printf("  Mismatch in %ld byte copy at byte %ld\n", len, i);
+                status = -1;
+                break;
+            }
+        }
+        for (size_t i = 0; i < guard; i += 1)
+        {
+            if (dst[dst_off + len + i] != 0x5a)
+            {
+                printf("  %ld byte copy wrote past the end of dst\n", len);
+                status = -1;
+                break;
+            }
+        }
+    }
+
+    ce_iova_cache_invalidate(dev, src, src_off + len + guard);
+    ce_iova_cache_invalidate(dev, dst, dst_off + len + guard);
+    free(src);
+    free(dst);
+
+    return status;
+}
+
+
+int ce_copy_test(t_ce_dev *dev)
+{
+    int status = 0;
+    const bool is_ase_sim = dev->is_ase_sim;
+
+    if (ce_copy_init(dev))
+        return -1;
+
+    const size_t line = dev->copy->line_bytes;
+    const size_t sizes[] = { line, 100, 4096, dev->copy->max_cmd_bytes + line,
+                             65536 + 17, (1 << 20) + 3,
+                             CE_COPY_STAGE_BYTES * 2 + line };
+    const size_t num_sizes = sizeof(sizes) / sizeof(sizes[0]) -
+                             (is_ase_sim ? 2 : 0);
+
+    printf("Checking ce_copy():\n");
+    for (size_t i = 0; i < num_sizes; i += 1)
+    {
+        // Offsets that start buffers mid-page
+        if (copy_test_one(dev, sizes[i], 0, 0) ||
+            copy_test_one(dev, sizes[i], line, 4096 - line))
+        {
+            status = -1;
+        }
+    }
+    printf("  %s\n\n", status ? "FAIL" : "PASS");
+
+    // Bandwidth with the IOVA cache warm after the first copy
+    const size_t len = is_ase_sim ? 256 * 1024 : 64 * 1024 * 1024;
+    const uint32_t iters = is_ase_sim ? 2 : 16;
+    void *src = NULL;
+    void *dst = NULL;
+    if (posix_memalign(&src, 4096, len)) src = NULL;
+    if (posix_memalign(&dst, 4096, len)) dst = NULL;
+    if (!status && src && dst)
+    {
+        memset(src, 0, len);
+        memset(dst, 0, len);
+        ce_copy(dev, dst, src, len);
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (uint32_t i = 0; i < iters; i += 1)
+        {
+            ce_copy(dev, dst, src, len);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double total_sec = end_time.tv_sec - start_time.tv_sec +
+                           1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+        printf("ce_copy() of %ld bytes: %0.2f GB/s\n\n", len,
+               (double)len * iters / total_sec / 1073741824.0);
+
+        ce_iova_cache_invalidate(dev, src, len);
+        ce_iova_cache_invalidate(dev, dst, len);
+    }
+    free(src);
+    free(dst);
+
+    t_ce_copy_stats stats;
+    ce_copy_get_stats(dev, &stats);
+    printf("Copy statistics:\n");
+    printf("  Copies: %ld (%ld bytes)\n", stats.copies, stats.bytes);
+    printf("  Direct bytes: %ld\n", stats.direct_bytes);
+    printf("  Staged bytes: %ld\n", stats.staged_bytes);
+    printf("  IOVA cache hits: %ld, misses: %ld, evictions: %ld\n",
+           stats.cache_hits, stats.cache_misses, stats.cache_evictions);
+    printf("  Pin failures: %ld\n\n", stats.pin_failures);
+
+    ce_copy_release(dev);
+
+    return status;
+}
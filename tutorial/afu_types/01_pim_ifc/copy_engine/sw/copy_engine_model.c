@@ -0,0 +1,278 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Host memory model of the copy engine CSRs, following the register map
+// at the top of csr_mgr.sv. Commands complete immediately, so software
+// can be measured without the FPGA's throughput limits.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "copy_engine_util.h"
+
+// Properties reported in register 5, typical of a PCIe Gen4x16 platform
+#define CE_MODEL_CLOCK_MHZ      250
+#define CE_MODEL_BUS_BYTES      64
+#define CE_MODEL_INTR_IDS       4
+#define CE_MODEL_REQS_IN_FLIGHT 1024
+#define CE_MODEL_MAX_BURST      128
+
+// Reads whose data hasn't been consumed by a write. Reads beyond the
+// request limit are rejected before they reach the FIFO, so it only needs
+// to hold CE_MODEL_REQS_IN_FLIGHT.
+#define CE_MODEL_RD_FIFO_DEPTH  CE_MODEL_REQS_IN_FLIGHT
+
+struct t_ce_model
+{
+    // Registers 8/9 and 10/11 may be written by different threads when
+    // the read and write streams are decoupled. The read FIFO between
+    // them is single producer, single consumer.
+    uint64_t rd_num_lines;
+    uint64_t wr_num_lines;
+    _Atomic uint64_t rd_cmds;
+    _Atomic uint64_t wr_cmds;
+    struct
+    {
+        uint64_t addr;
+        uint64_t num_lines;
+    }
+    rd_fifo[CE_MODEL_RD_FIFO_DEPTH];
+
+    // Read by the interrupt thread
+    _Atomic uint64_t rd_lines;
+    _Atomic uint64_t wr_lines;
+    uint64_t pairing_errors;
+    uint64_t stream_errors;
+    bool move_data;
+    volatile uint64_t *status_line;
+
+    // Interrupts, as in copy_write_engine.sv: one is sent at a time and
+    // the rest wait for the ACK in register 12. The ACK comes from the
+    // interrupt thread, so this state is locked.
+    pthread_mutex_t intr_lock;
+    int intr_fd;
+    bool intr_busy;
+    uint64_t intr_pending;
+};
+
+
+t_ce_model *ce_model_create(void)
+{
+    t_ce_model *m = calloc(1, sizeof(t_ce_model));
+    if (NULL == m) return NULL;
+
+    pthread_mutex_init(&m->intr_lock, NULL);
+    m->intr_fd = -1;
+    return m;
+}
+
+
+void ce_model_destroy(t_ce_model *m)
+{
+    if (NULL == m) return;
+
+    if (m->intr_fd >= 0) close(m->intr_fd);
+    pthread_mutex_destroy(&m->intr_lock);
+    free(m);
+}
+
+
+void ce_model_reset(t_ce_model *m)
+{
+    const int intr_fd = m->intr_fd;
+
+    // The command and line counters are kept. The hardware clears them
+    // only on AFU reset (csr_mgr.sv and copy_write_engine.sv), so runs
+    // after the first see them where the last run left them. So is the
+    // interrupt state: an interrupt a run left unacknowledged holds off
+    // the next run's interrupts until that run's ACK.
+    m->pairing_errors = 0;
+    m->stream_errors = 0;
+    m->move_data = false;
+    m->status_line = NULL;
+
+    // A new run registers a new event handle and never sees interrupts
+    // signaled to the old one
+    if (intr_fd >= 0)
+    {
+        uint64_t count;
+        while (read(intr_fd, &count, sizeof(count)) > 0) {};
+    }
+}
+
+
+int ce_model_intr_fd(t_ce_model *m)
+{
+    if (m->intr_fd < 0)
+        m->intr_fd = eventfd(0, EFD_NONBLOCK);
+    return m->intr_fd;
+}
+
+
+// Send the next interrupt if the vector is free. Called with intr_lock held.
+static void model_send_intr(t_ce_model *m)
+{
+    if (!m->intr_busy && m->intr_pending)
+    {
+        const uint64_t one = 1;
+        m->intr_pending -= 1;
+        m->intr_busy = true;
+        if (write(m->intr_fd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "CSR model: interrupt write failed\n");
+    }
+}
+
+
+uint64_t ce_model_read_csr(t_ce_model *m, uint32_t idx)
+{
+    switch (idx)
+    {
+      case 5:
+        return ((uint64_t)CE_MODEL_MAX_BURST << 48) |
+               ((uint64_t)CE_MODEL_REQS_IN_FLIGHT << 32) |
+               (CE_MODEL_INTR_IDS << 24) |
+               (CE_MODEL_BUS_BYTES << 16) |
+               CE_MODEL_CLOCK_MHZ;
+      case 6:
+        return atomic_load_explicit(&m->rd_lines, memory_order_relaxed);
+      case 7:
+        return atomic_load_explicit(&m->wr_lines, memory_order_relaxed);
+      default:
+        return 0;
+    }
+}
+
+
+void ce_model_write_csr(t_ce_model *m, uint32_t idx, uint64_t v)
+{
+    switch (idx)
+    {
+      case 8:
+        m->rd_num_lines = (v & 0xffffffff) + 1;
+        break;
+      case 9:
+      {
+        const uint64_t n = atomic_load_explicit(&m->rd_cmds,
+                                                memory_order_relaxed);
+        if ((n - atomic_load(&m->wr_cmds)) >= CE_MODEL_REQS_IN_FLIGHT)
+        {
+            // Beyond the request limit advertised in register 5. The
+            // hardware would lose it.
+            m->stream_errors += 1;
+            break;
+        }
+        m->rd_fifo[n % CE_MODEL_RD_FIFO_DEPTH].addr = v;
+        m->rd_fifo[n % CE_MODEL_RD_FIFO_DEPTH].num_lines =
+            m->rd_num_lines;
+        atomic_fetch_add_explicit(&m->rd_lines, m->rd_num_lines,
+                                  memory_order_relaxed);
+        atomic_store_explicit(&m->rd_cmds, n + 1, memory_order_release);
+        break;
+      }
+      case 10:
+        m->wr_num_lines = (v & 0xffffffff) + 1;
+        break;
+      case 11:
+      {
+        const uint64_t n = atomic_load_explicit(&m->wr_cmds,
+                                                memory_order_relaxed);
+        const uint64_t rd_cmds = atomic_load_explicit(&m->rd_cmds,
+                                                      memory_order_acquire);
+
+        // In lock step, every write consumes the read issued just before it
+        if (rd_cmds != n + 1)
+            m->pairing_errors += 1;
+
+        // Write data comes from the oldest read. The hardware would wait
+        // for a read that hasn't been issued, but the model can't, and a
+        // write longer or shorter than its read corrupts the stream.
+        uint64_t src_addr = 0;
+        if (n == rd_cmds)
+        {
+            m->stream_errors += 1;
+        }
+        else
+        {
+            src_addr = m->rd_fifo[n % CE_MODEL_RD_FIFO_DEPTH].addr;
+            if (m->rd_fifo[n % CE_MODEL_RD_FIFO_DEPTH].num_lines !=
+                m->wr_num_lines)
+            {
+                m->stream_errors += 1;
+                src_addr = 0;
+            }
+        }
+
+        // Addresses are host virtual addresses. Data is inverted, as in
+        // data_stream_engine.sv.
+        if (m->move_data && src_addr)
+        {
+            const uint64_t *src = (const uint64_t*)(uintptr_t)src_addr;
+            uint64_t *dst = (uint64_t*)(uintptr_t)(v & ~(uint64_t)1);
+            const uint64_t n_words = m->wr_num_lines * CE_MODEL_BUS_BYTES / 8;
+            for (uint64_t i = 0; i < n_words; i += 1)
+            {
+                dst[i] = ~src[i];
+            }
+        }
+
+        atomic_store_explicit(&m->wr_cmds, n + 1, memory_order_release);
+
+        // Lines are counted as they are written, before the completion
+        atomic_fetch_add_explicit(&m->wr_lines, m->wr_num_lines,
+                                  memory_order_release);
+
+        // The total number of write commands completed, as the hardware
+        // writes it, or an interrupt
+        if ((v & 1) && m->status_line)
+        {
+            *m->status_line = n + 1;
+        }
+        else if ((v & 1) && (m->intr_fd >= 0))
+        {
+            pthread_mutex_lock(&m->intr_lock);
+            m->intr_pending += 1;
+            model_send_intr(m);
+            pthread_mutex_unlock(&m->intr_lock);
+        }
+        break;
+      }
+      case 12:
+        pthread_mutex_lock(&m->intr_lock);
+        m->intr_busy = false;
+        model_send_intr(m);
+        pthread_mutex_unlock(&m->intr_lock);
+        break;
+      case 13:
+        m->status_line = (v & 1) ?
+            (volatile uint64_t*)(uintptr_t)(v & ~(uint64_t)1) : NULL;
+        break;
+      default:
+        break;
+    }
+}
+
+
+void ce_model_set_move_data(t_ce_model *m, bool move_data)
+{
+    m->move_data = move_data;
+}
+
+
+uint64_t ce_model_pairing_errors(const t_ce_model *m)
+{
+    return m->pairing_errors;
+}
+
+
+uint64_t ce_model_stream_errors(const t_ce_model *m)
+{
+    return m->stream_errors;
+}
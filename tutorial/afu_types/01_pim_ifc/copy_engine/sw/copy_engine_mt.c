@@ -0,0 +1,269 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Multi-threaded command submission. Threads claim command numbers from
+// a shared atomic counter, which is also the count of credits consumed,
+// and compare it to the completion count in the status line before
+// issuing. A command is a pair of writes, to register 9 and then 11, and
+// pairs from different threads must not interleave. Rather than holding
+// a lock around the pair, each thread publishes its command in a ring
+// slot indexed by its command number. Whichever thread finds the issue
+// flag clear writes every consecutive published command to the CSRs,
+// including those of other threads, so no thread ever waits for another
+// to finish issuing.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+// Commands per benchmark step
+#define CE_MT_BENCH_COMMANDS(is_ase_sim) ((is_ase_sim) ? 1536L : 4000000L)
+
+typedef struct
+{
+    alignas(64) _Atomic uint64_t seq;
+    uint64_t rd_addr;
+    uint64_t wr_addr;
+}
+t_ce_cmd_slot;
+
+typedef struct
+{
+    const t_ce_run *run;
+
+    // Next command number. Commands below it have consumed a credit.
+    alignas(64) _Atomic uint64_t next_cmd;
+    // Commands below end_cmd belong to the current step
+    uint64_t end_cmd;
+
+    // Set while a thread is writing commands to the CSRs
+    alignas(64) atomic_bool issuing;
+    // Commands below issued have been written to the CSRs
+    _Atomic uint64_t issued;
+
+    // One slot per credit, so a slot is always free when its command
+    // has a credit
+    uint64_t ring_mask;
+    t_ce_cmd_slot *ring;
+}
+t_ce_mt;
+
+
+static inline bool cmd_published(t_ce_mt *mt, uint64_t n)
+{
+    return atomic_load(&mt->ring[n & mt->ring_mask].seq) == n;
+}
+
+
+//
+// Write published commands to the CSRs in command order until the next
+// command isn't ready.
+//
+static void issue_published_cmds(t_ce_mt *mt)
+{
+    do
+    {
+        // Another thread is issuing and will find our command
+        if (atomic_exchange(&mt->issuing, true))
+            return;
+
+        uint64_t n = atomic_load_explicit(&mt->issued, memory_order_relaxed);
+        while (cmd_published(mt, n))
+        {
+            const t_ce_cmd_slot *slot = &mt->ring[n & mt->ring_mask];
+            writeMMIO64(mt->run->dev, 9, slot->rd_addr);
+            writeMMIO64(mt->run->dev, 11, slot->wr_addr);
+            n += 1;
+        }
+        atomic_store_explicit(&mt->issued, n, memory_order_relaxed);
+        ce_progress_issued(mt->run, n);
+
+        // The sequentially consistent store is a locked instruction on x86,
+        // so the MMIO writes above are posted before another thread can
+        // take over issuing.
+        atomic_store(&mt->issuing, false);
+
+        // A command published after the loop above but before the flag was
+        // cleared saw the flag set. Go around again for it.
+    }
+    while (cmd_published(mt, atomic_load(&mt->issued)));
+}
+
+
+static void* submit_thread(void *args)
+{
+    t_ce_mt *mt = args;
+    const t_ce_run *run = mt->run;
+    const uint32_t cpl_mask = run->completion_freq - 1;
+    const uint32_t cpl_shift = __builtin_ctz(run->completion_freq);
+
+    while (true)
+    {
+        const uint64_t n = atomic_fetch_add_explicit(&mt->next_cmd, 1,
+                                                     memory_order_relaxed);
+        if (n >= mt->end_cmd) break;
+
+        // Wait for a credit. Earlier commands are all owned by threads
+        // that aren't waiting for this one, so they will complete.
+        ce_wait_cpl(run, 0, n - run->max_reqs_in_flight + 1, NULL);
+
+        // Keep the interrupts waiting to be sent within the AFU's limit
+        // (see fixed_cpl_loop() in copy_engine.c)
+        if (run->use_interrupts)
+            ce_wait_cpl(run, 1, (n >> cpl_shift) - run->max_reqs_in_flight + 1,
+                        NULL);
+
+        const uint32_t buf_idx = n & (run->num_bufs - 1);
+        const uint32_t need_cpl = (n & cpl_mask) == cpl_mask;
+
+        t_ce_cmd_slot *slot = &mt->ring[n & mt->ring_mask];
+        slot->rd_addr = run->src_bufs[buf_idx].pa;
+        slot->wr_addr = run->dst_bufs[buf_idx].pa | need_cpl;
+        atomic_store(&slot->seq, n);
+
+        issue_published_cmds(mt);
+    }
+
+    return NULL;
+}
+
+
+int copy_engine_mt_bench(
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight,
+    uint32_t max_threads,
+    e_ce_wait_policy wait_policy)
+{
+    t_ce_run run;
+    int status = 0;
+
+    if (ce_run_open(dev, chunk_size, completion_freq, use_interrupts,
+                    max_reqs_in_flight, &run))
+        return -1;
+    if (ce_run_alloc_bufs(&run))
+    {
+        ce_run_close(&run);
+        return -1;
+    }
+    run.wait_policy = wait_policy;
+
+    // Spinning threads can't outnumber CPUs without stalling the command
+    // stream whenever a thread holding the next command is descheduled.
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((max_threads == 0) || (max_threads > CE_MT_BENCH_MAX_THREADS))
+        max_threads = CE_MT_BENCH_MAX_THREADS;
+    if ((num_cpus > 0) && (max_threads > num_cpus))
+        max_threads = num_cpus;
+
+    t_ce_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.run = &run;
+    mt.ring_mask = run.max_reqs_in_flight - 1;
+    mt.ring = aligned_alloc(alignof(t_ce_cmd_slot),
+                            sizeof(t_ce_cmd_slot) * run.max_reqs_in_flight);
+    assert(NULL != mt.ring);
+    for (uint32_t i = 0; i < run.max_reqs_in_flight; i += 1)
+    {
+        atomic_init(&mt.ring[i].seq, UINT64_MAX);
+    }
+
+    pthread_t threads[CE_MT_BENCH_MAX_THREADS];
+
+    // Every step ends on a completion so the status line shows when it is
+    // done
+    uint64_t step_cmds = CE_MT_BENCH_COMMANDS(dev->is_ase_sim);
+    step_cmds = (step_cmds + run.completion_freq - 1) &
+                ~(uint64_t)(run.completion_freq - 1);
+
+    printf("%8s %14s %12s\n", "threads", "Mcommands/s", "GB/s");
+
+    for (uint32_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    {
+        const uint64_t start_cmd = mt.end_cmd;
+        const uint64_t rd_lines = readMMIO64(dev, 6);
+        const uint64_t wr_lines = readMMIO64(dev, 7);
+
+        mt.end_cmd = start_cmd + step_cmds;
+        atomic_store(&mt.next_cmd, start_cmd);
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        uint32_t num_started = 0;
+        for (; num_started < num_threads; num_started += 1)
+        {
+            if (pthread_create(&threads[num_started], NULL, submit_thread, &mt))
+            {
+                fprintf(stderr, "Failed to create submission thread\n");
+                status = -1;
+                break;
+            }
+        }
+        if (0 == num_started) break;
+
+        // Without every thread, the remaining ones still finish the step
+        for (uint32_t i = 0; i < num_started; i += 1)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        ce_wait_cpl(&run, 0, mt.end_cmd, NULL);
+        // Register 7 counts write data before it commits. The step is
+        // done when its last interrupt has arrived.
+        if (run.use_interrupts)
+        {
+            const uint64_t num_intrs =
+                mt.end_cmd >> __builtin_ctz(run.completion_freq);
+            ce_wait_cpl(&run, 1, num_intrs, NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double total_sec = end_time.tv_sec - start_time.tv_sec +
+                           1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+
+        const uint64_t total_bytes = (readMMIO64(dev, 6) - rd_lines +
+                                      readMMIO64(dev, 7) - wr_lines) *
+                                     run.data_bus_num_bytes;
+        printf("%8d %14.2f %12.2f\n", num_threads,
+               step_cmds / total_sec * 1e-6,
+               total_bytes / total_sec / 1073741824.0);
+
+        const uint64_t expected_bytes = step_cmds * 2 * run.chunk_size;
+        if (expected_bytes != total_bytes)
+        {
+            printf("\n*** Expected %ld bytes but counted %ld ***\n",
+                   expected_bytes, total_bytes);
+            status = -1;
+        }
+
+        if (status) break;
+    }
+
+    if (dev->csr_model && ce_model_pairing_errors(dev->model))
+    {
+        printf("\n*** %ld commands had interleaved read and write addresses ***\n",
+               ce_model_pairing_errors(dev->model));
+        status = -1;
+    }
+
+    free(mt.ring);
+    ce_run_close(&run);
+
+    return status;
+}
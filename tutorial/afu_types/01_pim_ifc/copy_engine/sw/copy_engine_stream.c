@@ -0,0 +1,696 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Decoupled read and write command streams. Reads are written to
+// registers 8/9 and writes to 10/11 independently, each with its own
+// length. The write engine takes its data, including the last flag of
+// each burst, from the read stream, so a write's length must match its
+// read. A ring of read lengths, indexed by command number, is checked
+// against each write.
+//
+// Credits are counted against writes completed in the status line. A
+// read holds its slot until the write it feeds completes, which is
+// conservative but needs no MMIO reads. Writes never wait: a write
+// always follows its read, which already held a credit. Once the writes
+// catch up with the reads, the last completion requested is at most
+// completion_freq - 1 writes back, which is within the credit window, so
+// a reader only has to wait for writes that haven't been issued when the
+// writes lag.
+//
+// ce_stream_copy() splits a transfer of any length into the fewest
+// commands: full bursts and one shorter burst for the remainder.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+// Commands per pipeline test step
+#define CE_STREAM_TEST_CMDS(is_ase_sim) ((is_ase_sim) ? 512L : 1000000L)
+// Requests per mixed size benchmark step
+#define CE_STREAM_MIXED_REQS(is_ase_sim) ((is_ase_sim) ? 64L : 200000L)
+// Buffer slots used round-robin by the pipeline test
+#define CE_STREAM_TEST_SLOTS 64
+
+// Stream state of an engine
+struct t_ce_stream_ctx
+{
+    t_ce_dev *dev;
+    t_ce_run run;
+    uint64_t line_bytes;
+    uint64_t max_cmd_bytes;
+    uint64_t ring_mask;
+    // Lines of each read, indexed by read number
+    uint32_t *rd_lines;
+
+    // Owned by the thread issuing reads
+    alignas(64) uint64_t rd_cmd_lines;
+    _Atomic uint64_t rds_issued;
+
+    // Owned by the thread issuing writes
+    alignas(64) uint64_t wr_cmd_lines;
+    _Atomic uint64_t wrs_issued;
+    // Writes issued through the last one that requested a completion.
+    // The status line will reach it.
+    _Atomic uint64_t wrs_cpl_requested;
+};
+
+typedef struct t_ce_stream_ctx t_ce_stream_ctx;
+
+
+int ce_stream_init(t_ce_dev *dev)
+{
+    if (dev->stream)
+    {
+        fprintf(stderr, "ce_stream_init: already initialized\n");
+        return -1;
+    }
+
+    t_ce_stream_ctx *st = aligned_alloc(64, 64 * ((sizeof(t_ce_stream_ctx) + 63) / 64));
+    assert(NULL != st);
+    memset(st, 0, sizeof(t_ce_stream_ctx));
+    st->dev = dev;
+
+    // Largest bursts, default completion frequency and status line
+    // completions
+    if (ce_run_open(dev, 0, 0, false, 0, &st->run))
+    {
+        free(st);
+        return -1;
+    }
+    if (dev->csr_model) ce_model_set_move_data(dev->model, true);
+
+    const t_ce_run *run = &st->run;
+    st->line_bytes = run->data_bus_num_bytes;
+    st->max_cmd_bytes = run->chunk_size;
+    st->ring_mask = run->max_reqs_in_flight - 1;
+    st->rd_lines = calloc(run->max_reqs_in_flight, sizeof(uint32_t));
+    assert(NULL != st->rd_lines);
+
+    // ce_run_open() set registers 8 and 10 to the chunk size
+    st->rd_cmd_lines = run->chunk_size / run->data_bus_num_bytes;
+    st->wr_cmd_lines = st->rd_cmd_lines;
+    atomic_store(&st->rds_issued, 0);
+    atomic_store(&st->wrs_issued, 0);
+    atomic_store(&st->wrs_cpl_requested, 0);
+
+    dev->stream = st;
+    return 0;
+}
+
+
+void ce_stream_release(t_ce_dev *dev)
+{
+    t_ce_stream_ctx *st = dev->stream;
+    if (NULL == st) return;
+
+    ce_wait_cpl(&st->run, 0, atomic_load(&st->wrs_cpl_requested), NULL);
+    free(st->rd_lines);
+    ce_run_close(&st->run);
+    free(st);
+    dev->stream = NULL;
+}
+
+
+uint64_t ce_stream_max_cmd_bytes(t_ce_dev *dev)
+{
+    return dev->stream ? dev->stream->max_cmd_bytes : 0;
+}
+
+
+static int check_cmd(const t_ce_stream_ctx *st, const char *who,
+                     uint64_t iova, uint64_t len)
+{
+    if (NULL == st)
+    {
+        fprintf(stderr, "%s: not initialized\n", who);
+        return -1;
+    }
+    if ((len == 0) || (len > st->max_cmd_bytes) ||
+        ((iova | len) & (st->line_bytes - 1)))
+    {
+        fprintf(stderr, "%s: address 0x%lx and length %ld must be multiples "
+                "of %ld, with length up to %ld\n", who, iova, len,
+                st->line_bytes, st->max_cmd_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+
+int ce_stream_read(t_ce_dev *dev, uint64_t src_iova, uint64_t len)
+{
+    t_ce_stream_ctx *st = dev->stream;
+    if (check_cmd(st, "ce_stream_read", src_iova, len)) return -1;
+
+    const t_ce_run *run = &st->run;
+    const uint64_t n = atomic_load_explicit(&st->rds_issued,
+                                            memory_order_relaxed);
+
+    // Wait for a credit, unless no completion that has been requested
+    // would provide it
+    const uint64_t target = n - run->max_reqs_in_flight + 1;
+    if (!ce_cpl_reached(run, 0, target))
+    {
+        if ((int64_t)(atomic_load(&st->wrs_cpl_requested) - target) < 0)
+            return CE_STREAM_AGAIN;
+        ce_wait_cpl(run, 0, target, NULL);
+    }
+
+    // The length is latched along with each address, so commands
+    // already queued keep the old one.
+    const uint64_t lines = len / st->line_bytes;
+    if (lines != st->rd_cmd_lines)
+    {
+        st->rd_cmd_lines = lines;
+        writeMMIO64(dev, 8, lines - 1);
+    }
+
+    st->rd_lines[n & st->ring_mask] = lines;
+    writeMMIO64(dev, 9, src_iova);
+    atomic_store_explicit(&st->rds_issued, n + 1, memory_order_release);
+
+    return 0;
+}
+
+
+int ce_stream_write(t_ce_dev *dev, uint64_t dst_iova, uint64_t len,
+                    bool flush)
+{
+    t_ce_stream_ctx *st = dev->stream;
+    if (check_cmd(st, "ce_stream_write", dst_iova, len)) return -1;
+
+    const t_ce_run *run = &st->run;
+    const uint64_t cpl_mask = run->completion_freq - 1;
+    const uint64_t n = atomic_load_explicit(&st->wrs_issued,
+                                            memory_order_relaxed);
+    const uint64_t rds_issued = atomic_load_explicit(&st->rds_issued,
+                                                     memory_order_acquire);
+
+    // The write engine would wait for read data, but the length of the
+    // read can't be checked before it is issued
+    if (n == rds_issued) return CE_STREAM_AGAIN;
+
+    const uint64_t lines = len / st->line_bytes;
+    if (lines != st->rd_lines[n & st->ring_mask])
+    {
+        fprintf(stderr, "ce_stream_write: write %ld is %ld bytes but its read "
+                "is %ld\n", n, len,
+                st->rd_lines[n & st->ring_mask] * st->line_bytes);
+        return -1;
+    }
+
+    if (lines != st->wr_cmd_lines)
+    {
+        st->wr_cmd_lines = lines;
+        writeMMIO64(dev, 10, lines - 1);
+    }
+
+    const uint64_t need_cpl = flush || ((n & cpl_mask) == cpl_mask);
+    writeMMIO64(dev, 11, dst_iova | need_cpl);
+    if (need_cpl) atomic_store(&st->wrs_cpl_requested, n + 1);
+    atomic_store_explicit(&st->wrs_issued, n + 1, memory_order_release);
+    ce_progress_issued(run, n + 1);
+
+    return 0;
+}
+
+
+int ce_stream_copy(t_ce_dev *dev, uint64_t dst_iova, uint64_t src_iova,
+                   uint64_t len, bool flush)
+{
+    t_ce_stream_ctx *st = dev->stream;
+    if (NULL == st)
+    {
+        fprintf(stderr, "ce_stream_copy: not initialized\n");
+        return -1;
+    }
+    if (atomic_load(&st->wrs_issued) != atomic_load(&st->rds_issued))
+    {
+        fprintf(stderr, "ce_stream_copy: reads are waiting for writes\n");
+        return -1;
+    }
+    if ((len == 0) || (len & (st->line_bytes - 1)))
+    {
+        fprintf(stderr, "ce_stream_copy: length %ld must be a multiple of %ld\n",
+                len, st->line_bytes);
+        return -1;
+    }
+
+    uint64_t off = 0;
+    while (off < len)
+    {
+        uint64_t n = len - off;
+        if (n > st->max_cmd_bytes) n = st->max_cmd_bytes;
+
+        // With the writes caught up, the read always gets its credit
+        if (ce_stream_read(dev, src_iova + off, n) ||
+            ce_stream_write(dev, dst_iova + off, n, flush && (off + n == len)))
+        {
+            return -1;
+        }
+        off += n;
+    }
+
+    return 0;
+}
+
+
+uint64_t ce_stream_writes_completed(t_ce_dev *dev)
+{
+    return ce_cpl_count(&dev->stream->run, 0);
+}
+
+
+int ce_stream_wait(t_ce_dev *dev, uint64_t num_writes)
+{
+    t_ce_stream_ctx *st = dev->stream;
+
+    if (!ce_cpl_reached(&st->run, 0, num_writes))
+    {
+        if ((int64_t)(atomic_load(&st->wrs_cpl_requested) - num_writes) < 0)
+            return CE_STREAM_AGAIN;
+        ce_wait_cpl(&st->run, 0, num_writes, NULL);
+    }
+    return 0;
+}
+
+
+// ========================================================================
+//
+// Pipeline test
+//
+// ========================================================================
+
+typedef struct
+{
+    t_ce_dev *dev;
+    const t_pinned_buffer *src;
+    const t_pinned_buffer *dst;
+    uint64_t line_bytes;
+    uint64_t slot_bytes;
+    uint64_t max_lines;
+    // Commands are numbered from first_cmd
+    uint64_t first_cmd;
+    uint64_t num_cmds;
+    // Reads issued ahead of writes, single threaded
+    uint32_t lead;
+    // Set by either thread on failure
+    atomic_int status;
+}
+t_ce_stream_test;
+
+
+// Length of command n, varying from one line to the largest burst
+static inline uint64_t test_cmd_lines(const t_ce_stream_test *t, uint64_t n)
+{
+    uint64_t x = n * 0x9e3779b97f4a7c15UL;
+    x ^= x >> 29;
+    return 1 + (x % t->max_lines);
+}
+
+
+static int test_read(const t_ce_stream_test *t, uint64_t i)
+{
+    const uint64_t n = t->first_cmd + i;
+    return ce_stream_read(t->dev,
+                          t->src->pa + (n % CE_STREAM_TEST_SLOTS) * t->slot_bytes,
+                          test_cmd_lines(t, n) * t->line_bytes);
+}
+
+
+static int test_write(const t_ce_stream_test *t, uint64_t i)
+{
+    const uint64_t n = t->first_cmd + i;
+    return ce_stream_write(t->dev,
+                           t->dst->pa + (n % CE_STREAM_TEST_SLOTS) * t->slot_bytes,
+                           test_cmd_lines(t, n) * t->line_bytes,
+                           i + 1 == t->num_cmds);
+}
+
+
+//
+// One thread issues reads up to lead commands ahead of the writes
+//
+static void run_single_thread(t_ce_stream_test *t)
+{
+    uint64_t rd = 0;
+    uint64_t wr = 0;
+
+    while (wr < t->num_cmds)
+    {
+        if ((rd < t->num_cmds) && ((rd - wr) < t->lead))
+        {
+            const int r = test_read(t, rd);
+            if (r < 0) goto fail;
+            if (r == 0)
+            {
+                rd += 1;
+                continue;
+            }
+        }
+
+        const int r = test_write(t, wr);
+        if (r < 0) goto fail;
+        if (r == 0) wr += 1;
+    }
+    return;
+
+  fail:
+    t->status = -1;
+}
+
+
+static void* reader_thread(void *args)
+{
+    t_ce_stream_test *t = args;
+
+    for (uint64_t i = 0; i < t->num_cmds; )
+    {
+        const int r = test_read(t, i);
+        if (r < 0)
+        {
+            t->status = -1;
+            break;
+        }
+        // Waiting for the writer, which may need this CPU
+        if (r == CE_STREAM_AGAIN) sched_yield();
+        if (r == 0) i += 1;
+    }
+
+    return NULL;
+}
+
+
+//
+// Reads and writes from separate threads
+//
+static void run_two_threads(t_ce_stream_test *t)
+{
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_thread, t))
+    {
+        fprintf(stderr, "Failed to create reader thread\n");
+        t->status = -1;
+        return;
+    }
+
+    for (uint64_t i = 0; (i < t->num_cmds) && !t->status; )
+    {
+        const int r = test_write(t, i);
+        if (r < 0) t->status = -1;
+        if (r == CE_STREAM_AGAIN) sched_yield();
+        if (r == 0) i += 1;
+    }
+
+    pthread_join(reader, NULL);
+}
+
+
+//
+// The last write to each slot must hold the inverse of the source slot.
+// Every source slot holds the same data throughout.
+//
+static int check_slots(const t_ce_stream_test *t)
+{
+    const uint64_t end = t->first_cmd + t->num_cmds;
+
+    for (uint64_t k = 0; k < CE_STREAM_TEST_SLOTS; k += 1)
+    {
+        // Last command that wrote slot k
+        uint64_t n = end - 1 - ((end - 1 - k) % CE_STREAM_TEST_SLOTS);
+        if (n < t->first_cmd) continue;
+
+        const uint64_t words = test_cmd_lines(t, n) * t->line_bytes / 8;
+        const uint64_t *src = (const uint64_t*)(t->src->ptr + k * t->slot_bytes);
+        const uint64_t *dst = (const uint64_t*)(t->dst->ptr + k * t->slot_bytes);
+        for (uint64_t i = 0; i < words; i += 1)
+        {
+            if (dst[i] != ~src[i])
+            {
+                printf("  Mismatch in slot %ld, command %ld, word %ld\n",
+                       k, n, i);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+int ce_stream_pipeline_test(t_ce_dev *dev)
+{
+    int status = 0;
+
+    if (ce_stream_init(dev))
+        return -1;
+    const t_ce_stream_ctx *st = dev->stream;
+
+    t_ce_stream_test t;
+    memset(&t, 0, sizeof(t));
+    t.dev = dev;
+    t.line_bytes = st->line_bytes;
+    t.slot_bytes = st->max_cmd_bytes;
+    t.max_lines = st->max_cmd_bytes / st->line_bytes;
+    t.num_cmds = CE_STREAM_TEST_CMDS(dev->is_ase_sim);
+
+    t_pinned_buffer src, dst;
+    if (ce_buffer_acquire(dev, t.slot_bytes * CE_STREAM_TEST_SLOTS, &src))
+    {
+        ce_stream_release(dev);
+        return -1;
+    }
+    if (ce_buffer_acquire(dev, t.slot_bytes * CE_STREAM_TEST_SLOTS, &dst))
+    {
+        ce_buffer_release(dev, &src);
+        ce_stream_release(dev);
+        return -1;
+    }
+    t.src = &src;
+    t.dst = &dst;
+
+    uint64_t x = 0x12345678;
+    for (uint64_t i = 0; i < src.size / 8; i += 1)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        ((uint64_t*)src.ptr)[i] = x;
+    }
+
+    // Lock step, then reads further and further ahead, then reads and
+    // writes from separate threads (lead 0)
+    const uint32_t leads[] = { 1, 16, st->run.max_reqs_in_flight / 2,
+                               st->run.max_reqs_in_flight, 0 };
+    const uint32_t num_leads = sizeof(leads) / sizeof(leads[0]);
+
+    printf("Command lengths vary from %ld to %ld bytes\n\n",
+           st->line_bytes, st->max_cmd_bytes);
+    printf("%14s %14s %12s %8s\n", "reads ahead", "Mcommands/s", "GB/s", "check");
+
+    for (uint32_t l = 0; (l < num_leads) && !status; l += 1)
+    {
+        t.lead = leads[l];
+        t.status = 0;
+        memset((void*)dst.ptr, 0, dst.size);
+
+        const uint64_t rd_lines = readMMIO64(dev, 6);
+        const uint64_t wr_lines = readMMIO64(dev, 7);
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        if (t.lead)
+            run_single_thread(&t);
+        else
+            run_two_threads(&t);
+        if (!t.status)
+            t.status = ce_stream_wait(dev, t.first_cmd + t.num_cmds) ? -1 : 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double total_sec = end_time.tv_sec - start_time.tv_sec +
+                           1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+
+        const uint64_t total_bytes = (readMMIO64(dev, 6) - rd_lines +
+                                      readMMIO64(dev, 7) - wr_lines) *
+                                     st->line_bytes;
+        if (!t.status) t.status = check_slots(&t);
+
+        char lead_str[16];
+        if (t.lead)
+            snprintf(lead_str, sizeof(lead_str), "%d", t.lead);
+        else
+            snprintf(lead_str, sizeof(lead_str), "2 threads");
+        printf("%14s %14.2f %12.2f %8s\n", lead_str,
+               t.num_cmds / total_sec * 1e-6,
+               total_bytes / total_sec / 1073741824.0,
+               t.status ? "FAIL" : "PASS");
+
+        status = t.status;
+        t.first_cmd += t.num_cmds;
+    }
+
+    if (dev->csr_model && ce_model_stream_errors(dev->model))
+    {
+        printf("\n*** %ld commands broke the read/write stream protocol ***\n",
+               ce_model_stream_errors(dev->model));
+        status = -1;
+    }
+    printf("\n");
+
+    ce_buffer_release(dev, &src);
+    ce_buffer_release(dev, &dst);
+    ce_stream_release(dev);
+
+    return status;
+}
+
+
+// ========================================================================
+//
+// Mixed size benchmark
+//
+// ========================================================================
+
+// Request sizes, mostly small metadata with occasional large payloads.
+// Weights are out of 100.
+static const struct
+{
+    uint64_t bytes;
+    uint32_t weight;
+}
+s_mixed_sizes[] =
+{
+    { 64,              60 },
+    { 512,             25 },
+    { 64 * 1024,       14 },
+    { 2 * 1024 * 1024,  1 }
+};
+#define CE_STREAM_MIXED_NUM_SIZES (sizeof(s_mixed_sizes) / sizeof(s_mixed_sizes[0]))
+
+// Requests are 64 bytes in ASE, keeping simulation short
+static uint64_t mixed_req_bytes(uint64_t n, bool is_ase_sim)
+{
+    if (is_ase_sim) return s_mixed_sizes[0].bytes;
+
+    uint64_t x = n * 0x9e3779b97f4a7c15UL;
+    x ^= x >> 29;
+    uint32_t pick = x % 100;
+    for (uint32_t i = 0; i < CE_STREAM_MIXED_NUM_SIZES; i += 1)
+    {
+        if (pick < s_mixed_sizes[i].weight) return s_mixed_sizes[i].bytes;
+        pick -= s_mixed_sizes[i].weight;
+    }
+    return s_mixed_sizes[0].bytes;
+}
+
+
+int ce_stream_mixed_bench(t_ce_dev *dev)
+{
+    int status = 0;
+    const bool is_ase_sim = dev->is_ase_sim;
+
+    if (ce_stream_init(dev))
+        return -1;
+    t_ce_stream_ctx *st = dev->stream;
+
+    // Room for the largest request rounded up to a whole chunk
+    const uint64_t chunk = st->max_cmd_bytes;
+    const uint64_t buf_bytes = (s_mixed_sizes[CE_STREAM_MIXED_NUM_SIZES-1].bytes +
+                                chunk - 1) & ~(chunk - 1);
+    t_pinned_buffer src, dst;
+    if (ce_buffer_acquire(dev, buf_bytes, &src))
+    {
+        ce_stream_release(dev);
+        return -1;
+    }
+    if (ce_buffer_acquire(dev, buf_bytes, &dst))
+    {
+        ce_buffer_release(dev, &src);
+        ce_stream_release(dev);
+        return -1;
+    }
+    memset((void*)src.ptr, 0, buf_bytes);
+
+    const uint64_t num_reqs = CE_STREAM_MIXED_REQS(is_ase_sim);
+
+    printf("Request sizes:");
+    for (uint32_t i = 0; i < CE_STREAM_MIXED_NUM_SIZES; i += 1)
+    {
+        printf(" %ld bytes (%d%%)", s_mixed_sizes[i].bytes,
+               s_mixed_sizes[i].weight);
+    }
+    printf("\nFixed command length: %ld bytes\n\n", chunk);
+    printf("%10s %12s %12s %14s %14s %12s\n", "lengths", "Mrequests/s",
+           "Mcommands/s", "request GB/s", "moved GB/s", "efficiency");
+
+    for (uint32_t variable = 0; (variable < 2) && !status; variable += 1)
+    {
+        const uint64_t rd_lines = readMMIO64(dev, 6);
+        const uint64_t wr_lines = readMMIO64(dev, 7);
+        const uint64_t start_writes = atomic_load(&st->wrs_issued);
+        uint64_t req_bytes = 0;
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        for (uint64_t n = 0; (n < num_reqs) && !status; n += 1)
+        {
+            const uint64_t len = mixed_req_bytes(n, is_ase_sim);
+            req_bytes += len;
+
+            // The fixed baseline moves whole chunks, as it would with one
+            // length programmed for the whole run
+            const uint64_t cmd_len = variable ? len :
+                                     (len + chunk - 1) & ~(chunk - 1);
+            if (ce_stream_copy(dev, dst.pa, src.pa, cmd_len, n + 1 == num_reqs))
+                status = -1;
+        }
+
+        const uint64_t num_writes = atomic_load(&st->wrs_issued);
+        if (!status && ce_stream_wait(dev, num_writes)) status = -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double total_sec = end_time.tv_sec - start_time.tv_sec +
+                           1e-9 * (end_time.tv_nsec - start_time.tv_nsec);
+
+        // Bytes crossing the bus in both directions
+        const uint64_t moved_bytes = (readMMIO64(dev, 6) - rd_lines +
+                                      readMMIO64(dev, 7) - wr_lines) *
+                                     st->line_bytes;
+        printf("%10s %12.2f %12.2f %14.2f %14.2f %11.1f%%\n",
+               variable ? "variable" : "fixed",
+               num_reqs / total_sec * 1e-6,
+               (num_writes - start_writes) / total_sec * 1e-6,
+               2 * req_bytes / total_sec / 1073741824.0,
+               moved_bytes / total_sec / 1073741824.0,
+               100.0 * 2 * req_bytes / moved_bytes);
+    }
+
+    if (dev->csr_model && ce_model_stream_errors(dev->model))
+    {
+        printf("\n*** %ld commands broke the read/write stream protocol ***\n",
+               ce_model_stream_errors(dev->model));
+        status = -1;
+    }
+    printf("\n");
+
+    ce_buffer_release(dev, &src);
+    ce_buffer_release(dev, &dst);
+    ce_stream_release(dev);
+
+    return status;
+}
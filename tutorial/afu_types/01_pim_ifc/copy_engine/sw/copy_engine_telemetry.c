@@ -0,0 +1,371 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Telemetry thread. While a run is in progress it samples the engine's
+// line counters (registers 6 and 7), the commands issued and completed
+// and the time submitters spent stalled for credit at a fixed interval.
+// Samples are appended to a CSV or JSON time series and the latest one
+// can be served in Prometheus text format on a UNIX socket, e.g.:
+//
+//   curl --unix-socket /tmp/ce.sock http://localhost/metrics
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+typedef struct
+{
+    double time_sec;
+    uint64_t rd_lines;
+    uint64_t wr_lines;
+    // Read plus write bandwidth over the last interval
+    double gbps;
+    uint64_t cmds_issued;
+    uint64_t cmds_completed;
+    // Percent of the last interval spent stalled for credit
+    double stall_pct;
+}
+t_ce_sample;
+
+struct t_ce_telemetry
+{
+    const t_ce_run *run;
+    uint32_t interval_ms;
+    pthread_t thread;
+    // Written to stop the thread
+    int stop_pipe[2];
+
+    FILE *out;
+    bool json;
+    uint64_t num_samples;
+
+    int listen_fd;
+    char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+    // Starting values, for counters that are never reset
+    uint64_t base_rd_lines;
+    uint64_t base_wr_lines;
+    uint64_t base_cmds_completed;
+    uint64_t start_ns;
+
+    t_ce_sample last;
+    uint64_t last_stall_ns;
+};
+
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+//
+// Stall time so far, including a stall still in progress
+//
+static uint64_t stall_ns(const t_ce_progress *p, uint64_t now)
+{
+    uint64_t ns = atomic_load_explicit(&p->stall_ns, memory_order_relaxed);
+    const uint64_t start = atomic_load_explicit(&p->stall_start_ns,
+                                                memory_order_relaxed);
+    if (start && (now > start)) ns += now - start;
+    return ns;
+}
+
+
+static void take_sample(t_ce_telemetry *t)
+{
+    const t_ce_run *run = t->run;
+    const uint64_t now = now_ns();
+    t_ce_sample s;
+
+    s.time_sec = 1e-9 * (now - t->start_ns);
+    s.rd_lines = readMMIO64(run->dev, 6) - t->base_rd_lines;
+    s.wr_lines = readMMIO64(run->dev, 7) - t->base_wr_lines;
+    s.cmds_issued = atomic_load_explicit(&run->progress->cmds_issued,
+                                         memory_order_relaxed);
+    s.cmds_completed = run->status_line[0] - t->base_cmds_completed;
+
+    // The status line may be written before the issue count is published
+    if (s.cmds_completed > s.cmds_issued) s.cmds_completed = s.cmds_issued;
+
+    const double dt = s.time_sec - t->last.time_sec;
+    const uint64_t stall = stall_ns(run->progress, now);
+    if (dt > 0)
+    {
+        s.gbps = (s.rd_lines - t->last.rd_lines + s.wr_lines - t->last.wr_lines) *
+                 run->data_bus_num_bytes / dt / 1073741824.0;
+        s.stall_pct = 100.0 * 1e-9 * (stall - t->last_stall_ns) / dt;
+    }
+    else
+    {
+        s.gbps = 0;
+        s.stall_pct = 0;
+    }
+
+    if (t->out)
+    {
+        const uint64_t in_flight = s.cmds_issued - s.cmds_completed;
+        if (t->json)
+        {
+            fprintf(t->out, "%s\n  { \"time_s\": %.6f, \"read_lines\": %lu, "
+                    "\"write_lines\": %lu, \"gbps\": %.3f, "
+                    "\"commands_issued\": %lu, \"commands_completed\": %lu, "
+                    "\"commands_in_flight\": %lu, \"credit_stall_pct\": %.2f }",
+                    t->num_samples ? "," : "",
+                    s.time_sec, s.rd_lines, s.wr_lines, s.gbps, s.cmds_issued,
+                    s.cmds_completed, in_flight, s.stall_pct);
+        }
+        else
+        {
+            fprintf(t->out, "%.6f,%lu,%lu,%.3f,%lu,%lu,%lu,%.2f\n",
+                    s.time_sec, s.rd_lines, s.wr_lines, s.gbps, s.cmds_issued,
+                    s.cmds_completed, in_flight, s.stall_pct);
+        }
+        fflush(t->out);
+    }
+
+    t->num_samples += 1;
+    t->last = s;
+    t->last_stall_ns = stall;
+}
+
+
+//
+// Answer one connection with the latest sample. The request is read only
+// as far as it has arrived and is otherwise ignored. The reply is HTTP,
+// which Prometheus-style collectors and curl expect, and also readable
+// with a plain socket client.
+//
+static void serve_metrics(t_ce_telemetry *t)
+{
+    int fd = accept(t->listen_fd, NULL, NULL);
+    if (fd < 0) return;
+
+    char req[512];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 100) > 0)
+    {
+        if (read(fd, req, sizeof(req)) < 0) {};
+    }
+
+    const t_ce_sample *s = &t->last;
+    char body[2048];
+    int len = snprintf(body, sizeof(body),
+        "# HELP copy_engine_read_lines_total Lines read by the engine.\n"
+        "# TYPE copy_engine_read_lines_total counter\n"
+        "copy_engine_read_lines_total %lu\n"
+        "# HELP copy_engine_write_lines_total Lines written by the engine.\n"
+        "# TYPE copy_engine_write_lines_total counter\n"
+        "copy_engine_write_lines_total %lu\n"
+        "# HELP copy_engine_throughput_gbps Read plus write GB/s over the last interval.\n"
+        "# TYPE copy_engine_throughput_gbps gauge\n"
+        "copy_engine_throughput_gbps %.3f\n"
+        "# HELP copy_engine_commands_issued_total Copy commands issued.\n"
+        "# TYPE copy_engine_commands_issued_total counter\n"
+        "copy_engine_commands_issued_total %lu\n"
+        "# HELP copy_engine_commands_completed_total Copy commands completed.\n"
+        "# TYPE copy_engine_commands_completed_total counter\n"
+        "copy_engine_commands_completed_total %lu\n"
+        "# HELP copy_engine_commands_in_flight Commands issued and not completed.\n"
+        "# TYPE copy_engine_commands_in_flight gauge\n"
+        "copy_engine_commands_in_flight %lu\n"
+        "# HELP copy_engine_credit_stall_ratio Fraction of the last interval stalled for credit.\n"
+        "# TYPE copy_engine_credit_stall_ratio gauge\n"
+        "copy_engine_credit_stall_ratio %.4f\n",
+        s->rd_lines, s->wr_lines, s->gbps, s->cmds_issued, s->cmds_completed,
+        s->cmds_issued - s->cmds_completed, s->stall_pct / 100.0);
+
+    char hdr[128];
+    int hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %d\r\n\r\n", len);
+
+    // A client that has gone away must not raise SIGPIPE
+    if ((send(fd, hdr, hdr_len, MSG_NOSIGNAL) == hdr_len) &&
+        (send(fd, body, len, MSG_NOSIGNAL) == len)) {};
+    close(fd);
+}
+
+
+static void* telemetry_thread(void *args)
+{
+    t_ce_telemetry *t = args;
+    const uint64_t interval_ns = t->interval_ms * 1000000UL;
+    uint64_t next_ns = t->start_ns + interval_ns;
+
+    while (true)
+    {
+        struct pollfd pfd[2] = {
+            { .fd = t->stop_pipe[0], .events = POLLIN },
+            { .fd = t->listen_fd, .events = POLLIN }
+        };
+        const uint64_t now = now_ns();
+        const int timeout_ms = (next_ns > now) ?
+                               (next_ns - now + 999999) / 1000000 : 0;
+
+        const int n = poll(pfd, (t->listen_fd >= 0) ? 2 : 1, timeout_ms);
+        if ((n < 0) && (errno != EINTR)) break;
+        if ((n > 0) && (pfd[0].revents & POLLIN)) break;
+        if ((n > 0) && (pfd[1].revents & POLLIN)) serve_metrics(t);
+
+        if (now_ns() >= next_ns)
+        {
+            take_sample(t);
+            next_ns += interval_ns;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int open_socket(t_ce_telemetry *t, const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Telemetry socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace a socket left by an earlier run, but nothing else
+    struct stat st;
+    if ((0 == lstat(path, &st)) && S_ISSOCK(st.st_mode)) unlink(path);
+
+    t->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((t->listen_fd < 0) ||
+        bind(t->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(t->listen_fd, 4))
+    {
+        fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+        if (t->listen_fd >= 0) close(t->listen_fd);
+        t->listen_fd = -1;
+        return -1;
+    }
+    fcntl(t->listen_fd, F_SETFL, O_NONBLOCK);
+    strcpy(t->socket_path, path);
+
+    return 0;
+}
+
+
+t_ce_telemetry *ce_telemetry_start(const t_ce_run *run,
+                                   const t_ce_telemetry_cfg *cfg)
+{
+    if ((NULL == cfg) || (!cfg->path && !cfg->prom_socket))
+        return NULL;
+
+    t_ce_telemetry *t = calloc(1, sizeof(t_ce_telemetry));
+    assert(NULL != t);
+    t->run = run;
+    t->interval_ms = cfg->interval_ms ? cfg->interval_ms : 100;
+    t->listen_fd = -1;
+
+    if (cfg->path)
+    {
+        const size_t len = strlen(cfg->path);
+        t->json = (len > 5) && (0 == strcmp(cfg->path + len - 5, ".json"));
+
+        if (0 == strcmp(cfg->path, "-"))
+            t->out = stdout;
+        else
+            t->out = fopen(cfg->path, "w");
+        if (NULL == t->out)
+        {
+            fprintf(stderr, "Error: unable to open %s\n", cfg->path);
+            goto fail;
+        }
+
+        if (t->json)
+            fprintf(t->out, "{ \"interval_ms\": %d, \"samples\": [", t->interval_ms);
+        else
+            fprintf(t->out, "time_s,read_lines,write_lines,gbps,commands_issued,"
+                    "commands_completed,commands_in_flight,credit_stall_pct\n");
+    }
+
+    if (cfg->prom_socket && open_socket(t, cfg->prom_socket))
+        goto fail;
+
+    if (pipe(t->stop_pipe))
+        goto fail;
+
+    t->base_rd_lines = readMMIO64(run->dev, 6);
+    t->base_wr_lines = readMMIO64(run->dev, 7);
+    t->base_cmds_completed = run->status_line[0];
+    t->start_ns = now_ns();
+    t->last_stall_ns = stall_ns(run->progress, t->start_ns);
+
+    if (pthread_create(&t->thread, NULL, telemetry_thread, t))
+    {
+        close(t->stop_pipe[0]);
+        close(t->stop_pipe[1]);
+        goto fail;
+    }
+
+    return t;
+
+  fail:
+    if (t->out && (t->out != stdout)) fclose(t->out);
+    if (t->listen_fd >= 0)
+    {
+        close(t->listen_fd);
+        unlink(t->socket_path);
+    }
+    free(t);
+    return NULL;
+}
+
+
+void ce_telemetry_stop(t_ce_telemetry *t)
+{
+    if (NULL == t) return;
+
+    const char c = 0;
+    if (write(t->stop_pipe[1], &c, 1) != 1) {};
+    pthread_join(t->thread, NULL);
+    close(t->stop_pipe[0]);
+    close(t->stop_pipe[1]);
+
+    // The end of the run, which is rarely on an interval
+    take_sample(t);
+
+    if (t->out)
+    {
+        if (t->json) fprintf(t->out, "\n] }\n");
+        if (t->out != stdout)
+            fclose(t->out);
+        else
+            fflush(t->out);
+    }
+    if (t->listen_fd >= 0)
+    {
+        close(t->listen_fd);
+        unlink(t->socket_path);
+    }
+
+    printf("Telemetry: %ld samples\n", t->num_samples);
+    free(t);
+}
@@ -0,0 +1,286 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Autotuner. Measures short benchmark runs over a grid of chunk sizes,
+// requests in flight and completion frequencies and keeps the
+// configurations no other configuration beats on both throughput and
+// host CPU time. They are saved as a profile, one configuration per line,
+// that a launcher loads with ce_profile_load():
+//
+//   # chunk_size max_reqs_in_flight completion_freq interrupts wait gbps cpu_pct
+//   8192 512 64 0 sleep 21.40 37.5
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+// Commands in the first run of a configuration, long enough to fill the
+// request window many times over
+#define CE_TUNE_CMDS(is_ase_sim) ((is_ase_sim) ? 500L : 100000L)
+// Runs shorter than this are repeated with more commands, since short
+// intervals make the CPU time noisy. Not in ASE, where time is simulated.
+#define CE_TUNE_MIN_SEC(is_ase_sim) ((is_ase_sim) ? 0.0 : 0.05)
+#define CE_TUNE_MAX_CMDS 50000000L
+
+// Each parameter is searched down from its maximum by this factor
+#define CE_TUNE_STEP 4
+
+
+// Largest power of 2 <= v, for v > 0
+static uint32_t pow2_floor(uint32_t v)
+{
+    uint32_t p = 1;
+    while (p <= v / 2) p *= 2;
+    return p;
+}
+
+
+// Number of values searched from max down to 1
+static uint32_t tune_num_values(uint32_t max)
+{
+    uint32_t n = 0;
+    for (uint32_t v = max; v; v /= CE_TUNE_STEP) n += 1;
+    return n;
+}
+
+
+// Fastest first, then least CPU
+static int cmp_points(const void *a, const void *b)
+{
+    const t_ce_profile_point *pa = a;
+    const t_ce_profile_point *pb = b;
+
+    if (pa->gbps != pb->gbps) return (pa->gbps < pb->gbps) ? 1 : -1;
+    if (pa->cpu_pct != pb->cpu_pct) return (pa->cpu_pct > pb->cpu_pct) ? 1 : -1;
+    return 0;
+}
+
+
+//
+// Sort the points and move the Pareto front to the start. Walking from the
+// fastest point, a point is on the front when it uses less CPU than every
+// faster point. Returns the size of the front.
+//
+static uint32_t pareto_front(t_ce_profile_point *points, uint32_t num_points)
+{
+    qsort(points, num_points, sizeof(points[0]), cmp_points);
+
+    uint32_t num_front = 0;
+    for (uint32_t i = 0; i < num_points; i += 1)
+    {
+        if ((num_front == 0) ||
+            (points[i].cpu_pct < points[num_front - 1].cpu_pct))
+        {
+            points[num_front++] = points[i];
+        }
+    }
+
+    return num_front;
+}
+
+
+static void print_point(FILE *f, const t_ce_profile_point *p)
+{
+    fprintf(f, "%u %u %u %d %s %0.2f %0.1f\n",
+            p->chunk_size, p->max_reqs_in_flight, p->completion_freq,
+            p->use_interrupts, ce_wait_policy_name(p->wait_policy),
+            p->gbps, p->cpu_pct);
+}
+
+
+static int write_profile(const char *path, const t_ce_dev *afu,
+                         const t_ce_profile_point *front, uint32_t num_front)
+{
+    FILE *f = fopen(path, "w");
+    if (NULL == f)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "# copy_engine autotune profile: Pareto front of throughput and\n"
+               "# host CPU time, fastest first\n");
+    fprintf(f, "# AFU: %u MHz, %u byte bus, max burst %u, max requests %u\n",
+            afu->clock_mhz, afu->data_bus_num_bytes, afu->max_burst_len,
+            afu->max_avail_reqs_in_flight);
+    fprintf(f, "# chunk_size max_reqs_in_flight completion_freq interrupts wait gbps cpu_pct\n");
+    for (uint32_t i = 0; i < num_front; i += 1)
+    {
+        print_point(f, &front[i]);
+    }
+
+    if (fclose(f))
+    {
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int copy_engine_autotune(
+    t_ce_dev *dev,
+    bool use_interrupts,
+    e_ce_wait_policy wait_policy,
+    const char *profile_path)
+{
+    int status = 0;
+    const bool is_ase_sim = dev->is_ase_sim;
+    const bool quiet = dev->quiet;
+
+    const uint32_t max_burst_len = dev->max_burst_len;
+    const uint32_t max_reqs = pow2_floor(dev->max_avail_reqs_in_flight);
+
+    uint32_t num_points = 0;
+    for (uint32_t reqs = max_reqs; reqs; reqs /= CE_TUNE_STEP)
+        num_points += tune_num_values(reqs);
+    num_points *= tune_num_values(max_burst_len);
+
+    t_ce_profile_point *points = calloc(num_points, sizeof(points[0]));
+    assert(NULL != points);
+
+    printf("Autotune: %u configurations, interrupts %s, wait policy %s\n\n",
+           num_points, use_interrupts ? "on" : "off",
+           ce_wait_policy_name(wait_policy));
+    printf("%10s %8s %8s %8s %8s\n", "chunk", "reqs", "cpl freq", "GB/s", "CPU %");
+
+    uint32_t n = 0;
+    for (uint32_t lines = max_burst_len; lines; lines /= CE_TUNE_STEP)
+    {
+        for (uint32_t reqs = max_reqs; reqs; reqs /= CE_TUNE_STEP)
+        {
+            for (uint32_t freq = reqs; freq; freq /= CE_TUNE_STEP)
+            {
+                t_ce_run_result r;
+                uint64_t num_cmds = CE_TUNE_CMDS(is_ase_sim);
+
+                dev->quiet = true;
+                while (true)
+                {
+                    status = ce_bench_run(dev,
+                                          lines * dev->data_bus_num_bytes, freq,
+                                          use_interrupts, reqs, false,
+                                          wait_policy, num_cmds, NULL, &r);
+                    if (status || (r.total_sec >= CE_TUNE_MIN_SEC(is_ase_sim)) ||
+                        (num_cmds >= CE_TUNE_MAX_CMDS))
+                        break;
+
+                    // Aim a little past the minimum
+                    double scale = 1.25 * CE_TUNE_MIN_SEC(is_ase_sim) / r.total_sec;
+                    if (scale > 64) scale = 64;
+                    num_cmds = (uint64_t)(num_cmds * scale) + 1;
+                    if (num_cmds > CE_TUNE_MAX_CMDS) num_cmds = CE_TUNE_MAX_CMDS;
+                }
+                dev->quiet = quiet;
+                if (status)
+                {
+                    fprintf(stderr, "Autotune run failed: chunk %u, reqs %u, "
+                            "completion freq %u\n",
+                            lines * dev->data_bus_num_bytes, reqs, freq);
+                    goto done;
+                }
+
+                t_ce_profile_point *p = &points[n++];
+                p->chunk_size = r.chunk_size;
+                p->max_reqs_in_flight = r.max_reqs_in_flight;
+                p->completion_freq = r.completion_freq;
+                p->use_interrupts = use_interrupts;
+                p->wait_policy = wait_policy;
+                p->gbps = r.total_bytes / r.total_sec / 1073741824.0;
+                p->cpu_pct = 100.0 * r.cpu_sec / r.total_sec;
+
+                printf("%10u %8u %8u %8.2f %8.1f\n",
+                       p->chunk_size, p->max_reqs_in_flight,
+                       p->completion_freq, p->gbps, p->cpu_pct);
+            }
+        }
+    }
+    assert(n == num_points);
+
+    const uint32_t num_front = pareto_front(points, num_points);
+
+    printf("\nPareto front, fastest first:\n");
+    printf("%10s %8s %8s %8s %8s\n", "chunk", "reqs", "cpl freq", "GB/s", "CPU %");
+    for (uint32_t i = 0; i < num_front; i += 1)
+    {
+        printf("%10u %8u %8u %8.2f %8.1f\n",
+               points[i].chunk_size, points[i].max_reqs_in_flight,
+               points[i].completion_freq, points[i].gbps, points[i].cpu_pct);
+    }
+
+    status = write_profile(profile_path, dev, points, num_front);
+    if (0 == status)
+        printf("\nWrote %u configurations to %s\n", num_front, profile_path);
+
+  done:
+    free(points);
+    return status;
+}
+
+
+int ce_profile_load(const char *path, double max_cpu_pct,
+                    t_ce_profile_point *point)
+{
+    FILE *f = fopen(path, "r");
+    if (NULL == f)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int status = 0;
+    bool found = false;
+    char line[256];
+    uint32_t line_num = 0;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        line_num += 1;
+
+        const char *s = line + strspn(line, " \t");
+        if ((*s == '#') || (*s == '\n') || (*s == '\0')) continue;
+
+        t_ce_profile_point p;
+        int interrupts;
+        char wait[16];
+        if ((7 != sscanf(s, "%u %u %u %d %15s %lf %lf",
+                         &p.chunk_size, &p.max_reqs_in_flight,
+                         &p.completion_freq, &interrupts, wait,
+                         &p.gbps, &p.cpu_pct)) ||
+            ce_wait_policy_from_name(wait, &p.wait_policy) ||
+            (p.chunk_size == 0) ||
+            (p.max_reqs_in_flight & (p.max_reqs_in_flight - 1)) ||
+            (p.completion_freq & (p.completion_freq - 1)))
+        {
+            fprintf(stderr, "%s:%u: invalid profile entry\n", path, line_num);
+            status = -1;
+            break;
+        }
+        p.use_interrupts = (interrupts != 0);
+
+        if ((max_cpu_pct > 0) && (p.cpu_pct > max_cpu_pct)) continue;
+        if (!found || (p.gbps > point->gbps))
+        {
+            *point = p;
+            found = true;
+        }
+    }
+
+    fclose(f);
+
+    if ((0 == status) && !found)
+    {
+        fprintf(stderr, "%s: no configuration within %0.1f%% CPU\n",
+                path, max_cpu_pct);
+        status = -1;
+    }
+    return status;
+}
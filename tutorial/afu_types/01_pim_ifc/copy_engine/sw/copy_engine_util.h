@@ -0,0 +1,355 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+#ifndef __COPY_ENGINE_UTIL_H__
+#define __COPY_ENGINE_UTIL_H__
+
+//
+// State and CSR access shared by the copy engine modules.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "pinned_buffer_pool.h"
+
+//
+// Host memory model of the CSRs. Every command completes as soon as its
+// write address is written, so runs against the model measure only the
+// cost of generating commands. Completions are status line writes or,
+// when the status line is off, interrupts signaled on an eventfd. Callers
+// serialize writes to registers 9 and 11 as they must for the hardware.
+//
+typedef struct t_ce_model t_ce_model;
+
+t_ce_model *ce_model_create(void);
+void ce_model_destroy(t_ce_model *m);
+// Start a run. Clears the error counts but, like an open AFU, not the
+// command and line counters.
+void ce_model_reset(t_ce_model *m);
+uint64_t ce_model_read_csr(t_ce_model *m, uint32_t idx);
+void ce_model_write_csr(t_ce_model *m, uint32_t idx, uint64_t v);
+
+// Eventfd on which the model signals interrupts
+int ce_model_intr_fd(t_ce_model *m);
+
+// Move data for each command, treating addresses as host virtual
+// addresses. Off by default, since benchmarks don't read their data.
+void ce_model_set_move_data(t_ce_model *m, bool move_data);
+
+// Number of write commands that did not immediately follow exactly one
+// read command. Non-zero when threads interleave the register 9/11 pairs.
+uint64_t ce_model_pairing_errors(const t_ce_model *m);
+
+// Number of commands that broke the read/write stream protocol: writes
+// with no read outstanding, writes whose length differs from the read
+// feeding them and reads beyond the request limit. Decoupled streams may
+// have pairing errors but must not have these.
+uint64_t ce_model_stream_errors(const t_ce_model *m);
+
+
+//
+// An open engine (copy_engine.h): the AFU handle or CSR model, the AFU's
+// properties and the state of the APIs built on it
+//
+struct t_ce_dev
+{
+    fpga_handle accel_handle;
+    bool is_ase_sim;
+    bool csr_model;
+    // Pointer to the mapped CSRs or NULL
+    volatile uint64_t *mmio_buf;
+    // Host memory model of the CSRs, when csr_model is set
+    t_ce_model *model;
+    // Skip the reports printed by ce_run_open(), ce_bench_run() and
+    // ce_dev_close()
+    bool quiet;
+
+    // AFU properties from register 5
+    uint32_t clock_mhz;
+    uint32_t data_bus_num_bytes;
+    uint32_t num_interrupt_ids;
+    uint32_t max_avail_reqs_in_flight;
+    uint32_t max_burst_len;
+
+    // Pinned buffers are recycled through a pool so that repeated runs
+    // don't pay for pinning and IOMMU mapping again. NULL with the model.
+    t_pinned_buffer_pool *buf_pool;
+    // The FPGA's NUMA node or -1
+    int numa_node;
+
+    // The engine takes commands from one run at a time. Set by
+    // ce_run_open() and cleared by ce_run_close().
+    atomic_bool busy;
+    // Commands issued by the runs closed so far. The engine's completion
+    // count and line counters are only cleared by an AFU reset, so each
+    // run is measured from where the last one left off.
+    uint64_t cmds_issued;
+
+    // ce_copy() state, guarded by copy_lock, and ce_stream_*() state.
+    // NULL until initialized.
+    pthread_mutex_t copy_lock;
+    struct t_ce_copy_ctx *copy;
+    struct t_ce_stream_ctx *stream;
+};
+
+
+//
+// Read a 64 bit CSR. When a pointer to CSR buffer is available, read directly.
+// Direct reads can be significantly faster.
+//
+static inline uint64_t readMMIO64(const t_ce_dev *dev, uint32_t idx)
+{
+    if (dev->mmio_buf)
+    {
+        return dev->mmio_buf[idx];
+    }
+    else if (dev->model)
+    {
+        return ce_model_read_csr(dev->model, idx);
+    }
+    else
+    {
+        fpga_result r;
+        uint64_t v;
+        r = fpgaReadMMIO64(dev->accel_handle, 0, 8 * idx, &v);
+        assert(FPGA_OK == r);
+        return v;
+    }
+}
+
+
+//
+// Write a 64 bit CSR. When a pointer to CSR buffer is available, write directly.
+//
+static inline void writeMMIO64(const t_ce_dev *dev, uint32_t idx, uint64_t v)
+{
+    if (dev->mmio_buf)
+    {
+        dev->mmio_buf[idx] = v;
+    }
+    else if (dev->model)
+    {
+        ce_model_write_csr(dev->model, idx, v);
+    }
+    else
+    {
+        fpgaWriteMMIO64(dev->accel_handle, 0, 8 * idx, v);
+    }
+}
+
+
+//
+// Sleeping waiters block on seq, bumped by the interrupt thread after it
+// updates the status line
+//
+typedef struct
+{
+    _Atomic uint32_t seq;
+    _Atomic uint32_t num_sleepers;
+}
+t_ce_cpl_wake;
+
+//
+// Completion state in host memory, updated by the interrupt thread or by
+// the CSR model
+//
+typedef struct
+{
+    uint64_t status_line[2];
+    t_ce_cpl_wake cpl_wake;
+}
+t_ce_host_status;
+
+//
+// Progress published by the code issuing commands, for telemetry
+//
+typedef struct
+{
+    // Commands written to the CSRs
+    _Atomic uint64_t cmds_issued;
+    // Total time spent waiting in ce_wait_cpl() and, while a wait is in
+    // progress, when it started. With several waiting threads, the start
+    // is the most recent.
+    _Atomic uint64_t stall_ns;
+    _Atomic uint64_t stall_start_ns;
+}
+t_ce_progress;
+
+//
+// A configured engine: AFU properties, the run parameters after fitting
+// them to the AFU, source and destination buffers and completion state.
+//
+typedef struct
+{
+    t_ce_dev *dev;
+
+    // AFU properties from register 5
+    uint32_t clock_mhz;
+    uint32_t data_bus_num_bytes;
+    uint32_t num_interrupt_ids;
+    uint32_t max_avail_reqs_in_flight;
+    uint32_t max_burst_len;
+
+    uint32_t chunk_size;
+    uint32_t completion_freq;
+    uint32_t max_reqs_in_flight;
+    bool use_interrupts;
+    // Set after ce_run_open(), which picks CE_WAIT_SPIN
+    e_ce_wait_policy wait_policy;
+    // Length of a benchmark run. ce_run_open() picks the platform default.
+    uint64_t num_cmds;
+
+    // Groups of buffers used round-robin by commands, each carved from
+    // one pinned buffer
+    uint32_t num_bufs;
+    t_pinned_buffer *src_bufs;
+    t_pinned_buffer *dst_bufs;
+    t_pinned_buffer src_mem;
+    t_pinned_buffer dst_mem;
+
+    // status_line[0] is the number of commands the engine has completed,
+    // written by the FPGA or, with interrupts, by the interrupt thread.
+    // With interrupts, status_line[1] is the number of interrupts received.
+    // Both are counted by the run from cpl_base, so completion targets
+    // start at 0 in every run.
+    volatile uint64_t *status_line;
+    uint64_t cpl_base[2];
+    t_pinned_buffer status_buf;
+    t_ce_host_status *host_status;
+    pthread_t intr_thread;
+    fpga_event_handle intr_handle;
+    int intr_fd;
+    // Registers 6 and 7 when the run was opened
+    uint64_t base_rd_lines;
+    uint64_t base_wr_lines;
+    // NULL unless the interrupt thread updates the status line
+    t_ce_cpl_wake *cpl_wake;
+
+    t_ce_progress *progress;
+}
+t_ce_run;
+
+// Claim the engine, fit the parameters to the AFU and set up
+// completions. A chunk_size of 0 picks the largest burst. Returns 0 on
+// success and -1 on bad parameters or when another run holds the engine.
+int ce_run_open(t_ce_dev *dev,
+                uint32_t chunk_size,
+                uint32_t completion_freq,
+                bool use_interrupts,
+                uint32_t max_reqs_in_flight,
+                t_ce_run *run);
+
+// Allocate the source and destination buffer groups for a run that
+// issues commands round-robin from them. Returns 0 on success.
+int ce_run_alloc_bufs(t_ce_run *run);
+
+// Stop interrupt handling, release the buffers and the engine
+void ce_run_close(t_ce_run *run);
+
+// Get a buffer the engine can reach: pinned from the pool or, with the
+// CSR model, ordinary memory whose IOVA is its address. Returns 0 on
+// success.
+int ce_buffer_acquire(t_ce_dev *dev, uint64_t size, t_pinned_buffer *buf);
+void ce_buffer_release(t_ce_dev *dev, const t_pinned_buffer *buf);
+
+
+//
+// Waiting for completions (copy_engine_wait.c)
+//
+typedef struct
+{
+    uint64_t waits;
+    uint64_t wait_ns;
+    uint64_t umwaits;
+    uint64_t sleeps;
+}
+t_ce_wait_stats;
+
+// Completions counted by status_line[idx] since the run was opened
+static inline uint64_t ce_cpl_count(const t_ce_run *run, uint32_t idx)
+{
+    return run->status_line[idx] - run->cpl_base[idx];
+}
+
+// Has status_line[idx] reached target? The difference is signed so that
+// targets computed as count - window wrap below zero as "reached".
+static inline bool ce_cpl_reached(const t_ce_run *run, uint32_t idx,
+                                  uint64_t target)
+{
+    return (int64_t)(ce_cpl_count(run, idx) - target) >= 0;
+}
+
+void ce_wait_cpl_slow(const t_ce_run *run, uint32_t idx, uint64_t target,
+                      t_ce_wait_stats *stats);
+
+// Wait for status_line[idx] to reach target using the run's wait policy.
+// stats may be NULL.
+static inline void ce_wait_cpl(const t_ce_run *run, uint32_t idx,
+                               uint64_t target, t_ce_wait_stats *stats)
+{
+    if (!ce_cpl_reached(run, idx, target))
+        ce_wait_cpl_slow(run, idx, target, stats);
+}
+
+// Called by the interrupt thread after updating the status line
+void ce_wait_wake(const t_ce_run *run);
+
+static inline void ce_progress_issued(const t_ce_run *run, uint64_t cmds_issued)
+{
+    atomic_store_explicit(&run->progress->cmds_issued, cmds_issued,
+                          memory_order_relaxed);
+}
+
+
+//
+// Measurements of one benchmark run
+//
+typedef struct
+{
+    // Parameters after ce_run_open() fit them to the AFU
+    uint32_t chunk_size;
+    uint32_t completion_freq;
+    uint32_t max_reqs_in_flight;
+
+    double total_sec;
+    // CPU time of the whole process, including the interrupt thread
+    double cpu_sec;
+    uint64_t total_bytes;
+    t_ce_wait_stats wait;
+}
+t_ce_run_result;
+
+// Open a run, issue num_cmds commands round-robin over the buffers (0 for
+// the default length) and check the line counters. Returns 0 on success.
+// result->total_sec is 0 when the run never started.
+int ce_bench_run(
+    t_ce_dev *dev,
+    uint32_t chunk_size,
+    uint32_t completion_freq,
+    bool use_interrupts,
+    uint32_t max_reqs_in_flight,
+    bool adaptive_cpl,
+    e_ce_wait_policy wait_policy,
+    uint64_t num_cmds,
+    const t_ce_telemetry_cfg *telemetry_cfg,
+    t_ce_run_result *result);
+
+
+//
+// Telemetry thread (copy_engine_telemetry.c). Returns NULL when cfg asks
+// for nothing or on failure, which is reported.
+//
+typedef struct t_ce_telemetry t_ce_telemetry;
+
+t_ce_telemetry *ce_telemetry_start(const t_ce_run *run,
+                                   const t_ce_telemetry_cfg *cfg);
+// Take a last sample, close the outputs and print the sample count
+void ce_telemetry_stop(t_ce_telemetry *t);
+
+#endif // __COPY_ENGINE_UTIL_H__
@@ -0,0 +1,230 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Waiting for completions. The spin policy is the original busy loop.
+// The others escalate while the wait continues: PAUSE first, so short
+// waits stay fast, then UMWAIT on the status line where the CPU has it,
+// then sleeping. A sleeper blocks on a futex the interrupt thread wakes
+// or, with FPGA status line writes, which can't wake anything, for a
+// fixed interval.
+//
+
+// syscall()
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+// UMONITOR/UMWAIT intrinsics appeared in GCC 9
+#if defined(__clang__) || (__GNUC__ >= 9)
+#define CE_HAVE_WAITPKG 1
+#endif
+#endif
+
+#include <opae/fpga.h>
+#include "copy_engine.h"
+#include "copy_engine_util.h"
+
+// Time spent in each tier before moving to the next
+#define CE_WAIT_PAUSE_NS   2000
+#define CE_WAIT_UMWAIT_NS  100000
+// Longest single UMWAIT, in TSC cycles
+#define CE_WAIT_UMWAIT_CYCLES 20000
+// Sleep interval without a notifier, and the futex timeout with one
+#define CE_WAIT_SLEEP_NS   50000
+#define CE_WAIT_FUTEX_NS   1000000
+
+static const char *s_policy_names[CE_WAIT_NUM_POLICIES] =
+{
+    "spin", "pause", "umwait", "sleep"
+};
+
+
+const char *ce_wait_policy_name(e_ce_wait_policy policy)
+{
+    return (policy < CE_WAIT_NUM_POLICIES) ? s_policy_names[policy] : "?";
+}
+
+
+int ce_wait_policy_from_name(const char *name, e_ce_wait_policy *policy)
+{
+    for (int i = 0; i < CE_WAIT_NUM_POLICIES; i += 1)
+    {
+        if (0 == strcasecmp(name, s_policy_names[i]))
+        {
+            *policy = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+#ifdef CE_HAVE_WAITPKG
+
+static bool have_waitpkg(void)
+{
+    static int s_have_waitpkg = -1;
+    if (s_have_waitpkg < 0)
+    {
+        unsigned int a, b, c, d;
+        s_have_waitpkg = __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+                         (c & (1 << 5));
+    }
+    return s_have_waitpkg;
+}
+
+//
+// Arm a monitor on the status line word and, unless it already changed,
+// wait in the C0.2 state until it is written or the deadline passes.
+// The OS may cap the wait (umwait_control/max_time in sysfs).
+//
+__attribute__((target("waitpkg")))
+static void umwait_cpl(const t_ce_run *run, uint32_t idx, uint64_t target)
+{
+    _umonitor((void*)&run->status_line[idx]);
+    if (ce_cpl_reached(run, idx, target)) return;
+    _umwait(0, __rdtsc() + CE_WAIT_UMWAIT_CYCLES);
+}
+
+#else
+
+static bool have_waitpkg(void)
+{
+    return false;
+}
+
+static void umwait_cpl(const t_ce_run *run, uint32_t idx, uint64_t target)
+{
+    cpu_relax();
+}
+
+#endif
+
+
+static void sleep_cpl(const t_ce_run *run, uint32_t idx, uint64_t target)
+{
+    t_ce_cpl_wake *wake = run->cpl_wake;
+
+    if (NULL == wake)
+    {
+        // Nothing will signal a status line write from the FPGA
+        struct timespec ts = { 0, CE_WAIT_SLEEP_NS };
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    // Announce the sleeper before sampling the sequence. If the interrupt
+    // thread updates the status line after the check below, it bumps the
+    // sequence afterward, so either the futex sees a new value or the
+    // thread sees a sleeper and wakes it.
+    atomic_fetch_add(&wake->num_sleepers, 1);
+    const uint32_t seq = atomic_load(&wake->seq);
+    if (!ce_cpl_reached(run, idx, target))
+    {
+        struct timespec ts = { 0, CE_WAIT_FUTEX_NS };
+        syscall(SYS_futex, &wake->seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+    }
+    atomic_fetch_sub(&wake->num_sleepers, 1);
+}
+
+
+void ce_wait_cpl_slow(const t_ce_run *run, uint32_t idx, uint64_t target,
+                      t_ce_wait_stats *stats)
+{
+    const e_ce_wait_policy policy = run->wait_policy;
+    const uint64_t start_ns = now_ns();
+    atomic_store_explicit(&run->progress->stall_start_ns, start_ns,
+                          memory_order_relaxed);
+
+    // The last tier the policy allows, then the end of each tier
+    const bool use_umwait = (policy >= CE_WAIT_UMWAIT) && have_waitpkg();
+    const bool use_sleep = (policy == CE_WAIT_SLEEP);
+    const uint64_t pause_end_ns = start_ns + CE_WAIT_PAUSE_NS;
+    const uint64_t umwait_end_ns = pause_end_ns +
+                                   (use_umwait ? CE_WAIT_UMWAIT_NS : 0);
+
+    if (policy == CE_WAIT_SPIN)
+    {
+        while (!ce_cpl_reached(run, idx, target)) {};
+    }
+    else
+    {
+        uint64_t t = start_ns;
+        uint32_t iter = 0;
+
+        while (!ce_cpl_reached(run, idx, target))
+        {
+            if ((t < pause_end_ns) || (!use_umwait && !use_sleep))
+            {
+                cpu_relax();
+                // Reading the clock costs more than a PAUSE
+                if ((++iter & 63) == 0) t = now_ns();
+            }
+            else if (use_umwait && ((t < umwait_end_ns) || !use_sleep))
+            {
+                umwait_cpl(run, idx, target);
+                if (stats) stats->umwaits += 1;
+                t = now_ns();
+            }
+            else
+            {
+                sleep_cpl(run, idx, target);
+                if (stats) stats->sleeps += 1;
+                t = now_ns();
+            }
+        }
+    }
+
+    const uint64_t wait_ns = now_ns() - start_ns;
+    atomic_fetch_add_explicit(&run->progress->stall_ns, wait_ns,
+                              memory_order_relaxed);
+    atomic_store_explicit(&run->progress->stall_start_ns, 0,
+                          memory_order_relaxed);
+
+    if (stats)
+    {
+        stats->waits += 1;
+        stats->wait_ns += wait_ns;
+    }
+}
+
+
+void ce_wait_wake(const t_ce_run *run)
+{
+    t_ce_cpl_wake *wake = run->cpl_wake;
+    if (NULL == wake) return;
+
+    atomic_fetch_add(&wake->seq, 1);
+    if (atomic_load(&wake->num_sleepers))
+        syscall(SYS_futex, &wake->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
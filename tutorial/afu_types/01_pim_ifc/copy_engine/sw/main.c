@@ -16,12 +16,31 @@
 // State from the AFU's JSON file, extracted using OPAE's afu_json_mgr script
 #include "afu_json_info.h"
 #include "copy_engine.h"
+#include "numa_util.h"
 
 
 static uint32_t chunk_size = 8192;
 static uint32_t completion_freq = 32;
 static uint32_t max_reqs_in_flight = 0;
 static bool use_interrupts = false;
+static uint32_t max_threads = 0;
+static bool csr_model = false;
+static bool copy_test = false;
+static bool pipeline_test = false;
+static bool mixed_bench = false;
+static t_ce_telemetry_cfg telemetry;
+static bool adaptive_cpl = false;
+static e_ce_wait_policy wait_policy = CE_WAIT_SPIN;
+static bool wait_bench = false;
+static const char *autotune_path = NULL;
+static const char *profile_path = NULL;
+static double cpu_budget = 0;
+
+// Options given explicitly, which take precedence over a profile
+static bool chunk_size_set = false;
+static bool completion_freq_set = false;
+static bool max_reqs_set = false;
+static bool wait_policy_set = false;
 
 
 //
@@ -34,7 +53,15 @@ help(void)
            "Usage:\n"
            "    copy_engine [-h] [--chunk-size=<num bytes>]\n"
            "                     [--completion-freq=<commands per completion>]\n"
-           "                     [--interrupts]\n"
+           "                     [--adaptive-cpl] [--interrupts]\n"
+           "                     [--wait=<policy>] [--wait-bench]\n"
+           "                     [--threads=<max threads>]\n"
+           "                     [--csr-model] [--copy-test] [--pipeline-test]\n"
+           "                     [--mixed-bench]\n"
+           "                     [--telemetry=<file>] [--telemetry-interval=<ms>]\n"
+           "                     [--prometheus-socket=<path>]\n"
+           "                     [--autotune=<profile>]\n"
+           "                     [--profile=<profile>] [--cpu-budget=<percent>]\n"
            "\n"
            "      -h,--help             Print this help\n"
            "\n"
@@ -44,10 +71,45 @@ help(void)
            "                            overhead decreases as this value increases, since\n"
            "                            multiple completions are signaled with a single\n"
            "                            operation.\n"
+           "      -a,--adaptive-cpl     Tune the completion frequency while running,\n"
+           "                            starting from --completion-freq. Each change\n"
+           "                            is logged.\n"
            "      -i,--interrupts       Use interrupts to signal completion of a command.\n"
            "                            When not set, completion is signaled by a write\n"
            "                            to host memory.\n"
            "      -m,--max-reqs         Maximum number of commands in flight.\n"
+           "      -w,--wait             How to wait for credits: spin (default), pause,\n"
+           "                            umwait or sleep. Each policy after spin adds\n"
+           "                            a tier: PAUSE, then UMWAIT on the status line,\n"
+           "                            then sleeping.\n"
+           "      -W,--wait-bench       Run once with each wait policy and compare\n"
+           "                            run time with CPU time consumed.\n"
+           "      -t,--threads          Benchmark commands per second with 1, 2, 4, ...\n"
+           "                            up to this many threads issuing commands.\n"
+           "      -C,--copy-test        Check ce_copy() on user buffers of several sizes\n"
+           "                            and measure its bandwidth.\n"
+           "      -P,--pipeline-test    Issue reads ahead of writes with varying\n"
+           "                            command lengths and check the data.\n"
+           "      -X,--mixed-bench      Compare fixed and per-command lengths on a mix\n"
+           "                            of small and large requests.\n"
+           "      -T,--telemetry        Sample bandwidth, commands in flight and credit\n"
+           "                            stalls during the run and write them to <file>,\n"
+           "                            as JSON when it ends in .json and otherwise as\n"
+           "                            CSV. \"-\" writes CSV to stdout.\n"
+           "      -I,--telemetry-interval  Sampling interval. (Default: 100ms)\n"
+           "      -S,--prometheus-socket   Serve the latest sample in Prometheus text\n"
+           "                            format on a UNIX socket during the run.\n"
+           "      -A,--autotune         Measure throughput and CPU time over chunk sizes,\n"
+           "                            requests in flight and completion frequencies\n"
+           "                            and write the Pareto front to <profile>.\n"
+           "                            --interrupts and --wait are held fixed.\n"
+           "      -p,--profile          Run with the fastest configuration in <profile>.\n"
+           "                            Options given explicitly take precedence.\n"
+           "      -B,--cpu-budget       With --profile, pick the fastest configuration\n"
+           "                            using at most this percentage of one CPU.\n"
+           "      -M,--csr-model        Send commands to a host memory model of the\n"
+           "                            CSRs instead of the FPGA. Commands complete\n"
+           "                            immediately, leaving only software costs.\n"
            "\n");
 }
 
@@ -55,7 +117,7 @@ help(void)
 //
 // Parse command line arguments
 //
-#define GETOPT_STRING ":hc:f:im:"
+#define GETOPT_STRING ":hc:f:aim:w:Wt:MCPXT:I:S:A:p:B:"
 static int
 parse_args(int argc, char *argv[])
 {
@@ -63,8 +125,22 @@ parse_args(int argc, char *argv[])
         {"help",            no_argument,       NULL, 'h'},
         {"chunk-size",      required_argument, NULL, 'c'},
         {"completion-freq", required_argument, NULL, 'f'},
+        {"adaptive-cpl",    no_argument,       NULL, 'a'},
         {"interrupts",      no_argument,       NULL, 'i'},
         {"max-reqs",        required_argument, NULL, 'm'},
+        {"wait",            required_argument, NULL, 'w'},
+        {"wait-bench",      no_argument,       NULL, 'W'},
+        {"threads",         required_argument, NULL, 't'},
+        {"csr-model",       no_argument,       NULL, 'M'},
+        {"copy-test",       no_argument,       NULL, 'C'},
+        {"pipeline-test",   no_argument,       NULL, 'P'},
+        {"mixed-bench",     no_argument,       NULL, 'X'},
+        {"telemetry",       required_argument, NULL, 'T'},
+        {"telemetry-interval", required_argument, NULL, 'I'},
+        {"prometheus-socket",  required_argument, NULL, 'S'},
+        {"autotune",        required_argument, NULL, 'A'},
+        {"profile",         required_argument, NULL, 'p'},
+        {"cpu-budget",      required_argument, NULL, 'B'},
         {0, 0, 0, 0}
     };
 
@@ -93,6 +169,7 @@ parse_args(int argc, char *argv[])
                 fprintf(stderr, "Invalid chunk size: %s\n", tmp_optarg);
                 return -1;
             }
+            chunk_size_set = true;
             break;
 
         case 'f': /* completion-freq */
@@ -106,6 +183,11 @@ parse_args(int argc, char *argv[])
                 fprintf(stderr, "Completion frequency must be a power of 2: %s\n", tmp_optarg);
                 return -1;
             }
+            completion_freq_set = true;
+            break;
+
+        case 'a': /* adaptive-cpl */
+            adaptive_cpl = true;
             break;
 
         case 'i': /* interrupts */
@@ -123,6 +205,79 @@ parse_args(int argc, char *argv[])
                 fprintf(stderr, "Maximum requests in flight must be a power of 2: %s\n", tmp_optarg);
                 return -1;
             }
+            max_reqs_set = true;
+            break;
+
+        case 'w': /* wait */
+            if (ce_wait_policy_from_name(tmp_optarg, &wait_policy)) {
+                fprintf(stderr, "Invalid wait policy: %s\n", tmp_optarg);
+                return -1;
+            }
+            wait_policy_set = true;
+            break;
+
+        case 'W': /* wait-bench */
+            wait_bench = true;
+            break;
+
+        case 't': /* threads */
+            endptr = NULL;
+            max_threads = (uint32_t)strtoul(tmp_optarg, &endptr, 0);
+            if ((endptr != tmp_optarg + strlen(tmp_optarg)) || (max_threads == 0)) {
+                fprintf(stderr, "Invalid thread count: %s\n", tmp_optarg);
+                return -1;
+            }
+            break;
+
+        case 'M': /* csr-model */
+            csr_model = true;
+            break;
+
+        case 'C': /* copy-test */
+            copy_test = true;
+            break;
+
+        case 'P': /* pipeline-test */
+            pipeline_test = true;
+            break;
+
+        case 'X': /* mixed-bench */
+            mixed_bench = true;
+            break;
+
+        case 'T': /* telemetry */
+            telemetry.path = tmp_optarg;
+            break;
+
+        case 'I': /* telemetry-interval */
+            endptr = NULL;
+            telemetry.interval_ms = (uint32_t)strtoul(tmp_optarg, &endptr, 0);
+            if ((endptr != tmp_optarg + strlen(tmp_optarg)) ||
+                (telemetry.interval_ms == 0)) {
+                fprintf(stderr, "Invalid telemetry interval: %s\n", tmp_optarg);
+                return -1;
+            }
+            break;
+
+        case 'S': /* prometheus-socket */
+            telemetry.prom_socket = tmp_optarg;
+            break;
+
+        case 'A': /* autotune */
+            autotune_path = tmp_optarg;
+            break;
+
+        case 'p': /* profile */
+            profile_path = tmp_optarg;
+            break;
+
+        case 'B': /* cpu-budget */
+            endptr = NULL;
+            cpu_budget = strtod(tmp_optarg, &endptr);
+            if ((endptr != tmp_optarg + strlen(tmp_optarg)) || (cpu_budget <= 0)) {
+                fprintf(stderr, "Invalid CPU budget: %s\n", tmp_optarg);
+                return -1;
+            }
             break;
 
         case ':': /* missing option argument */
@@ -141,6 +296,39 @@ parse_args(int argc, char *argv[])
         return -1;
     }
 
+    if ((cpu_budget > 0) && !profile_path) {
+        fprintf(stderr, "--cpu-budget requires --profile\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+//
+// Take the parameters not given on the command line from a profile
+// written by --autotune.
+//
+static int
+apply_profile(void)
+{
+    t_ce_profile_point point;
+
+    if (ce_profile_load(profile_path, cpu_budget, &point))
+        return -1;
+
+    if (!chunk_size_set) chunk_size = point.chunk_size;
+    if (!completion_freq_set) completion_freq = point.completion_freq;
+    if (!max_reqs_set) max_reqs_in_flight = point.max_reqs_in_flight;
+    if (!wait_policy_set) wait_policy = point.wait_policy;
+    use_interrupts = use_interrupts || point.use_interrupts;
+
+    printf("Profile %s: chunk size %d, max requests %d, completion freq %d, "
+           "interrupts %s, wait %s (%0.2f GB/s, %0.1f%% CPU when tuned)\n\n",
+           profile_path, chunk_size, max_reqs_in_flight, completion_freq,
+           use_interrupts ? "on" : "off", ce_wait_policy_name(wait_policy),
+           point.gbps, point.cpu_pct);
+
     return 0;
 }
 
@@ -205,29 +393,80 @@ static fpga_handle connect_to_accel(const char *accel_uuid, bool *is_ase_sim)
 int main(int argc, char *argv[])
 {
     fpga_result r;
-    fpga_handle accel_handle;
-    bool is_ase_sim;
+    fpga_handle accel_handle = NULL;
+    bool is_ase_sim = false;
 
     if (parse_args(argc, argv) < 0)
         return 1;
 
-    // Find and connect to the accelerator(s)
-    accel_handle = connect_to_accel(AFU_ACCEL_UUID, &is_ase_sim);
-    if (NULL == accel_handle) return 0;
+    if (profile_path && apply_profile())
+        return 1;
+
+    // Find and connect to the accelerator(s). The CSR model needs no FPGA.
+    if (!csr_model)
+    {
+        accel_handle = connect_to_accel(AFU_ACCEL_UUID, &is_ase_sim);
+        if (NULL == accel_handle) return 0;
+    }
 
     if (is_ase_sim)
     {
         printf("Running in ASE mode\n");
     }
 
+    t_ce_dev *dev = ce_dev_open(accel_handle, is_ase_sim, csr_model);
+    if (NULL == dev)
+    {
+        if (accel_handle) fpgaClose(accel_handle);
+        return 1;
+    }
+
+    // Run on the FPGA's NUMA node, where the buffers are. Threads started
+    // by the tests, including the interrupt thread, inherit the binding.
+    const int numa_node = ce_dev_numa_node(dev);
+    if ((numa_node >= 0) && numa_bind_thread(numa_node))
+        fprintf(stderr, "Warning: unable to bind to NUMA node %d\n", numa_node);
+
     // Run tests
     int status = 0;
-    status = copy_engine(accel_handle, is_ase_sim,
-                         chunk_size, completion_freq, use_interrupts,
-                         max_reqs_in_flight);
+    if (copy_test)
+    {
+        status = ce_copy_test(dev);
+    }
+    else if (pipeline_test)
+    {
+        status = ce_stream_pipeline_test(dev);
+    }
+    else if (mixed_bench)
+    {
+        status = ce_stream_mixed_bench(dev);
+    }
+    else if (autotune_path)
+    {
+        status = copy_engine_autotune(dev, use_interrupts, wait_policy,
+                                      autotune_path);
+    }
+    else if (max_threads)
+    {
+        status = copy_engine_mt_bench(dev, chunk_size, completion_freq,
+                                      use_interrupts, max_reqs_in_flight,
+                                      max_threads, wait_policy);
+    }
+    else if (wait_bench)
+    {
+        status = copy_engine_wait_bench(dev, chunk_size, completion_freq,
+                                        use_interrupts, max_reqs_in_flight);
+    }
+    else
+    {
+        status = copy_engine(dev, chunk_size, completion_freq, use_interrupts,
+                             max_reqs_in_flight, adaptive_cpl, wait_policy,
+                             &telemetry);
+    }
 
     // Done
-    fpgaClose(accel_handle);
+    ce_dev_close(dev);
+    if (accel_handle) fpgaClose(accel_handle);
 
     return status;
 }
@@ -5,8 +5,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 #include <poll.h>
 #include <pthread.h>
 #include <time.h>
@@ -17,17 +19,63 @@
 #include <opae/fpga.h>
 #include "dma.h"
 #include "dma_util.h"
-
+#include "pinned_buffer_pool.h"
+#include "crc32c.h"
+#include "numa_util.h"
+
+//
+// Engine state. There is one engine per AFU and one AFU per process, so
+// the state is file scope rather than a context object passed to every
+// call. Only one thread may call into this file at a time. Threads that
+// share the engine go through the submitter in dma_mt.c.
+//
 static fpga_handle s_accel_handle;
 static bool s_is_ase_sim;
 static volatile uint64_t *s_mmio_buf;
+// Host memory model of the CSRs, used in place of the AFU when
+// s_csr_model is set
+static bool s_csr_model;
+static t_dma_model *s_model;
 static int s_error_count = 0;
+static t_pinned_buffer_pool *s_buf_pool;
+// NUMA node of the FPGA, -1 when unknown
+static int s_numa_node = -1;
+
+// AFU interrupt used to end blocking completion waits early. s_intr_fd is
+// -1 when the AFU or driver has no interrupt to offer.
+static fpga_event_handle s_intr_handle;
+static int s_intr_fd = -1;
+
+// Descriptors written to the FIFO and descriptors retired by the engine.
+// Tickets are the value of s_desc_submitted after a descriptor is written,
+// so ticket t is complete once s_desc_completed >= t. s_hw_desc_count is
+// the last value of the 4 bit completed descriptor count in the status
+// register.
+static uint64_t s_desc_submitted;
+static uint64_t s_desc_completed;
+static uint32_t s_hw_desc_count;
+
+// Descriptors that have been written but not yet retired, indexed by
+// ticket. The engine services its FIFO in order, so entries retire in
+// ticket order.
+typedef struct {
+  dma_ticket_t ticket;
+  dma_descriptor_t desc;
+  uint64_t submit_ns;
+} t_inflight_desc;
+
+static t_inflight_desc s_inflight[DMA_DESCRIPTOR_FIFO_DEPTH];
+#define INFLIGHT_SLOT(ticket) ((ticket) & (DMA_DESCRIPTOR_FIFO_DEPTH - 1))
+
+// Submit to retire latency of each descriptor
+static t_latency_hist s_desc_latency;
 
 static uint64_t dma_dfh_offset = -256*1024;
 
 // Shorter runs for ASE
 #define TOTAL_COPY_COMMANDS (s_is_ase_sim ? 1500L : 1000000L)
-#define DMA_BUFFER_SIZE (1024*1024)
+// Large enough for the biggest basic test transfer
+#define DMA_BUFFER_SIZE (2048*1024)
 
 #define TEST_BUFFER_SIZE_ASE 2048 * 1024
 #define TEST_BUFFER_SIZE_HW 2048 * 1024
@@ -41,8 +89,6 @@ static uint64_t dma_dfh_offset = -256*1024;
     }                                                                          \
   } while (0)
 
-#define BW_GIGA 1000000
-
 void print_err(const char *s, fpga_result res) {
   fprintf(stderr, "Error %s: %s\n", s, fpgaErrStr(res));
 }
@@ -52,6 +98,8 @@ void print_err(const char *s, fpga_result res) {
 static inline uint64_t readMMIO64(uint32_t idx) {
   if (s_mmio_buf) {
     return s_mmio_buf[idx];
+  } else if (s_model) {
+    return dma_model_read_csr(s_model, idx);
   } else {
     fpga_result r;
     uint64_t v;
@@ -80,25 +128,69 @@ void mmio_read64_silent(fpga_handle accel_handle, uint64_t addr,
 static inline void writeMMIO64(uint32_t idx, uint64_t v) {
   if (s_mmio_buf) {
     s_mmio_buf[idx] = v;
+  } else if (s_model) {
+    dma_model_write_csr(s_model, idx, v);
   } else {
     fpgaWriteMMIO64(s_accel_handle, 0, 8 * idx, v);
   }
 }
 
+volatile void *alloc_io_shared_buffer(fpga_handle accel_handle, ssize_t size,
+                                      uint64_t *wsid, uint64_t *io_addr) {
+  t_pinned_buffer buf;
+
+  // The CSR model takes host virtual addresses as IOVAs
+  if (s_model) {
+    void *ptr;
+    if (posix_memalign(&ptr, sysconf(_SC_PAGESIZE), size))
+      return NULL;
+    *wsid = 0;
+    *io_addr = (uint64_t)(uintptr_t)ptr;
+    return ptr;
+  }
+
+  if (NULL == s_buf_pool) {
+    s_buf_pool = pinned_buffer_pool_create(accel_handle);
+    if (NULL == s_buf_pool)
+      return NULL;
+  }
+
+  if (pinned_buffer_acquire(s_buf_pool, size, &buf))
+    return NULL;
+
+  *wsid = buf.wsid;
+  *io_addr = buf.pa;
+  return buf.ptr;
+}
+
+void free_io_shared_buffer(fpga_handle accel_handle, volatile void *buf,
+                           ssize_t size, uint64_t wsid, uint64_t io_addr) {
+  const t_pinned_buffer pinned = {
+      .ptr = buf, .wsid = wsid, .pa = io_addr, .size = size};
+
+  if (s_model) {
+    free((void *)buf);
+    return;
+  }
+  pinned_buffer_release(s_buf_pool, &pinned);
+}
+
+uint64_t dma_csr_read(uint32_t idx) { return readMMIO64(idx); }
+
+// Performance counter totals when get_bandwidth() was last called
+static t_dma_perf_totals s_bw_totals;
+
 double get_bandwidth(e_dma_mode descriptor_mode) {
-  uint64_t rd_src_clk_cnt;
-  uint64_t rd_src_valid_cnt;
-  uint64_t wr_dest_clk_cnt;
-  uint64_t wr_dest_valid_cnt;
-  uint64_t wr_dest_bw;
+  // Everything the engine did since the previous call is attributed to the
+  // transfer being measured. The sampling service accumulates the 20 bit
+  // hardware counters into 64 bit totals, so long transfers don't wrap.
+  t_dma_perf_totals now, delta;
+  dma_perf_get(&now);
+  dma_perf_delta(&now, &s_bw_totals, &delta);
+  s_bw_totals = now;
 
   // Gather Read statistics and calculate bandwidth
-  const uint64_t rd_src_perf_cntr = readMMIO64(DMA_CSR_IDX_RD_SRC_PERF_CNTR);
-  rd_src_valid_cnt = rd_src_perf_cntr & 0xFFFFF; // keep lower 20 bits
-  rd_src_clk_cnt = rd_src_perf_cntr >> 20;       // Keep upper 20 bits
-  rd_src_clk_cnt &= 0xFFFFF;
-  const double read_uptime = (rd_src_valid_cnt * 1.0) / (rd_src_clk_cnt * 1.0);
-  const double read_bandwidth = read_uptime * MAX_TRPT_BYTES / 1000.0;
+  const double read_bandwidth = dma_perf_bandwidth(&delta.rd);
   if (descriptor_mode == ddr_to_host) {
     printf("\nAFU Reading DDR ");
   } else {
@@ -113,13 +205,7 @@ double get_bandwidth(e_dma_mode descriptor_mode) {
   }
 
   // Gather Write statistics and calculate bandwidth
-  const uint64_t wr_dest_perf_cntr = readMMIO64(DMA_CSR_IDX_WR_DEST_PERF_CNTR);
-  wr_dest_valid_cnt = wr_dest_perf_cntr & 0xFFFFF;
-  wr_dest_clk_cnt = wr_dest_perf_cntr >> 20;
-  wr_dest_clk_cnt &= 0xFFFFF;
-  const double write_uptime =
-      (wr_dest_valid_cnt * 1.0) / (wr_dest_clk_cnt * 1.0);
-  const double write_bandwidth = write_uptime * MAX_TRPT_BYTES / 1000.0;
+  const double write_bandwidth = dma_perf_bandwidth(&delta.wr);
   if (descriptor_mode == ddr_to_host) {
     printf("Host to AFU ");
   } else {
@@ -204,50 +290,220 @@ void send_descriptor(fpga_handle accel_handle, uint64_t mmio_dst,
   // mmio requires 8 byte alignment
   assert(mmio_dst % 8 == 0);
 
-  uint32_t dev_addr = mmio_dst;
+  if (s_mmio_buf) {
+    dma_store_descriptor(s_mmio_buf + mmio_dst / 8 - DMA_CSR_IDX_SRC_ADDR,
+                         &desc);
+    return;
+  }
 
+  uint32_t dev_addr = mmio_dst;
   fpgaWriteMMIO64(accel_handle, 0, dev_addr, desc.src_address);
-  printf("Writing %lX to address %X\n", desc.src_address, dev_addr);
   dev_addr += 8;
   fpgaWriteMMIO64(accel_handle, 0, dev_addr, desc.dest_address);
-  printf("Writing %lX to address %X\n", desc.dest_address, dev_addr);
   dev_addr += 8;
   fpgaWriteMMIO64(accel_handle, 0, dev_addr, desc.len);
-  printf("Writing %X to address %X\n", desc.len, dev_addr);
   dev_addr += 8;
   fpgaWriteMMIO64(accel_handle, 0, dev_addr, desc.control);
-  printf("Writing %X to address %X\n", desc.control, dev_addr);
+}
+
+volatile uint64_t *dma_mmio_base(void) { return s_mmio_buf; }
+
+int dma_numa_node(void) { return s_numa_node; }
+
+void dma_use_csr_model(bool csr_model) { s_csr_model = csr_model; }
+
+bool dma_is_csr_model(void) { return s_csr_model; }
+
+uint64_t dma_fpga_mem_addr(uint64_t dev_addr) {
+  const uint64_t bank = dev_addr / DMA_FPGA_MEM_BANK_SIZE;
+  assert(bank < DMA_FPGA_NUM_MEM_BANKS);
+
+  return (bank << DMA_FPGA_BANK_SEL_SHIFT) |
+         (dev_addr & DMA_FPGA_MEM_BANK_ADDR_MASK);
+}
+
+void dma_init_descriptor(dma_descriptor_t *desc, e_dma_mode mode,
+                         uint64_t src, uint64_t dest, uint32_t len) {
+  desc->src_address = src;
+  desc->dest_address = dest;
+  desc->len = len;
+  desc->control = DESCRIPTOR_GO | (mode << MODE_SHIFT);
+}
+
+// Write a descriptor to the CSR window. Mapped MMIO is far cheaper than a
+// library call per CSR, so use it whenever it is available.
+static inline void write_descriptor(const dma_descriptor_t *desc) {
+  if (s_mmio_buf) {
+    dma_store_descriptor(s_mmio_buf, desc);
+  } else if (s_model) {
+    writeMMIO64(DMA_CSR_IDX_SRC_ADDR, desc->src_address);
+    writeMMIO64(DMA_CSR_IDX_DEST_ADDR, desc->dest_address);
+    writeMMIO64(DMA_CSR_IDX_LENGTH, desc->len);
+    writeMMIO64(DMA_CSR_IDX_DESCRIPTOR_CONTROL, desc->control);
+  } else {
+    fpgaWriteMMIO64(s_accel_handle, 0, 8 * DMA_CSR_IDX_SRC_ADDR,
+                    desc->src_address);
+    fpgaWriteMMIO64(s_accel_handle, 0, 8 * DMA_CSR_IDX_DEST_ADDR,
+                    desc->dest_address);
+    fpgaWriteMMIO64(s_accel_handle, 0, 8 * DMA_CSR_IDX_LENGTH, desc->len);
+    fpgaWriteMMIO64(s_accel_handle, 0, 8 * DMA_CSR_IDX_DESCRIPTOR_CONTROL,
+                    desc->control);
+  }
+}
+
+// Read the engine's completed descriptor count and retire newly finished
+// descriptors from the in-flight table. Returns the number retired or -1 if
+// the engine stopped on an error.
+static int update_completions(void) {
+  const uint64_t status = readMMIO64(DMA_CSR_IDX_STATUS);
+  const uint32_t hw_count =
+      (status >> DMA_STATUS_DESC_COUNT_SHIFT) & DMA_STATUS_DESC_COUNT_MASK;
+  const uint32_t num_retired =
+      (hw_count - s_hw_desc_count) & DMA_STATUS_DESC_COUNT_MASK;
+
+  const uint64_t now_ns = num_retired ? latency_now_ns() : 0;
+  for (uint32_t i = 0; i < num_retired; i++) {
+    s_desc_completed += 1;
+    const t_inflight_desc *entry = &s_inflight[INFLIGHT_SLOT(s_desc_completed)];
+    assert(entry->ticket == s_desc_completed);
+    latency_hist_record(&s_desc_latency, now_ns - entry->submit_ns);
+  }
+  s_hw_desc_count = hw_count;
+
+  if (status & DMA_STATUS_STOPPED_ON_ERROR) {
+    fprintf(stderr, "Error: DMA engine stopped on error (status %016lX)\n",
+            status);
+    s_error_count += 1;
+    return -1;
+  }
+  return num_retired;
+}
+
+dma_ticket_t dma_submit(fpga_handle accel_handle,
+                        const dma_descriptor_t *desc) {
+  // Credit is tracked on the host. Status is only read when the host's
+  // view of the descriptor FIFO is full.
+  if ((s_desc_submitted - s_desc_completed) >= DMA_MAX_DESC_IN_FLIGHT) {
+    if ((update_completions() < 0) ||
+        dma_wait(accel_handle,
+                 s_desc_submitted - DMA_MAX_DESC_IN_FLIGHT + 1, false))
+      return 0;
+  }
+
+  const dma_ticket_t ticket = s_desc_submitted + 1;
+  t_inflight_desc *entry = &s_inflight[INFLIGHT_SLOT(ticket)];
+  entry->ticket = ticket;
+  entry->desc = *desc;
+  entry->submit_ns = latency_now_ns();
+
+  write_descriptor(desc);
+  s_desc_submitted = ticket;
+
+  return ticket;
+}
+
+int dma_poll(fpga_handle accel_handle) {
+  if (s_desc_completed == s_desc_submitted)
+    return 0;
+
+  return update_completions();
+}
+
+bool dma_ticket_done(dma_ticket_t ticket) {
+  return s_desc_completed >= ticket;
+}
+
+uint32_t dma_inflight(void) {
+  return s_desc_submitted - s_desc_completed;
+}
+
+dma_ticket_t dma_last_retired(void) { return s_desc_completed; }
+
+// Block for up to timeout_us, returning early if the AFU raises an
+// interrupt.
+static void wait_for_event(uint32_t timeout_us) {
+  if (s_intr_fd >= 0) {
+    struct pollfd pfd = {.fd = s_intr_fd, .events = POLLIN};
+    const int timeout_ms = (timeout_us + 999) / 1000;
+
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+      uint64_t count;
+      if (read(s_intr_fd, &count, sizeof(count)) < 0)
+        fprintf(stderr, "Interrupt read error: %s\n", strerror(errno));
+    }
+  } else {
+    const struct timespec ts = {.tv_sec = timeout_us / 1000000,
+                                .tv_nsec = (timeout_us % 1000000) * 1000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+int dma_wait(fpga_handle accel_handle, dma_ticket_t ticket, bool verbose) {
+  assert(ticket <= s_desc_submitted);
+
+  // Short transfers finish within the spin window, so most waits never
+  // give up the CPU. Longer ones stop spinning and back off.
+  const uint64_t spin_end_ns =
+      s_is_ase_sim ? 0 : latency_now_ns() + DMA_WAIT_SPIN_NS;
+  const uint32_t backoff_max_us =
+      s_is_ase_sim ? DMA_WAIT_BACKOFF_MAX_US_ASE : DMA_WAIT_BACKOFF_MAX_US;
+  uint32_t backoff_us = DMA_WAIT_BACKOFF_MIN_US;
+
+  while (!dma_ticket_done(ticket)) {
+    if (update_completions() < 0)
+      return -1;
+    if (dma_ticket_done(ticket) || (latency_now_ns() < spin_end_ns))
+      continue;
+
+    wait_for_event(backoff_us);
+    backoff_us = (2 * backoff_us < backoff_max_us) ? 2 * backoff_us
+                                                    : backoff_max_us;
+    if (verbose && s_is_ase_sim)
+      print_csrs();
+  }
+
+  return 0;
+}
+
+void dma_latency_reset(void) { latency_hist_reset(&s_desc_latency); }
+
+const t_latency_hist *dma_latency(void) { return &s_desc_latency; }
+
+int dma_submit_batch(fpga_handle accel_handle, const dma_descriptor_t *descs,
+                     uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    if (dma_submit(accel_handle, &descs[i]) == 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int dma_wait_idle(fpga_handle accel_handle, bool verbose) {
+  return dma_wait(accel_handle, s_desc_submitted, verbose);
 }
 
 void dma_transfer(fpga_handle accel_handle, e_dma_mode mode, uint64_t dev_src,
                   uint64_t dev_dest, int len, bool verbose) {
   // Performance tracking variables
-  clock_t start, end;
+  uint64_t start_ns, end_ns;
   double sw_bandwidth;
 
-  fpga_result res = FPGA_OK;
-
   // dma requires 64 byte alignment
   assert(dev_src % 64 == 0);
   assert(dev_dest % 64 == 0);
 
-  // only 32bit for now
-  const uint64_t MASK_FOR_32BIT_ADDR = 0xFFFFFFFF;
+  // Device memory addresses carry the bank select in their high bits.
+  // Host addresses are passed through at full width.
+  if ((mode == ddr_to_host) || (mode == ddr_to_ddr))
+    dev_src = dma_fpga_mem_addr(dev_src);
+  if ((mode == host_to_ddr) || (mode == ddr_to_ddr))
+    dev_dest = dma_fpga_mem_addr(dev_dest);
 
-  dma_descriptor_t desc;
   // Set the DMA Transaction type: host_to_ddr, ddr_to_host, ddr_to_ddr
-  e_dma_mode descriptor_mode = mode;
-
-  desc.src_address = dev_src & MASK_FOR_32BIT_ADDR;
-  desc.dest_address = dev_dest & MASK_FOR_32BIT_ADDR;
-  desc.len = len;
-  desc.control = 0x80000000 | (descriptor_mode << MODE_SHIFT);
-
-  const uint64_t DMA_DESC_BASE = 8 * DMA_CSR_IDX_SRC_ADDR;
-  const uint64_t DMA_STATUS_BASE = 8 * DMA_CSR_IDX_STATUS;
-  uint64_t mmio_data = 0;
+  dma_descriptor_t desc;
+  dma_init_descriptor(&desc, mode, dev_src, dev_dest, len);
 
-  // int desc_size = sizeof(desc)/sizeof(desc.control);
   int desc_size = sizeof(desc);
   if (verbose) {
     printf("\nDescriptor size   = %d\n", desc_size);
@@ -257,28 +513,63 @@ void dma_transfer(fpga_handle accel_handle, e_dma_mode mode, uint64_t dev_src,
     printf("desc.control      = %04X\n", desc.control);
   }
 
-  // send descriptor
-  start = clock();
-  for (int i=0; i<2; i++) {
-     send_descriptor(accel_handle, DMA_DESC_BASE, desc);
+  // send descriptor and wait for the engine to retire it
+  start_ns = latency_now_ns();
+  dma_submit_batch(accel_handle, &desc, 1);
+  dma_wait_idle(accel_handle, verbose);
+  end_ns = latency_now_ns();
+
+  // Wall time, bytes per nanosecond is GB/s
+  sw_bandwidth = ((double)len * DMA_LINE_SIZE) / (end_ns - start_ns);
+  printf("\nApparent Transfer Bandwidth: %4.5fGB/s", sw_bandwidth);
+}
+
+// Fill buf with 64 bit words counting up from 0 and return its CRC32C.
+// Each block is checksummed right after it is written, while it is still
+// in cache, so verification adds little to staging.
+static uint32_t fill_pattern_crc(volatile uint64_t *buf, uint64_t size) {
+  const uint64_t block_words = DMA_VERIFY_BLOCK_BYTES / 8;
+  const uint64_t num_words = size / 8;
+  uint32_t crc = 0;
+
+  for (uint64_t i = 0; i < num_words; i += block_words) {
+    const uint64_t n =
+        (num_words - i < block_words) ? num_words - i : block_words;
+    for (uint64_t j = i; j < i + n; j++)
+      buf[j] = j;
+    crc = crc32c(crc, (const void *)&buf[i], n * 8);
   }
 
-  mmio_read64_silent(accel_handle, DMA_STATUS_BASE, &mmio_data);
-  // If the descriptor buffer is empty, then we are done
-  while ((mmio_data & 0x1) == 0x1) {
-#ifdef USE_ASE
-    sleep(1);
-    if (verbose)
-      print_csrs();
-    mmio_read64(accel_handle, DMA_STATUS_BASE, &mmio_data, "dma_csr_base");
-#else
-    mmio_read64_silent(accel_handle, DMA_STATUS_BASE, &mmio_data);
-#endif
+  return crc;
+}
+
+// Compare the CRC32C of data read back from device memory against the CRC
+// of the pattern that was sent. Returns the number of errors.
+static int verify_pattern_crc(volatile uint64_t *buf, uint64_t size,
+                              uint32_t expected_crc, bool verbose) {
+  const uint64_t start_ns = latency_now_ns();
+  const uint32_t crc = crc32c(0, (const void *)buf, size);
+  const uint64_t end_ns = latency_now_ns();
+
+  if (verbose)
+    printf("CRC32C verified %ld bytes at %0.2f GB/s\n", size,
+           (double)size / (end_ns - start_ns));
+
+  if (crc == expected_crc)
+    return 0;
+
+  printf("\nERROR: CRC32C mismatch, expected %08X, read back %08X\n",
+         expected_crc, crc);
+
+  // The pattern is easy to regenerate, so report where it went wrong
+  for (uint64_t i = 0; i < size / 8; i++) {
+    if (buf[i] != i) {
+      printf("ERROR: first mismatch at word %ld: %016lX\n", i, buf[i]);
+      break;
     }
-    end = clock();
-    sw_bandwidth = ((double)(len * DMA_LINE_SIZE)) /
-                   (BW_GIGA * ((double)(end - start)) / CLOCKS_PER_SEC);
-    printf("\nApparent Transfer Bandwidth: %4.5fGB/s", sw_bandwidth);
+  }
+
+  return 1;
 }
 
 int run_basic_ddr_dma_test(fpga_handle accel_handle, int transfer_size, bool verbose) {
@@ -286,8 +577,6 @@ int run_basic_ddr_dma_test(fpga_handle accel_handle, int transfer_size, bool ver
   volatile uint64_t *dma_buf_ptr = NULL;
   // Workspace ID used by OPAE to identify buffer
   uint64_t dma_buf_wsid;
-  // Return status buffer for OPAE library calls
-  fpga_result res = FPGA_OK;
   int num_errors = 0;
 
   // Set test transfer size
@@ -308,68 +597,203 @@ int run_basic_ddr_dma_test(fpga_handle accel_handle, int transfer_size, bool ver
   uint32_t dma_len = ((test_buffer_size - 1) / DMA_LINE_SIZE)+1; // Ceiling of test_buffer_size / awsize
   printf("dma_len = %d\n", dma_len);
 
-  // Create expected result
-  uint32_t test_buffer_word_size = test_buffer_size / 8;
-  char expected_result[test_buffer_size];
-  uint64_t *expected_result_word_ptr = (uint64_t *)expected_result;
-  for (int i = 0; i < test_buffer_word_size; i++) {
-    expected_result_word_ptr[i] = i;
-  }
-
   printf("TEST_BUFFER_SIZE = %d\n", test_buffer_size);
   printf("DMA_BUFFER_SIZE  = %d\n", DMA_BUFFER_SIZE);
 
-  // Initialize shared buffer
-  res = fpgaPrepareBuffer(accel_handle, DMA_BUFFER_SIZE, (void **)&dma_buf_ptr,
-                          &dma_buf_wsid, 0);
-  ON_ERR_GOTO(res, release_buf, "allocating dma buffer");
-  memset((void *)dma_buf_ptr, 0x0, DMA_BUFFER_SIZE);
-
-  // Store virtual address of IO registers
+  // Initialize shared buffer, recycled through the pinned buffer pool
   uint64_t dma_buf_iova;
-  res = fpgaGetIOAddress(accel_handle, dma_buf_wsid, &dma_buf_iova);
-  ON_ERR_GOTO(res, release_buf, "getting dma DMA_BUF_IOVA");
+  dma_buf_ptr = alloc_io_shared_buffer(accel_handle, DMA_BUFFER_SIZE,
+                                       &dma_buf_wsid, &dma_buf_iova);
+  if (NULL == dma_buf_ptr) {
+    fprintf(stderr, "Error allocating dma buffer\n");
+    return 1;
+  }
+  memset((void *)dma_buf_ptr, 0x0, DMA_BUFFER_SIZE);
 
-  for (int i = 0; i < test_buffer_word_size; i++) {
-    dma_buf_ptr[i] = i;
+  // Device memory target
+  uint64_t ddr_addr;
+  if (alloc_fpga_mem_buffer(test_buffer_size, &ddr_addr) != FPGA_OK) {
+    fprintf(stderr, "Error allocating device memory\n");
+    free_io_shared_buffer(accel_handle, dma_buf_ptr, DMA_BUFFER_SIZE,
+                          dma_buf_wsid, dma_buf_iova);
+    return 1;
   }
+  printf("DDR address      = %016lX\n", ddr_addr);
+
+  const uint32_t expected_crc = fill_pattern_crc(dma_buf_ptr, test_buffer_size);
 
   // Basic DMA transfer, Host to DDR
-  dma_transfer(accel_handle, host_to_ddr, dma_buf_iova | DMA_HOST_MASK, 0,
-               dma_len, verbose);
+  dma_transfer(accel_handle, host_to_ddr, dma_buf_iova | DMA_HOST_MASK,
+               ddr_addr, dma_len, verbose);
   double h2a_bw = get_bandwidth(host_to_ddr);
 
   // DMA Transfer
   memset((void *)dma_buf_ptr, 0x0, DMA_BUFFER_SIZE);
 
   // Basic DMA transfer, DDR to Host
-  dma_transfer(accel_handle, ddr_to_host, 0, dma_buf_iova | DMA_HOST_MASK,
-               dma_len, verbose);
+  dma_transfer(accel_handle, ddr_to_host, ddr_addr,
+               dma_buf_iova | DMA_HOST_MASK, dma_len, verbose);
 
   double a2h_bw = get_bandwidth(ddr_to_host);
 
   if ((a2h_bw == -1) || h2a_bw == -1) {
      fprintf(stderr, "Error: Minimum bandwidth requirement violation detected.\n");
+     free_fpga_mem_buffer(ddr_addr);
+     free_io_shared_buffer(accel_handle, dma_buf_ptr, DMA_BUFFER_SIZE,
+                           dma_buf_wsid, dma_buf_iova);
      return -1; 
   }
 
   // Check expected result
-  if (memcmp((void *)dma_buf_ptr, (void *)expected_result, test_buffer_size) !=
-      0) {
-    printf("\nERROR: memcmp failed!\n");
+  num_errors += verify_pattern_crc(dma_buf_ptr, test_buffer_size,
+                                   expected_crc, verbose);
+  if (!num_errors)
+    printf("\nSuccess!\n");
+
+  free_fpga_mem_buffer(ddr_addr);
+  free_io_shared_buffer(accel_handle, dma_buf_ptr, DMA_BUFFER_SIZE,
+                        dma_buf_wsid, dma_buf_iova);
+
+  return num_errors;
+}
+
+int run_sg_ddr_dma_test(fpga_handle accel_handle, uint64_t transfer_size,
+                        bool verbose) {
+  int num_errors = 0;
+  struct timespec start, end;
+
+  // Ensure the transfer size is in terms of 64B (512-bit) lines
+  assert(transfer_size % DMA_LINE_SIZE == 0);
+  printf("TEST_BUFFER_SIZE = %ld (scatter-gather)\n", transfer_size);
+
+  // An ordinary user buffer. dma_sg_transfer() pins it in place.
+  uint64_t *buf = NULL;
+  if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), transfer_size)) {
+    fprintf(stderr, "Error: failed to allocate %ld byte user buffer\n",
+            transfer_size);
+    return 1;
+  }
+
+  // Device memory target. Transfers larger than a bank can't come from
+  // the allocator and use all of device memory from address 0.
+  uint64_t ddr_addr = 0;
+  const bool ddr_allocated =
+      (alloc_fpga_mem_buffer(transfer_size, &ddr_addr) == FPGA_OK);
+  printf("DDR address      = %016lX\n", ddr_addr);
+
+  const uint32_t expected_crc = fill_pattern_crc(buf, transfer_size);
+
+  t_dma_perf_totals perf_start, perf_end, perf_delta;
+  dma_perf_get(&perf_start);
+
+  // Host to DDR, spread over as many banks as the size requires
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (dma_sg_transfer(accel_handle, host_to_ddr, buf, ddr_addr, transfer_size))
     num_errors++;
-  } else {
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double sec = end.tv_sec - start.tv_sec + 1e-9 * (end.tv_nsec - start.tv_nsec);
+  printf("Host to DDR: %0.2f GB/s\n", transfer_size / sec / 1e9);
+
+  memset(buf, 0, transfer_size);
+
+  // DDR to Host, back into the same buffer
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (dma_sg_transfer(accel_handle, ddr_to_host, buf, ddr_addr, transfer_size))
+    num_errors++;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sec = end.tv_sec - start.tv_sec + 1e-9 * (end.tv_nsec - start.tv_nsec);
+  printf("DDR to Host: %0.2f GB/s\n", transfer_size / sec / 1e9);
+
+  dma_perf_get(&perf_end);
+  dma_perf_delta(&perf_end, &perf_start, &perf_delta);
+  dma_perf_print(&perf_delta, stdout);
+
+  // Check expected result
+  num_errors += verify_pattern_crc(buf, transfer_size, expected_crc, verbose);
+  if (!num_errors)
     printf("\nSuccess!\n");
+
+  if (ddr_allocated)
+    free_fpga_mem_buffer(ddr_addr);
+  free(buf);
+  return num_errors;
+}
+
+// Load a pattern into device memory, copy it to a second region on the card
+// with dma_device_memcpy() and read the copy back.
+int run_device_memcpy_test(fpga_handle accel_handle, uint64_t transfer_size,
+                           bool verbose) {
+  int num_errors = 0;
+  uint64_t start_ns, end_ns;
+
+  if (transfer_size > TEST_BUFFER_SIZE_HW)
+    transfer_size = TEST_BUFFER_SIZE_HW;
+  assert(transfer_size % DMA_LINE_SIZE == 0);
+  const uint32_t dma_len = transfer_size / DMA_LINE_SIZE;
+
+  uint64_t buf_wsid, buf_iova;
+  volatile uint64_t *buf = alloc_io_shared_buffer(accel_handle, transfer_size,
+                                                  &buf_wsid, &buf_iova);
+  if (NULL == buf) {
+    fprintf(stderr, "Error allocating dma buffer\n");
+    return 1;
+  }
+
+  uint64_t src_addr, dst_addr;
+  if (alloc_fpga_mem_buffer(transfer_size, &src_addr) != FPGA_OK) {
+    fprintf(stderr, "Error allocating device memory\n");
+    free_io_shared_buffer(accel_handle, buf, transfer_size, buf_wsid, buf_iova);
+    return 1;
+  }
+  if (alloc_fpga_mem_buffer(transfer_size, &dst_addr) != FPGA_OK) {
+    fprintf(stderr, "Error allocating device memory\n");
+    free_fpga_mem_buffer(src_addr);
+    free_io_shared_buffer(accel_handle, buf, transfer_size, buf_wsid, buf_iova);
+    return 1;
   }
 
-  release_buf:
-    res = fpgaReleaseBuffer(accel_handle, dma_buf_wsid); 
+  for (uint64_t i = 0; i < transfer_size / 8; i++)
+    buf[i] = ~i;
+
+  dma_descriptor_t desc;
+  dma_init_descriptor(&desc, host_to_ddr, buf_iova | DMA_HOST_MASK,
+                      dma_fpga_mem_addr(src_addr), dma_len);
+  dma_submit_batch(accel_handle, &desc, 1);
+  if (dma_wait_idle(accel_handle, verbose))
+    num_errors++;
+
+  start_ns = latency_now_ns();
+  if (dma_device_memcpy(accel_handle, dst_addr, src_addr, transfer_size))
+    num_errors++;
+  end_ns = latency_now_ns();
+  printf("\nDevice memcpy %016lX -> %016lX: %0.2f GB/s\n", src_addr, dst_addr,
+         (double)transfer_size / (end_ns - start_ns));
+
+  memset((void *)buf, 0, transfer_size);
+  dma_init_descriptor(&desc, ddr_to_host, dma_fpga_mem_addr(dst_addr),
+                      buf_iova | DMA_HOST_MASK, dma_len);
+  dma_submit_batch(accel_handle, &desc, 1);
+  if (dma_wait_idle(accel_handle, verbose))
+    num_errors++;
+
+  for (uint64_t i = 0; i < transfer_size / 8; i++) {
+    if (buf[i] != ~i) {
+      printf("ERROR: device memcpy mismatch at word %ld\n", i);
+      num_errors++;
+      break;
+    }
+  }
+  if (0 == num_errors)
+    printf("Device memcpy success!\n");
+
+  free_fpga_mem_buffer(dst_addr);
+  free_fpga_mem_buffer(src_addr);
+  free_io_shared_buffer(accel_handle, buf, transfer_size, buf_wsid, buf_iova);
 
   return num_errors;
 }
 
-int dma(fpga_handle accel_handle, bool is_ase_sim, uint32_t transfer_size,
-        bool verbose) {
+void dma_engine_init(fpga_handle accel_handle, bool is_ase_sim) {
   fpga_result r;
 
   s_accel_handle = accel_handle;
@@ -377,7 +801,11 @@ int dma(fpga_handle accel_handle, bool is_ase_sim, uint32_t transfer_size,
 
   // Get a pointer to the MMIO buffer for direct access. The OPAE functions will
   // be used with ASE since true MMIO isn't detected by the SW simulator.
-  if (is_ase_sim) {
+  if (s_csr_model) {
+    s_mmio_buf = NULL;
+    s_model = dma_model_create();
+    assert(NULL != s_model);
+  } else if (is_ase_sim) {
     s_mmio_buf = NULL;
   } else {
     uint64_t *tmp_ptr;
@@ -386,6 +814,98 @@ int dma(fpga_handle accel_handle, bool is_ase_sim, uint32_t transfer_size,
     s_mmio_buf = tmp_ptr;
   }
 
-  return run_basic_ddr_dma_test(s_accel_handle, transfer_size, verbose);
+  // Start counting completions from whatever the engine has already retired
+  s_hw_desc_count = (readMMIO64(DMA_CSR_IDX_STATUS) >>
+                     DMA_STATUS_DESC_COUNT_SHIFT) & DMA_STATUS_DESC_COUNT_MASK;
+  s_desc_submitted = 0;
+  s_desc_completed = 0;
+  dma_latency_reset();
+
+  // Buffers for the CSR model are ordinary memory
+  if (!s_model) {
+    s_buf_pool = pinned_buffer_pool_create(accel_handle);
+    assert(NULL != s_buf_pool);
+  }
+
+  // Keep host buffers and the submitting thread on the FPGA's socket.
+  // Threads created from here on inherit the binding.
+  s_numa_node = (is_ase_sim || s_model) ? -1 : fpga_numa_node(accel_handle);
+  if (s_numa_node >= 0) {
+    pinned_buffer_pool_set_numa_node(s_buf_pool, s_numa_node);
+    if (numa_bind_thread(s_numa_node))
+      fprintf(stderr, "Warning: unable to bind to NUMA node %d\n",
+              s_numa_node);
+  }
+
+  // Completion waits block on an interrupt when the AFU provides one and
+  // otherwise sleep between status reads.
+  s_intr_fd = -1;
+  if (!s_model && (FPGA_OK == fpgaCreateEventHandle(&s_intr_handle))) {
+    if (FPGA_OK == fpgaRegisterEvent(accel_handle, FPGA_EVENT_INTERRUPT,
+                                     s_intr_handle, 0)) {
+      if (FPGA_OK != fpgaGetOSObjectFromEventHandle(s_intr_handle,
+                                                    &s_intr_fd)) {
+        fpgaUnregisterEvent(accel_handle, FPGA_EVENT_INTERRUPT, s_intr_handle);
+        s_intr_fd = -1;
+      }
+    }
+    if (s_intr_fd < 0)
+      fpgaDestroyEventHandle(&s_intr_handle);
+  }
+
+  // Sample the engine performance counters in the background
+  if (dma_perf_start(is_ase_sim ? DMA_PERF_SAMPLE_US_ASE : DMA_PERF_SAMPLE_US))
+    fprintf(stderr, "Warning: performance counter sampling not started\n");
+  dma_perf_get(&s_bw_totals);
 }
 
+void dma_engine_release(bool verbose) {
+  dma_perf_stop();
+
+  if (s_intr_fd >= 0) {
+    fpgaUnregisterEvent(s_accel_handle, FPGA_EVENT_INTERRUPT, s_intr_handle);
+    fpgaDestroyEventHandle(&s_intr_handle);
+    s_intr_fd = -1;
+  }
+
+  if (verbose) {
+    if (s_buf_pool)
+      pinned_buffer_pool_print_stats(s_buf_pool, stdout);
+    print_fpga_mem_stats(stdout);
+  }
+  pinned_buffer_pool_destroy(s_buf_pool);
+  s_buf_pool = NULL;
+
+  dma_model_destroy(s_model);
+  s_model = NULL;
+}
+
+int dma(fpga_handle accel_handle, bool is_ase_sim, uint64_t transfer_size,
+        bool verbose, const char *latency_json) {
+  dma_engine_init(accel_handle, is_ase_sim);
+
+  // Transfers beyond a single pinned buffer use the scatter-gather path
+  int status;
+  if (!is_ase_sim && (transfer_size > TEST_BUFFER_SIZE_HW))
+    status = run_sg_ddr_dma_test(s_accel_handle, transfer_size, verbose);
+  else
+    status = run_basic_ddr_dma_test(s_accel_handle, transfer_size, verbose);
+
+  if (0 == status)
+    status = run_device_memcpy_test(s_accel_handle, transfer_size, verbose);
+
+  latency_hist_print(&s_desc_latency, "\nDescriptor", stdout);
+  if (latency_json) {
+    FILE *f = fopen(latency_json, "w");
+    if (f) {
+      latency_hist_write_json(&s_desc_latency, f);
+      fclose(f);
+    } else {
+      fprintf(stderr, "Error: unable to open %s\n", latency_json);
+    }
+  }
+
+  dma_engine_release(verbose);
+
+  return status;
+}
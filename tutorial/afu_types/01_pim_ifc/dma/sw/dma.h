@@ -4,7 +4,6 @@
 #ifndef __DMA_H__
 #define __DMA_H__
 
-#define USE_ASE
 #define CLOCK_RATE_MHZ                 470 // 470MHz
 #define MAX_TRPT_BYTES                 (CLOCK_RATE_MHZ * 64) //64 Bytes per AXI read/write.
 #define MIN_TRPT_GBPS                  8.2 // 8.2 GB/s -> Nominal BW is 8.7GB/s
@@ -28,6 +27,21 @@
 #define DMA_CSR_IDX_RD_SRC_PERF_CNTR   0x11
 #define DMA_CSR_IDX_WR_DEST_PERF_CNTR  0x12
 #define MODE_SHIFT                     26
+#define DESCRIPTOR_GO                  0x80000000
+
+// DMA_CSR_IDX_STATUS fields, from t_dma_csr_status in dma_pkg.sv
+#define DMA_STATUS_BUSY                (1u << 0)
+#define DMA_STATUS_DESC_FIFO_EMPTY     (1u << 1)
+#define DMA_STATUS_DESC_FIFO_FULL      (1u << 2)
+#define DMA_STATUS_STOPPED_ON_ERROR    (1u << 7)
+#define DMA_STATUS_DESC_COUNT_SHIFT    28
+#define DMA_STATUS_DESC_COUNT_MASK     0xF
+
+// Must match DMA_DESCRIPTOR_FIFO_DEPTH in dma_pkg.sv. The completed
+// descriptor count in the status register is only 4 bits, so keeping one
+// slot free lets the host tell an empty FIFO from a full one.
+#define DMA_DESCRIPTOR_FIFO_DEPTH      16
+#define DMA_MAX_DESC_IN_FLIGHT         (DMA_DESCRIPTOR_FIFO_DEPTH - 1)
 
 
 #define CONTROL_BUSY_BIT               1
@@ -53,14 +67,150 @@
 #define DMA_FPGA_NUM_ADDR_BITS 32
 #define DMA_FPGA_MEM_BUS_WIDTH 512
 #define DMA_FPGA_MEM_ALIGNMENT 0x1FF
+// dma_ddr_selector.sv picks the local memory bank from the top bits of the
+// 57 bit descriptor address. Software addresses device memory linearly as
+// bank * DMA_FPGA_MEM_BANK_SIZE + offset and converts with dma_fpga_mem_addr().
+#define DMA_FPGA_BANK_SEL_SHIFT 55
+
+// Device memory allocator granularity. Allocations are power of two
+// multiples of the minimum block, placed in a single bank. Allocations of
+// at least DMA_FPGA_MEM_INTERLEAVE_MIN rotate through the banks so that
+// concurrent large transfers use every DDR channel.
+#define DMA_FPGA_MEM_MIN_BLOCK 4096
+#define DMA_FPGA_MEM_INTERLEAVE_MIN (1024 * 1024)
 
 #define DMA_LINE_SIZE 64
 
+// Completion waits spin on the status register for DMA_WAIT_SPIN_NS, then
+// block for exponentially longer intervals between status reads. Blocking
+// waits end early on an AFU interrupt when one is registered. Simulation
+// runs orders of magnitude slower, so ASE backs off to much longer waits.
+#define DMA_WAIT_SPIN_NS              20000
+#define DMA_WAIT_BACKOFF_MIN_US       10
+#define DMA_WAIT_BACKOFF_MAX_US       1000
+#define DMA_WAIT_BACKOFF_MAX_US_ASE   1000000
+
+// Performance counter sampling period. The 20 bit cycle counters wrap
+// every 2^20 / CLOCK_RATE_MHZ microseconds (~2.2ms), so sample well
+// inside that. Simulated clocks are slow and MMIO in ASE is expensive.
+#define DMA_PERF_SAMPLE_US      500
+#define DMA_PERF_SAMPLE_US_ASE  100000
+
+// Largest transfer described by a single descriptor. The read and write
+// engines count at most 512 AXI bursts of 256 lines per descriptor, so
+// stay at the documented 2MB maximum.
+#define DMA_MAX_DESC_BYTES (2 * 1024 * 1024)
+
+// Scatter-gather pinning granularity and the number of chunks that may be
+// pinned at once while a transfer streams through the engine.
+#define DMA_SG_CHUNK_SIZE       (2L * 1024 * 1024)
+#define DMA_SG_HUGE_CHUNK_SIZE  (1024L * 1024 * 1024)
+#define DMA_SG_MAX_PINNED_CHUNKS 4
+
+// Test patterns are checksummed with CRC32C a block at a time as they are
+// written
+#define DMA_VERIFY_BLOCK_BYTES 4096
+
+// Transfer size sweep limits. Points are repeated until they have moved
+// at least DMA_SWEEP_TARGET_BYTES, within the iteration bounds.
+#define DMA_SWEEP_MIN_SIZE          64
+#define DMA_SWEEP_MAX_SIZE          (1024L * 1024 * 1024)
+#define DMA_SWEEP_MAX_SIZE_ASE      (64 * 1024)
+#define DMA_SWEEP_TARGET_BYTES      (256L * 1024 * 1024)
+#define DMA_SWEEP_TARGET_BYTES_ASE  (256 * 1024)
+#define DMA_SWEEP_MIN_ITERS         8
+#define DMA_SWEEP_MAX_ITERS         16384
+#define DMA_SWEEP_MAX_ITERS_ASE     64
+
+// Descriptors written per path by the descriptor push micro-benchmark
+#define DMA_DESC_BENCH_COUNT        1000000
+#define DMA_DESC_BENCH_COUNT_ASE    1000
+
+// Streaming mode staging buffers and the size of the device memory ring
+// they are written to, in staging buffers
+#define DMA_STREAM_NUM_BUFS         4
+#define DMA_STREAM_DEV_RING_BUFS    64
+
+// Multi-threaded submission queue size and scaling benchmark. Each
+// producer posts DMA_MT_BENCH_DESC_BYTES descriptors in batches that
+// share a completion.
+#define DMA_MT_QUEUE_SIZE           1024
+#define DMA_MT_BENCH_MAX_THREADS    64
+#define DMA_MT_BENCH_DESCS          262144
+#define DMA_MT_BENCH_DESCS_ASE      256
+#define DMA_MT_BENCH_BATCH          8
+#define DMA_MT_BENCH_DESC_BYTES     4096
+
+// NUMA placement benchmark: staging buffers of DMA_MAX_DESC_BYTES cycled
+// until DMA_NUMA_BENCH_BYTES have moved in each direction
+#define DMA_NUMA_BENCH_BUFS         8
+#define DMA_NUMA_BENCH_BYTES        (4L * 1024 * 1024 * 1024)
+
+// Run the tests and benchmarks below against a host memory model of the
+// engine CSRs (dma_model.c) instead of the AFU. Descriptors retire in
+// order at a modeled bandwidth and move their data, so submission
+// throughput and ordering can be checked without an FPGA. The accelerator
+// handle is then unused and may be NULL.
+void dma_use_csr_model(bool csr_model);
+
 int run_basic_ddr_dma_test(fpga_handle accel_handle, int transfer_size, bool verbose);
 
+int run_sg_ddr_dma_test(fpga_handle accel_handle, uint64_t transfer_size, bool verbose);
+
+int run_stream_test(fpga_handle accel_handle, bool is_ase_sim, uint64_t buf_size, uint32_t seconds, bool verbose);
+
+int run_device_memcpy_test(fpga_handle accel_handle, uint64_t transfer_size, bool verbose);
+
 int dma(
     fpga_handle accel_handle, bool is_ase_sim,
-    uint32_t transfer_size,
+    uint64_t transfer_size,
+    bool verbose,
+    const char *latency_json);
+
+// Measure bandwidth and latency over a range of transfer sizes, modes and
+// descriptor queue depths, writing one CSV row per point to csv_file
+// ("-" for stdout). Transfers grow by powers of two from DMA_SWEEP_MIN_SIZE
+// to max_size.
+int dma_sweep(
+    fpga_handle accel_handle, bool is_ase_sim,
+    uint64_t max_size,
+    bool verbose,
+    const char *csv_file);
+
+// Measure how many descriptors per second can be written to the CSRs
+// through the OPAE library, through mapped MMIO and, for comparison, to
+// ordinary memory. Descriptors are written without the go bit, so no
+// transfers start.
+int dma_desc_bench(
+    fpga_handle accel_handle, bool is_ase_sim,
+    bool verbose);
+
+// Stream host to DDR through double buffered staging buffers of buf_size
+// bytes for the given number of seconds and report sustained bandwidth.
+int dma_stream_bench(
+    fpga_handle accel_handle, bool is_ase_sim,
+    uint64_t buf_size,
+    uint32_t seconds,
+    bool verbose);
+
+// Post descriptors from 1 to DMA_MT_BENCH_MAX_THREADS producer threads
+// through the multi-threaded submission queue and report descriptor rate
+// and bandwidth for each thread count.
+int dma_mt_bench(
+    fpga_handle accel_handle, bool is_ase_sim,
+    bool verbose);
+
+// Post an invalid descriptor through the multi-threaded submission queue,
+// followed by more descriptors than the queue holds, and check that the
+// error reaches the completion and dma_mt_stop(). Needs the CSR model.
+int dma_mt_error_test(
+    fpga_handle accel_handle, bool is_ase_sim,
+    bool verbose);
+
+// Compare DMA bandwidth with host buffers on the FPGA's NUMA node and on
+// another node. Needs a multi-node host.
+int dma_numa_bench(
+    fpga_handle accel_handle, bool is_ase_sim,
     bool verbose);
 
 #endif // __DMA_H__
@@ -0,0 +1,645 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Transfer size sweep. Each point moves a fixed transfer size repeatedly
+// in one mode while limiting the number of descriptors queued in the
+// engine, and reports wall time bandwidth, engine bandwidth from the
+// performance counters and the distribution of per transfer latency.
+//
+// Transfers larger than DMA_MAX_DESC_BYTES are split into descriptors of
+// that size, each backed by its own pinned host buffer, so no huge pages
+// larger than 2MB are needed. Queue depth counts descriptors, not
+// transfers, since that is what the hardware sees.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+#include "pinned_buffer_pool.h"
+#include "numa_util.h"
+
+static const uint32_t s_queue_depths[] = {1, 2, 4, 8, DMA_MAX_DESC_IN_FLIGHT};
+#define NUM_QUEUE_DEPTHS (sizeof(s_queue_depths) / sizeof(s_queue_depths[0]))
+
+// ddr_to_ddr isn't swept. dma_axi_mm_mux.sv doesn't route it and
+// dma_ddr_selector.sv always connects bank 0 for it, while sweep buffers
+// come from any bank.
+static const e_dma_mode s_modes[] = {host_to_ddr, ddr_to_host};
+#define NUM_MODES (sizeof(s_modes) / sizeof(s_modes[0]))
+
+static const char *mode_name(e_dma_mode mode) {
+  switch (mode) {
+  case host_to_ddr:
+    return "host_to_ddr";
+  case ddr_to_host:
+    return "ddr_to_host";
+  case ddr_to_ddr:
+    return "ddr_to_ddr";
+  default:
+    return "stand_by";
+  }
+}
+
+// Buffers used by every point of one transfer size
+typedef struct {
+  uint64_t size;
+  uint32_t num_descs;
+  uint64_t desc_bytes;
+  // One pinned host buffer per descriptor
+  t_pinned_buffer *host_bufs;
+  uint64_t dev_src;
+} t_sweep_bufs;
+
+// A transfer whose last descriptor has not yet been seen to retire
+typedef struct {
+  dma_ticket_t last_ticket;
+  uint64_t start_ns;
+} t_pending_xfer;
+
+static void free_sweep_bufs(fpga_handle accel_handle, t_sweep_bufs *b) {
+  if (b->host_bufs) {
+    for (uint32_t i = 0; i < b->num_descs; i++) {
+      if (b->host_bufs[i].ptr)
+        free_io_shared_buffer(accel_handle, b->host_bufs[i].ptr,
+                              b->host_bufs[i].size, b->host_bufs[i].wsid,
+                              b->host_bufs[i].pa);
+    }
+    free(b->host_bufs);
+    b->host_bufs = NULL;
+  }
+
+  if (b->dev_src != ~0UL)
+    free_fpga_mem_buffer(b->dev_src);
+  b->dev_src = ~0UL;
+}
+
+static int alloc_sweep_bufs(fpga_handle accel_handle, uint64_t size,
+                            t_sweep_bufs *b) {
+  memset(b, 0, sizeof(*b));
+  b->size = size;
+  b->desc_bytes = (size < DMA_MAX_DESC_BYTES) ? size : DMA_MAX_DESC_BYTES;
+  b->num_descs = (size + b->desc_bytes - 1) / b->desc_bytes;
+  b->dev_src = ~0UL;
+
+  b->host_bufs = calloc(b->num_descs, sizeof(t_pinned_buffer));
+  if (NULL == b->host_bufs)
+    return -1;
+
+  for (uint32_t i = 0; i < b->num_descs; i++) {
+    t_pinned_buffer *hb = &b->host_bufs[i];
+    hb->size = b->desc_bytes;
+    hb->ptr = alloc_io_shared_buffer(accel_handle, b->desc_bytes, &hb->wsid,
+                                     &hb->pa);
+    if (NULL == hb->ptr)
+      goto fail;
+    memset((void *)hb->ptr, 0, b->desc_bytes);
+  }
+
+  if (alloc_fpga_mem_buffer(size, &b->dev_src) != FPGA_OK) {
+    b->dev_src = ~0UL;
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  free_sweep_bufs(accel_handle, b);
+  return -1;
+}
+
+static void init_sweep_desc(const t_sweep_bufs *b, e_dma_mode mode,
+                            uint32_t idx, dma_descriptor_t *desc) {
+  const uint64_t offset = (uint64_t)idx * b->desc_bytes;
+  const uint64_t host = b->host_bufs[idx].pa | DMA_HOST_MASK;
+  const uint64_t dev_src = dma_fpga_mem_addr(b->dev_src + offset);
+  const uint32_t len = b->desc_bytes / DMA_LINE_SIZE;
+
+  if (mode == host_to_ddr)
+    dma_init_descriptor(desc, mode, host, dev_src, len);
+  else
+    dma_init_descriptor(desc, mode, dev_src, host, len);
+}
+
+// Retire transfers whose last descriptor has completed, oldest first.
+// Completion is only observed when the submit loop has to poll for
+// credit, so latency includes that polling delay, as in dma_latency().
+static void retire_xfers(t_pending_xfer *pending, uint32_t *head,
+                         uint32_t tail, t_latency_hist *lat) {
+  const uint64_t now_ns = latency_now_ns();
+
+  while ((*head != tail) &&
+         dma_ticket_done(pending[*head % DMA_DESCRIPTOR_FIFO_DEPTH].last_ticket)) {
+    const t_pending_xfer *x = &pending[*head % DMA_DESCRIPTOR_FIFO_DEPTH];
+    latency_hist_record(lat, now_ns - x->start_ns);
+    *head += 1;
+  }
+}
+
+static int run_sweep_point(fpga_handle accel_handle, bool is_ase_sim,
+                           const t_sweep_bufs *b, e_dma_mode mode,
+                           uint32_t queue_depth, FILE *csv) {
+  // Enough transfers to amortize startup without spending minutes on tiny
+  // sizes
+  const uint64_t target =
+      is_ase_sim ? DMA_SWEEP_TARGET_BYTES_ASE : DMA_SWEEP_TARGET_BYTES;
+  const uint64_t max_iters =
+      is_ase_sim ? DMA_SWEEP_MAX_ITERS_ASE : DMA_SWEEP_MAX_ITERS;
+  uint64_t iters = target / b->size;
+  if (iters < DMA_SWEEP_MIN_ITERS)
+    iters = DMA_SWEEP_MIN_ITERS;
+  if (iters > max_iters)
+    iters = max_iters;
+
+  // A transfer still pending holds at least one of at most queue_depth
+  // descriptors in flight, plus the one being submitted.
+  t_pending_xfer pending[DMA_DESCRIPTOR_FIFO_DEPTH];
+  uint32_t head = 0, tail = 0;
+  t_latency_hist *lat = malloc(sizeof(t_latency_hist));
+  if (NULL == lat)
+    return -1;
+  latency_hist_reset(lat);
+
+  t_dma_perf_totals perf_start, perf_end, perf;
+  dma_perf_get(&perf_start);
+  const uint64_t start_ns = latency_now_ns();
+
+  for (uint64_t i = 0; i < iters; i++) {
+    assert(tail - head < DMA_DESCRIPTOR_FIFO_DEPTH);
+    t_pending_xfer *x = &pending[tail % DMA_DESCRIPTOR_FIFO_DEPTH];
+    x->start_ns = latency_now_ns();
+
+    for (uint32_t d = 0; d < b->num_descs; d++) {
+      while (dma_inflight() >= queue_depth) {
+        if (dma_poll(accel_handle) < 0)
+          goto err;
+        retire_xfers(pending, &head, tail, lat);
+      }
+
+      dma_descriptor_t desc;
+      init_sweep_desc(b, mode, d, &desc);
+      x->last_ticket = dma_submit(accel_handle, &desc);
+      if (0 == x->last_ticket)
+        goto err;
+    }
+
+    tail += 1;
+  }
+
+  while (head != tail) {
+    if (dma_poll(accel_handle) < 0)
+      goto err;
+    retire_xfers(pending, &head, tail, lat);
+  }
+
+  const uint64_t elapsed_ns = latency_now_ns() - start_ns;
+  dma_perf_get(&perf_end);
+  dma_perf_delta(&perf_end, &perf_start, &perf);
+
+  fprintf(csv, "%s,%lu,%u,%lu,%u,%.6f,%.3f,%.3f,%.3f,%lu,%lu,%lu\n",
+          mode_name(mode), b->size, queue_depth, iters, b->num_descs,
+          elapsed_ns / 1e9, (double)(iters * b->size) / elapsed_ns,
+          dma_perf_bandwidth(&perf.rd), dma_perf_bandwidth(&perf.wr),
+          latency_hist_percentile(lat, 50.0),
+          latency_hist_percentile(lat, 99.0), lat->max);
+  fflush(csv);
+
+  free(lat);
+  return 0;
+
+err:
+  fprintf(stderr, "Error: sweep point %s size %lu depth %u failed\n",
+          mode_name(mode), b->size, queue_depth);
+  free(lat);
+  return -1;
+}
+
+int dma_sweep(fpga_handle accel_handle, bool is_ase_sim, uint64_t max_size,
+              bool verbose, const char *csv_file) {
+  int status = 0;
+
+  FILE *csv = stdout;
+  if (strcmp(csv_file, "-")) {
+    csv = fopen(csv_file, "w");
+    if (NULL == csv) {
+      fprintf(stderr, "Error: unable to open %s\n", csv_file);
+      return 1;
+    }
+  }
+
+  dma_engine_init(accel_handle, is_ase_sim);
+
+  fprintf(csv, "mode,transfer_bytes,queue_depth,transfers,"
+               "descriptors_per_transfer,seconds,bandwidth_gbps,"
+               "engine_read_gbps,engine_write_gbps,latency_p50_ns,"
+               "latency_p99_ns,latency_max_ns\n");
+
+  for (uint64_t size = DMA_SWEEP_MIN_SIZE; size <= max_size; size *= 2) {
+    t_sweep_bufs bufs;
+    if (alloc_sweep_bufs(accel_handle, size, &bufs)) {
+      fprintf(stderr, "Unable to allocate %lu byte buffers, sweep stopped. "
+                      "Are enough 2MB huge pages available?\n", size);
+      break;
+    }
+
+    for (uint32_t m = 0; (m < NUM_MODES) && !status; m++) {
+      for (uint32_t q = 0; (q < NUM_QUEUE_DEPTHS) && !status; q++) {
+        if (verbose)
+          printf("Sweep %s %lu bytes, queue depth %u\n", mode_name(s_modes[m]),
+                 size, s_queue_depths[q]);
+
+        status = run_sweep_point(accel_handle, is_ase_sim, &bufs, s_modes[m],
+                                 s_queue_depths[q], csv);
+      }
+    }
+
+    free_sweep_bufs(accel_handle, &bufs);
+    if (status)
+      break;
+  }
+
+  if (csv != stdout)
+    fclose(csv);
+
+  dma_engine_release(verbose);
+
+  return status;
+}
+
+// Descriptors are written with the go bit clear, so the engine latches the
+// CSRs but never queues a transfer.
+static void init_bench_desc(uint64_t i, dma_descriptor_t *desc) {
+  dma_init_descriptor(desc, host_to_ddr, i * DMA_LINE_SIZE,
+                      (i + 1) * DMA_LINE_SIZE, 1);
+  desc->control &= ~DESCRIPTOR_GO;
+}
+
+static void print_desc_rate(const char *path, uint64_t count,
+                            uint64_t elapsed_ns) {
+  printf("  %-26s %12.0f descriptors/s  %8.1f ns/descriptor\n", path,
+         count * 1e9 / elapsed_ns, (double)elapsed_ns / count);
+}
+
+int dma_desc_bench(fpga_handle accel_handle, bool is_ase_sim, bool verbose) {
+  const uint64_t count =
+      is_ase_sim ? DMA_DESC_BENCH_COUNT_ASE : DMA_DESC_BENCH_COUNT;
+  dma_descriptor_t desc;
+  uint64_t start_ns;
+
+  dma_engine_init(accel_handle, is_ase_sim);
+  printf("Descriptor push rate, %lu descriptors per path:\n", count);
+
+  // One library call per CSR. The CSR model has no AFU to call.
+  if (!dma_is_csr_model()) {
+    start_ns = latency_now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+      init_bench_desc(i, &desc);
+      fpgaWriteMMIO64(accel_handle, 0, 8 * DMA_CSR_IDX_SRC_ADDR,
+                      desc.src_address);
+      fpgaWriteMMIO64(accel_handle, 0, 8 * DMA_CSR_IDX_DEST_ADDR,
+                      desc.dest_address);
+      fpgaWriteMMIO64(accel_handle, 0, 8 * DMA_CSR_IDX_LENGTH, desc.len);
+      fpgaWriteMMIO64(accel_handle, 0, 8 * DMA_CSR_IDX_DESCRIPTOR_CONTROL,
+                      desc.control);
+    }
+    // Reading a CSR waits for the posted writes ahead of it
+    dma_csr_read(DMA_CSR_IDX_STATUS);
+    print_desc_rate("fpgaWriteMMIO64", count, latency_now_ns() - start_ns);
+  }
+
+  // Direct stores to the mapped BAR, as used by dma_submit()
+  volatile uint64_t *csrs = dma_mmio_base();
+  if (csrs) {
+    start_ns = latency_now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+      init_bench_desc(i, &desc);
+      dma_store_descriptor(csrs, &desc);
+    }
+    dma_csr_read(DMA_CSR_IDX_STATUS);
+    print_desc_rate("mapped MMIO stores", count, latency_now_ns() - start_ns);
+  } else if (verbose) {
+    printf("  MMIO is not mapped in ASE or the CSR model, skipping mapped "
+           "stores\n");
+  }
+
+  // The same stores to ordinary memory in place of the BAR. This is the
+  // CPU cost of building and storing descriptors, without PCIe.
+  volatile uint64_t *stand_in = calloc(DMA_CSR_IDX_WR_DEST_PERF_CNTR + 1,
+                                       sizeof(uint64_t));
+  if (NULL == stand_in) {
+    dma_engine_release(verbose);
+    return 1;
+  }
+  start_ns = latency_now_ns();
+  for (uint64_t i = 0; i < count; i++) {
+    init_bench_desc(i, &desc);
+    dma_store_descriptor(stand_in, &desc);
+  }
+  print_desc_rate("host memory stand-in", count, latency_now_ns() - start_ns);
+  free((void *)stand_in);
+
+  dma_engine_release(verbose);
+  return 0;
+}
+
+typedef struct {
+  t_dma_mt *mt;
+  uint64_t num_descs;
+  uint64_t host_iova;
+  uint64_t dev_addr;
+  int status;
+} t_mt_producer;
+
+static void *mt_producer_thread(void *args) {
+  t_mt_producer *p = args;
+  t_dma_completion completion;
+  dma_descriptor_t desc;
+
+  dma_init_descriptor(&desc, host_to_ddr, p->host_iova | DMA_HOST_MASK,
+                      dma_fpga_mem_addr(p->dev_addr),
+                      DMA_MT_BENCH_DESC_BYTES / DMA_LINE_SIZE);
+
+  for (uint64_t i = 0; i < p->num_descs; i += DMA_MT_BENCH_BATCH) {
+    dma_completion_init(&completion);
+    for (uint64_t j = i; (j < i + DMA_MT_BENCH_BATCH) && (j < p->num_descs);
+         j++)
+      dma_mt_post(p->mt, &desc, &completion);
+
+    if (dma_completion_wait(&completion)) {
+      p->status = -1;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int run_mt_point(fpga_handle accel_handle, uint32_t num_threads,
+                        uint64_t total_descs, t_mt_producer *producers) {
+  int status = 0;
+  pthread_t threads[DMA_MT_BENCH_MAX_THREADS];
+
+  t_dma_mt *mt = dma_mt_start(accel_handle, DMA_MT_QUEUE_SIZE);
+  if (NULL == mt)
+    return -1;
+
+  const uint64_t start_ns = latency_now_ns();
+  uint32_t num_started = 0;
+  for (uint32_t t = 0; t < num_threads; t++) {
+    producers[t].mt = mt;
+    producers[t].num_descs = total_descs / num_threads;
+    producers[t].status = 0;
+    if (pthread_create(&threads[t], NULL, mt_producer_thread, &producers[t])) {
+      status = -1;
+      break;
+    }
+    num_started += 1;
+  }
+
+  for (uint32_t t = 0; t < num_started; t++) {
+    pthread_join(threads[t], NULL);
+    if (producers[t].status)
+      status = -1;
+  }
+  if (dma_mt_stop(mt))
+    status = -1;
+  const uint64_t elapsed_ns = latency_now_ns() - start_ns;
+
+  const uint64_t descs = (total_descs / num_threads) * num_threads;
+  printf("%8u %12.0f %10.2f\n", num_threads, descs * 1e9 / elapsed_ns,
+         (double)descs * DMA_MT_BENCH_DESC_BYTES / elapsed_ns);
+
+  return status;
+}
+
+int dma_mt_bench(fpga_handle accel_handle, bool is_ase_sim, bool verbose) {
+  int status = 0;
+  const uint64_t total_descs =
+      is_ase_sim ? DMA_MT_BENCH_DESCS_ASE : DMA_MT_BENCH_DESCS;
+  t_mt_producer producers[DMA_MT_BENCH_MAX_THREADS];
+  volatile void *bufs[DMA_MT_BENCH_MAX_THREADS];
+  uint64_t wsids[DMA_MT_BENCH_MAX_THREADS];
+  uint32_t num_bufs = 0;
+
+  dma_engine_init(accel_handle, is_ase_sim);
+
+  // Each producer has its own host buffer and device memory target
+  uint64_t dev_base;
+  if (alloc_fpga_mem_buffer(DMA_MT_BENCH_MAX_THREADS * DMA_MT_BENCH_DESC_BYTES,
+                            &dev_base) != FPGA_OK) {
+    fprintf(stderr, "Error allocating device memory\n");
+    dma_engine_release(verbose);
+    return 1;
+  }
+  for (; num_bufs < DMA_MT_BENCH_MAX_THREADS; num_bufs++) {
+    t_mt_producer *p = &producers[num_bufs];
+    bufs[num_bufs] = alloc_io_shared_buffer(accel_handle,
+                                            DMA_MT_BENCH_DESC_BYTES,
+                                            &wsids[num_bufs], &p->host_iova);
+    if (NULL == bufs[num_bufs]) {
+      fprintf(stderr, "Error allocating dma buffer\n");
+      status = 1;
+      break;
+    }
+    p->dev_addr = dev_base + num_bufs * DMA_MT_BENCH_DESC_BYTES;
+  }
+
+  if (0 == status) {
+    printf("%lu byte descriptors, batches of %d per completion\n",
+           (uint64_t)DMA_MT_BENCH_DESC_BYTES, DMA_MT_BENCH_BATCH);
+    printf("%8s %12s %10s\n", "threads", "descs/s", "GB/s");
+    for (uint32_t n = 1; (n <= DMA_MT_BENCH_MAX_THREADS) && !status; n *= 2)
+      status = run_mt_point(accel_handle, n, total_descs, producers);
+  }
+
+  for (uint32_t i = 0; i < num_bufs; i++)
+    free_io_shared_buffer(accel_handle, bufs[i], DMA_MT_BENCH_DESC_BYTES,
+                          wsids[i], producers[i].host_iova);
+  free_fpga_mem_buffer(dev_base);
+  dma_engine_release(verbose);
+
+  return status;
+}
+
+int dma_mt_error_test(fpga_handle accel_handle, bool is_ase_sim,
+                      bool verbose) {
+  // An engine that stops on an error stays stopped, so only run this on
+  // the model
+  if (!dma_is_csr_model()) {
+    fprintf(stderr, "The multi-threaded error test needs --csr-model\n");
+    return 1;
+  }
+
+  dma_engine_init(accel_handle, is_ase_sim);
+
+  uint64_t wsid, host_iova, dev_addr;
+  volatile void *buf = alloc_io_shared_buffer(
+      accel_handle, DMA_MT_BENCH_DESC_BYTES, &wsid, &host_iova);
+  if ((NULL == buf) ||
+      (alloc_fpga_mem_buffer(2 * DMA_MT_BENCH_DESC_BYTES, &dev_addr) !=
+       FPGA_OK)) {
+    fprintf(stderr, "Error allocating dma buffers\n");
+    dma_engine_release(verbose);
+    return 1;
+  }
+
+  t_dma_mt *mt = dma_mt_start(accel_handle, DMA_MT_QUEUE_SIZE);
+  if (NULL == mt) {
+    free_io_shared_buffer(accel_handle, buf, DMA_MT_BENCH_DESC_BYTES, wsid,
+                          host_iova);
+    free_fpga_mem_buffer(dev_addr);
+    dma_engine_release(verbose);
+    return 1;
+  }
+
+  dma_descriptor_t good, bad;
+  dma_init_descriptor(&good, host_to_ddr, host_iova | DMA_HOST_MASK,
+                      dma_fpga_mem_addr(dev_addr),
+                      DMA_MT_BENCH_DESC_BYTES / DMA_LINE_SIZE);
+  // The engine doesn't route ddr_to_ddr and stops on it
+  dma_init_descriptor(&bad, ddr_to_ddr, dma_fpga_mem_addr(dev_addr),
+                      dma_fpga_mem_addr(dev_addr + DMA_MT_BENCH_DESC_BYTES),
+                      DMA_MT_BENCH_DESC_BYTES / DMA_LINE_SIZE);
+
+  // Post more after the error than the queue holds. Posting only finishes
+  // if the submitter fails the descriptors queued behind the error.
+  t_dma_completion completion;
+  dma_completion_init(&completion);
+  for (uint32_t i = 0; i < DMA_MT_BENCH_BATCH; i++)
+    dma_mt_post(mt, &good, &completion);
+  dma_mt_post(mt, &bad, &completion);
+  for (uint32_t i = 0; i < 2 * DMA_MT_QUEUE_SIZE; i++)
+    dma_mt_post(mt, &good, &completion);
+
+  const int wait_status = dma_completion_wait(&completion);
+  const int stop_status = dma_mt_stop(mt);
+
+  free_io_shared_buffer(accel_handle, buf, DMA_MT_BENCH_DESC_BYTES, wsid,
+                        host_iova);
+  free_fpga_mem_buffer(dev_addr);
+  dma_engine_release(verbose);
+
+  if ((wait_status != -1) || (stop_status != -1)) {
+    fprintf(stderr,
+            "Error: engine error not reported (completion %d, stop %d)\n",
+            wait_status, stop_status);
+    return 1;
+  }
+  printf("Engine error reported to the completion and by dma_mt_stop()\n");
+  return 0;
+}
+
+// Stream DMA_NUMA_BENCH_BYTES through bufs in one direction. Returns GB/s
+// or a negative value on error.
+static double numa_bench_rate(fpga_handle accel_handle, e_dma_mode mode,
+                              const t_pinned_buffer *bufs, uint64_t dev_addr) {
+  const uint64_t num_descs = DMA_NUMA_BENCH_BYTES / DMA_MAX_DESC_BYTES;
+  const uint64_t start_ns = latency_now_ns();
+
+  for (uint64_t i = 0; i < num_descs; i++) {
+    const uint32_t b = i % DMA_NUMA_BENCH_BUFS;
+    const uint64_t host = bufs[b].pa | DMA_HOST_MASK;
+    const uint64_t dev =
+        dma_fpga_mem_addr(dev_addr + (uint64_t)b * DMA_MAX_DESC_BYTES);
+
+    dma_descriptor_t desc;
+    if (mode == host_to_ddr)
+      dma_init_descriptor(&desc, mode, host, dev,
+                          DMA_MAX_DESC_BYTES / DMA_LINE_SIZE);
+    else
+      dma_init_descriptor(&desc, mode, dev, host,
+                          DMA_MAX_DESC_BYTES / DMA_LINE_SIZE);
+    if (0 == dma_submit(accel_handle, &desc))
+      return -1;
+  }
+  if (dma_wait_idle(accel_handle, false))
+    return -1;
+
+  return (double)DMA_NUMA_BENCH_BYTES / (latency_now_ns() - start_ns);
+}
+
+int dma_numa_bench(fpga_handle accel_handle, bool is_ase_sim, bool verbose) {
+  int status = 0;
+
+  dma_engine_init(accel_handle, is_ase_sim);
+
+  const int local = dma_numa_node();
+  const int num_nodes = numa_num_nodes();
+  if ((local < 0) || (num_nodes < 2)) {
+    printf("NUMA placement benchmark needs a multi-node host and a known "
+           "FPGA node\n");
+    dma_engine_release(verbose);
+    return 0;
+  }
+
+  uint64_t dev_addr;
+  if (alloc_fpga_mem_buffer(DMA_NUMA_BENCH_BUFS * DMA_MAX_DESC_BYTES,
+                            &dev_addr) != FPGA_OK) {
+    fprintf(stderr, "Error allocating device memory\n");
+    dma_engine_release(verbose);
+    return 1;
+  }
+
+  // The submitting thread stays on the FPGA's node. Only the host
+  // buffers move.
+  const int nodes[2] = {local, (local + 1) % num_nodes};
+  double rates[2][2] = {{0}};
+  printf("FPGA on NUMA node %d, submitting from node %d\n", local, local);
+  printf("%-8s %6s %12s %12s %16s\n", "buffers", "node", "H2D GB/s",
+         "D2H GB/s", "remote bytes");
+
+  for (int p = 0; (p < 2) && !status; p++) {
+    // A private pool, so buffers cached on the other node aren't reused
+    t_pinned_buffer_pool *pool = pinned_buffer_pool_create(accel_handle);
+    t_pinned_buffer bufs[DMA_NUMA_BENCH_BUFS];
+    uint32_t num_bufs = 0;
+
+    if (NULL == pool) {
+      status = 1;
+      break;
+    }
+    pinned_buffer_pool_set_numa_node(pool, nodes[p]);
+
+    for (; num_bufs < DMA_NUMA_BENCH_BUFS; num_bufs++) {
+      if (pinned_buffer_acquire(pool, DMA_MAX_DESC_BYTES, &bufs[num_bufs])) {
+        fprintf(stderr, "Error allocating buffers on node %d\n", nodes[p]);
+        status = 1;
+        break;
+      }
+      memset((void *)bufs[num_bufs].ptr, 0, DMA_MAX_DESC_BYTES);
+    }
+
+    if (!status) {
+      rates[p][0] = numa_bench_rate(accel_handle, host_to_ddr, bufs, dev_addr);
+      rates[p][1] = numa_bench_rate(accel_handle, ddr_to_host, bufs, dev_addr);
+      if ((rates[p][0] < 0) || (rates[p][1] < 0))
+        status = 1;
+
+      t_pinned_buffer_pool_stats stats;
+      pinned_buffer_pool_get_stats(pool, &stats);
+      printf("%-8s %6d %12.2f %12.2f %16lu\n", p ? "remote" : "local",
+             nodes[p], rates[p][0], rates[p][1], stats.numa_remote_bytes);
+    }
+
+    while (num_bufs--)
+      pinned_buffer_release(pool, &bufs[num_bufs]);
+    pinned_buffer_pool_destroy(pool);
+  }
+
+  if (!status && (rates[1][0] > 0) && (rates[1][1] > 0))
+    printf("Local placement is %+0.1f%% host to DDR, %+0.1f%% DDR to host\n",
+           100.0 * (rates[0][0] / rates[1][0] - 1),
+           100.0 * (rates[0][1] / rates[1][1] - 1));
+
+  free_fpga_mem_buffer(dev_addr);
+  dma_engine_release(verbose);
+
+  return status;
+}
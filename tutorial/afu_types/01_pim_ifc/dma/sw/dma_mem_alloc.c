@@ -0,0 +1,199 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Device (DDR) memory allocator. Each bank is managed by a binary buddy
+// allocator stored as a complete binary tree. Every node holds one more
+// than the log2 of the largest free block in its subtree (counted in
+// DMA_FPGA_MEM_MIN_BLOCK units), or 0 when nothing below it is free. Both
+// allocation and free walk a single root-to-leaf path.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+_Static_assert((DMA_FPGA_MEM_MIN_BLOCK & DMA_FPGA_MEM_ALIGNMENT) == 0,
+               "Allocator blocks must honor DMA_FPGA_MEM_ALIGNMENT");
+
+#define BANK_ORDER 20
+#define BANK_LEAVES (1L << BANK_ORDER)
+_Static_assert((BANK_LEAVES * DMA_FPGA_MEM_MIN_BLOCK) == DMA_FPGA_MEM_BANK_SIZE,
+               "BANK_ORDER must cover DMA_FPGA_MEM_BANK_SIZE");
+
+typedef struct {
+  uint8_t *tree;
+  uint64_t allocated_bytes;
+} t_mem_bank;
+
+static t_mem_bank s_banks[DMA_FPGA_NUM_MEM_BANKS];
+static uint32_t s_next_bank;
+static uint64_t s_num_allocs;
+static uint64_t s_num_failures;
+static pthread_mutex_t s_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LEFT(n) (2 * (n) + 1)
+#define RIGHT(n) (2 * (n) + 2)
+#define PARENT(n) (((n) - 1) / 2)
+
+static int init_banks(void) {
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++) {
+    uint8_t *tree = malloc(2 * BANK_LEAVES - 1);
+    if (NULL == tree)
+      return -1;
+
+    // Every node starts out completely free
+    uint32_t order = BANK_ORDER;
+    for (uint64_t n = 0; n < 2 * BANK_LEAVES - 1; n++) {
+      if (n == (1UL << (BANK_ORDER - order + 1)) - 1)
+        order -= 1;
+      tree[n] = order + 1;
+    }
+
+    s_banks[b].tree = tree;
+    s_banks[b].allocated_bytes = 0;
+  }
+
+  return 0;
+}
+
+static void update_parents(uint8_t *tree, uint64_t node, uint32_t order) {
+  while (node) {
+    node = PARENT(node);
+    order += 1;
+
+    const uint8_t l = tree[LEFT(node)];
+    const uint8_t r = tree[RIGHT(node)];
+    if ((l == order) && (r == order))
+      tree[node] = order + 1; // Both halves free, merge the buddies
+    else
+      tree[node] = (l > r) ? l : r;
+  }
+}
+
+// Allocate a block of 2^order minimum blocks from a bank. Returns the byte
+// offset within the bank or -1.
+static int64_t bank_alloc(t_mem_bank *bank, uint32_t order) {
+  uint8_t *tree = bank->tree;
+  if (tree[0] < order + 1)
+    return -1;
+
+  uint64_t node = 0;
+  for (uint32_t o = BANK_ORDER; o != order; o--) {
+    node = (tree[LEFT(node)] >= order + 1) ? LEFT(node) : RIGHT(node);
+  }
+
+  tree[node] = 0;
+  update_parents(tree, node, order);
+
+  const uint64_t block = ((node + 1) << order) - BANK_LEAVES;
+  bank->allocated_bytes += (uint64_t)DMA_FPGA_MEM_MIN_BLOCK << order;
+  return block * DMA_FPGA_MEM_MIN_BLOCK;
+}
+
+static int bank_free(t_mem_bank *bank, uint64_t offset) {
+  uint8_t *tree = bank->tree;
+  const uint64_t block = offset / DMA_FPGA_MEM_MIN_BLOCK;
+
+  // Climb from the leaf to the node that was handed out
+  uint64_t node = block + BANK_LEAVES - 1;
+  uint32_t order = 0;
+  while (tree[node] != 0) {
+    if (node == 0)
+      return -1;
+    node = PARENT(node);
+    order += 1;
+  }
+
+  // The address must be the start of the block
+  if ((block & ((1L << order) - 1)) != 0)
+    return -1;
+
+  tree[node] = order + 1;
+  update_parents(tree, node, order);
+  bank->allocated_bytes -= (uint64_t)DMA_FPGA_MEM_MIN_BLOCK << order;
+  return 0;
+}
+
+fpga_result alloc_fpga_mem_buffer(size_t size, uint64_t *addr) {
+  if ((size == 0) || (size > DMA_FPGA_MEM_BANK_SIZE))
+    return FPGA_INVALID_PARAM;
+
+  uint32_t order = 0;
+  while (((uint64_t)DMA_FPGA_MEM_MIN_BLOCK << order) < size)
+    order += 1;
+
+  pthread_mutex_lock(&s_mem_lock);
+
+  if ((NULL == s_banks[0].tree) && init_banks()) {
+    pthread_mutex_unlock(&s_mem_lock);
+    return FPGA_NO_MEMORY;
+  }
+
+  // Large allocations rotate through the banks. Small ones are packed
+  // into the lowest bank with room, leaving big free blocks elsewhere.
+  const bool interleave = (size >= DMA_FPGA_MEM_INTERLEAVE_MIN);
+  const uint32_t first_bank = interleave ? s_next_bank : 0;
+
+  for (uint32_t i = 0; i < DMA_FPGA_NUM_MEM_BANKS; i++) {
+    const uint32_t b = (first_bank + i) % DMA_FPGA_NUM_MEM_BANKS;
+    const int64_t offset = bank_alloc(&s_banks[b], order);
+    if (offset >= 0) {
+      if (interleave)
+        s_next_bank = (b + 1) % DMA_FPGA_NUM_MEM_BANKS;
+      s_num_allocs += 1;
+      pthread_mutex_unlock(&s_mem_lock);
+
+      *addr = b * DMA_FPGA_MEM_BANK_SIZE + offset;
+      return FPGA_OK;
+    }
+  }
+
+  s_num_failures += 1;
+  pthread_mutex_unlock(&s_mem_lock);
+  return FPGA_NO_MEMORY;
+}
+
+fpga_result free_fpga_mem_buffer(uint64_t addr) {
+  const uint64_t b = addr / DMA_FPGA_MEM_BANK_SIZE;
+  if ((b >= DMA_FPGA_NUM_MEM_BANKS) || (NULL == s_banks[b].tree))
+    return FPGA_INVALID_PARAM;
+
+  pthread_mutex_lock(&s_mem_lock);
+  int status = bank_free(&s_banks[b], addr % DMA_FPGA_MEM_BANK_SIZE);
+  pthread_mutex_unlock(&s_mem_lock);
+
+  return status ? FPGA_INVALID_PARAM : FPGA_OK;
+}
+
+void print_fpga_mem_stats(FILE *f) {
+  pthread_mutex_lock(&s_mem_lock);
+
+  fprintf(f, "Device memory allocator:\n");
+  fprintf(f, "  Allocations: %ld (failed %ld)\n", s_num_allocs, s_num_failures);
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++) {
+    uint64_t largest_free = DMA_FPGA_MEM_BANK_SIZE;
+    if (s_banks[b].tree) {
+      const uint8_t l = s_banks[b].tree[0];
+      largest_free = l ? ((uint64_t)DMA_FPGA_MEM_MIN_BLOCK << (l - 1)) : 0;
+    }
+
+    // Fragmentation: share of free memory not in the largest free block
+    const uint64_t free_bytes =
+        DMA_FPGA_MEM_BANK_SIZE - s_banks[b].allocated_bytes;
+    const double frag =
+        free_bytes ? 100.0 * (free_bytes - largest_free) / free_bytes : 0.0;
+
+    fprintf(f, "  Bank %d: %ld bytes allocated, largest free block %ld, "
+               "fragmentation %0.1f%%\n",
+            b, s_banks[b].allocated_bytes, largest_free, frag);
+  }
+
+  pthread_mutex_unlock(&s_mem_lock);
+}
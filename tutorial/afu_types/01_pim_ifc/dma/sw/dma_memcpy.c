@@ -0,0 +1,94 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Copies between two regions of device memory.
+//
+// The copy is staged through one pinned host buffer rather than made with
+// ddr_to_ddr descriptors: dma_axi_mm_mux.sv doesn't route them and
+// dma_ddr_selector.sv would always pick bank 0 for them. The read engine
+// waits for the write responses of a descriptor before starting the next
+// one, so a ddr_to_host descriptor followed by a host_to_ddr descriptor
+// from the same buffer is ordered by the engine itself. The whole copy is
+// queued without the host waiting between pieces, at the cost of moving
+// the data over PCIe twice.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+static uint64_t bank_left(uint64_t dev_addr) {
+  return DMA_FPGA_MEM_BANK_SIZE - (dev_addr & (DMA_FPGA_MEM_BANK_SIZE - 1));
+}
+
+int dma_device_memcpy(fpga_handle accel_handle, uint64_t dst, uint64_t src,
+                      uint64_t len) {
+  int status = 0;
+
+  if ((dst % DMA_LINE_SIZE) || (src % DMA_LINE_SIZE) ||
+      (len % DMA_LINE_SIZE)) {
+    fprintf(stderr, "Error: device memcpy must be %d byte aligned\n",
+            DMA_LINE_SIZE);
+    return -1;
+  }
+  if ((dst < src + len) && (src < dst + len)) {
+    fprintf(stderr, "Error: device memcpy regions overlap\n");
+    return -1;
+  }
+  if (0 == len)
+    return 0;
+
+  uint64_t bounce_wsid, bounce_iova;
+  volatile void *bounce = alloc_io_shared_buffer(
+      accel_handle, DMA_MAX_DESC_BYTES, &bounce_wsid, &bounce_iova);
+  if (NULL == bounce) {
+    fprintf(stderr, "Error allocating device memcpy staging buffer\n");
+    return -1;
+  }
+  const uint64_t host = bounce_iova | DMA_HOST_MASK;
+
+  uint64_t offset = 0;
+  while (offset < len) {
+    const uint64_t s = src + offset;
+    const uint64_t d = dst + offset;
+
+    // Neither side of a descriptor may cross a bank
+    uint64_t n = len - offset;
+    if (n > DMA_MAX_DESC_BYTES)
+      n = DMA_MAX_DESC_BYTES;
+    if (n > bank_left(s))
+      n = bank_left(s);
+    if (n > bank_left(d))
+      n = bank_left(d);
+
+    const uint32_t lines = n / DMA_LINE_SIZE;
+    dma_descriptor_t desc;
+
+    dma_init_descriptor(&desc, ddr_to_host, dma_fpga_mem_addr(s), host, lines);
+    if (0 == dma_submit(accel_handle, &desc)) {
+      status = -1;
+      break;
+    }
+    dma_init_descriptor(&desc, host_to_ddr, host, dma_fpga_mem_addr(d), lines);
+    if (0 == dma_submit(accel_handle, &desc)) {
+      status = -1;
+      break;
+    }
+
+    offset += n;
+  }
+
+  if (dma_wait_idle(accel_handle, false))
+    status = -1;
+
+  free_io_shared_buffer(accel_handle, bounce, DMA_MAX_DESC_BYTES,
+                        bounce_wsid, bounce_iova);
+
+  return status;
+}
@@ -0,0 +1,269 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Host memory model of the DMA engine CSRs, following the register map in
+// dma.h. Writing DESCRIPTOR_CONTROL with DESCRIPTOR_GO set pushes the
+// descriptor window into a FIFO as deep as the engine's. Descriptors
+// retire in order at a modeled engine bandwidth and move their data when
+// they retire, so a descriptor always sees the writes of the ones before
+// it. Host addresses are host virtual addresses. Device memory is an
+// anonymous mapping per bank, committed only where it is written.
+//
+// Like the engine, the model stops on an error and sets
+// DMA_STATUS_STOPPED_ON_ERROR: for a malformed descriptor and for a
+// descriptor pushed while DMA_MAX_DESC_IN_FLIGHT are queued, since the 4
+// bit completed count could then wrap without software noticing.
+//
+
+// MAP_ANONYMOUS and MAP_NORESERVE
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+// Engine throughput, typical of a PCIe Gen4x16 platform, and a fixed cost
+// per descriptor
+#define DMA_MODEL_BYTES_PER_NS 16
+#define DMA_MODEL_DESC_NS      200
+// Clock of the modeled performance counters
+#define DMA_MODEL_CLOCK_MHZ    470
+
+#define DMA_MODEL_NUM_CSRS (DMA_CSR_IDX_WR_DEST_PERF_CNTR + 1)
+
+typedef struct {
+  dma_descriptor_t desc;
+  uint64_t start_ns;
+  uint64_t done_ns;
+} t_model_desc;
+
+struct t_dma_model {
+  // The submitting thread and the performance counter sampler both
+  // access the CSRs
+  pthread_mutex_t lock;
+  uint64_t csr[DMA_MODEL_NUM_CSRS];
+
+  t_model_desc fifo[DMA_DESCRIPTOR_FIFO_DEPTH];
+  uint32_t head;
+  uint32_t num_queued;
+  // Completed descriptors, reported modulo 16 in the status register
+  uint32_t num_completed;
+  // When the last queued descriptor finishes
+  uint64_t busy_until_ns;
+
+  bool stopped;
+
+  uint8_t *bank[DMA_FPGA_NUM_MEM_BANKS];
+};
+
+t_dma_model *dma_model_create(void) {
+  t_dma_model *m = calloc(1, sizeof(t_dma_model));
+  if (NULL == m)
+    return NULL;
+
+  pthread_mutex_init(&m->lock, NULL);
+  return m;
+}
+
+void dma_model_destroy(t_dma_model *m) {
+  if (NULL == m)
+    return;
+
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++) {
+    if (m->bank[b])
+      munmap(m->bank[b], DMA_FPGA_MEM_BANK_SIZE);
+  }
+  pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+static void stop_on_error(t_dma_model *m, const dma_descriptor_t *desc,
+                          const char *reason) {
+  fprintf(stderr,
+          "DMA CSR model: %s (src %016lX, dest %016lX, len %u, "
+          "control %08X)\n",
+          reason, desc->src_address, desc->dest_address, desc->len,
+          desc->control);
+  m->stopped = true;
+}
+
+// Host memory behind a descriptor address or NULL if it isn't one
+static uint8_t *host_ptr(uint64_t addr) {
+  if (!(addr & DMA_HOST_MASK))
+    return NULL;
+  return (uint8_t *)(uintptr_t)(addr & ~(uint64_t)DMA_HOST_MASK);
+}
+
+// Device memory behind a descriptor address or NULL if the address and
+// length don't fit in one bank
+static uint8_t *dev_ptr(t_dma_model *m, uint64_t addr, uint64_t len) {
+  const uint64_t bank = addr >> DMA_FPGA_BANK_SEL_SHIFT;
+  const uint64_t offset = addr & DMA_FPGA_MEM_BANK_ADDR_MASK;
+  if ((bank >= DMA_FPGA_NUM_MEM_BANKS) ||
+      ((addr & ~(bank << DMA_FPGA_BANK_SEL_SHIFT)) != offset) ||
+      (offset + len > DMA_FPGA_MEM_BANK_SIZE))
+    return NULL;
+
+  if (NULL == m->bank[bank]) {
+    void *p = mmap(NULL, DMA_FPGA_MEM_BANK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == p)
+      return NULL;
+    m->bank[bank] = p;
+  }
+
+  return m->bank[bank] + offset;
+}
+
+// Performance counter value at the end of a descriptor: data beats in
+// bits 19:0 and active cycles in bits 39:20
+static uint64_t perf_cntr(uint64_t lines, uint64_t ns) {
+  const uint64_t cycles = ns * DMA_MODEL_CLOCK_MHZ / 1000;
+  return (lines & 0xFFFFF) | ((cycles & 0xFFFFF) << 20);
+}
+
+// The performance counters count up while a descriptor runs and hold
+// their final values once the engine is idle
+static uint64_t perf_read(const t_dma_model *m, uint32_t idx) {
+  if (0 == m->num_queued)
+    return m->csr[idx];
+
+  const t_model_desc *d = &m->fifo[m->head];
+  const uint64_t now_ns = latency_now_ns();
+  const uint64_t elapsed_ns = (now_ns > d->start_ns) ? now_ns - d->start_ns : 0;
+  return perf_cntr(d->desc.len * elapsed_ns / (d->done_ns - d->start_ns),
+                   elapsed_ns);
+}
+
+// Move the data of the oldest queued descriptor and retire it
+static void retire(t_dma_model *m) {
+  const t_model_desc *d = &m->fifo[m->head];
+  const uint64_t len = (uint64_t)d->desc.len * DMA_LINE_SIZE;
+  const e_dma_mode mode = (d->desc.control >> MODE_SHIFT) & 3;
+
+  uint8_t *src, *dst;
+  if (host_to_ddr == mode) {
+    src = host_ptr(d->desc.src_address);
+    dst = dev_ptr(m, d->desc.dest_address, len);
+  } else {
+    src = dev_ptr(m, d->desc.src_address, len);
+    dst = host_ptr(d->desc.dest_address);
+  }
+  if ((NULL == src) || (NULL == dst)) {
+    stop_on_error(m, &d->desc, "unable to map device memory");
+    return;
+  }
+  memcpy(dst, src, len);
+
+  const uint64_t cntr = perf_cntr(d->desc.len, d->done_ns - d->start_ns);
+  m->csr[DMA_CSR_IDX_RD_SRC_PERF_CNTR] = cntr;
+  m->csr[DMA_CSR_IDX_WR_DEST_PERF_CNTR] = cntr;
+
+  m->head = (m->head + 1) % DMA_DESCRIPTOR_FIFO_DEPTH;
+  m->num_queued -= 1;
+  m->num_completed += 1;
+}
+
+// Retire every descriptor whose modeled finish time has passed
+static void update(t_dma_model *m) {
+  const uint64_t now_ns = latency_now_ns();
+  while (m->num_queued && !m->stopped &&
+         (m->fifo[m->head].done_ns <= now_ns))
+    retire(m);
+}
+
+static void push(t_dma_model *m) {
+  dma_descriptor_t desc;
+  desc.src_address = m->csr[DMA_CSR_IDX_SRC_ADDR];
+  desc.dest_address = m->csr[DMA_CSR_IDX_DEST_ADDR];
+  desc.len = m->csr[DMA_CSR_IDX_LENGTH];
+  desc.control = m->csr[DMA_CSR_IDX_DESCRIPTOR_CONTROL];
+
+  if (m->stopped)
+    return;
+
+  update(m);
+  if (m->num_queued >= DMA_MAX_DESC_IN_FLIGHT) {
+    stop_on_error(m, &desc, "too many descriptors in flight");
+    return;
+  }
+
+  // dma_axi_mm_mux.sv routes only the two host modes
+  const e_dma_mode mode = (desc.control >> MODE_SHIFT) & 3;
+  const uint64_t len = (uint64_t)desc.len * DMA_LINE_SIZE;
+  bool ok = (len > 0) && (len <= DMA_MAX_DESC_BYTES) &&
+            ((desc.src_address % DMA_LINE_SIZE) == 0) &&
+            ((desc.dest_address % DMA_LINE_SIZE) == 0);
+  if (host_to_ddr == mode)
+    ok = ok && host_ptr(desc.src_address) &&
+         !host_ptr(desc.dest_address) &&
+         dev_ptr(m, desc.dest_address, len);
+  else if (ddr_to_host == mode)
+    ok = ok && !host_ptr(desc.src_address) &&
+         dev_ptr(m, desc.src_address, len) && host_ptr(desc.dest_address);
+  else
+    ok = false;
+  if (!ok) {
+    stop_on_error(m, &desc, "invalid descriptor");
+    return;
+  }
+
+  const uint64_t now_ns = latency_now_ns();
+  t_model_desc *d =
+      &m->fifo[(m->head + m->num_queued) % DMA_DESCRIPTOR_FIFO_DEPTH];
+  d->desc = desc;
+  d->start_ns = (m->busy_until_ns > now_ns) ? m->busy_until_ns : now_ns;
+  d->done_ns = d->start_ns + DMA_MODEL_DESC_NS + len / DMA_MODEL_BYTES_PER_NS;
+  m->busy_until_ns = d->done_ns;
+  m->num_queued += 1;
+}
+
+static uint64_t status(const t_dma_model *m) {
+  uint64_t v = (uint64_t)(m->num_completed & DMA_STATUS_DESC_COUNT_MASK)
+               << DMA_STATUS_DESC_COUNT_SHIFT;
+  if (m->num_queued)
+    v |= DMA_STATUS_BUSY;
+  else
+    v |= DMA_STATUS_DESC_FIFO_EMPTY;
+  if (m->stopped)
+    v |= DMA_STATUS_STOPPED_ON_ERROR;
+  return v;
+}
+
+uint64_t dma_model_read_csr(t_dma_model *m, uint32_t idx) {
+  if (idx >= DMA_MODEL_NUM_CSRS)
+    return 0;
+
+  pthread_mutex_lock(&m->lock);
+  update(m);
+  uint64_t v;
+  if (DMA_CSR_IDX_STATUS == idx)
+    v = status(m);
+  else if ((DMA_CSR_IDX_RD_SRC_PERF_CNTR == idx) ||
+           (DMA_CSR_IDX_WR_DEST_PERF_CNTR == idx))
+    v = perf_read(m, idx);
+  else
+    v = m->csr[idx];
+  pthread_mutex_unlock(&m->lock);
+
+  return v;
+}
+
+void dma_model_write_csr(t_dma_model *m, uint32_t idx, uint64_t v) {
+  if (idx >= DMA_MODEL_NUM_CSRS)
+    return;
+
+  pthread_mutex_lock(&m->lock);
+  m->csr[idx] = v;
+  if ((DMA_CSR_IDX_DESCRIPTOR_CONTROL == idx) && (v & DESCRIPTOR_GO))
+    push(m);
+  pthread_mutex_unlock(&m->lock);
+}
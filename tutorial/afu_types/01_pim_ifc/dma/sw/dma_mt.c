@@ -0,0 +1,282 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Multi-threaded descriptor submission.
+//
+// Any number of threads post descriptors to a bounded lock-free queue. A
+// single submitter thread owns the CSR window: it drains the queue into
+// the engine with dma_submit(), polls for completions and signals the
+// posting threads. Since only the submitter calls into the engine, the
+// engine state in dma.c is never shared between threads.
+//
+// The queue is a ring of slots, each with a sequence number. A producer
+// claims a position with a compare-and-swap on the enqueue index, fills
+// the slot and publishes it by advancing the slot's sequence number. The
+// consumer reads slots in order and frees each one by advancing its
+// sequence number by the ring size.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+#include "numa_util.h"
+
+typedef struct {
+  _Atomic uint64_t seq;
+  dma_descriptor_t desc;
+  t_dma_completion *completion;
+} t_mt_slot;
+
+struct dma_mt {
+  fpga_handle accel_handle;
+  uint64_t mask;
+  t_mt_slot *slots;
+
+  // Producers contend on the enqueue index. Keep it on its own cache line,
+  // away from the consumer's state.
+  _Alignas(64) _Atomic uint64_t enqueue_pos;
+  _Alignas(64) uint64_t dequeue_pos;
+
+  pthread_t thread;
+  atomic_bool running;
+  _Atomic int status;
+
+  // Completion of each descriptor in the engine, indexed by ticket
+  t_dma_completion *inflight[DMA_DESCRIPTOR_FIFO_DEPTH];
+  dma_ticket_t next_retire;
+  dma_ticket_t last_ticket;
+};
+
+static void sleep_us(uint32_t us) {
+  const struct timespec ts = {.tv_sec = us / 1000000,
+                              .tv_nsec = (us % 1000000) * 1000};
+  nanosleep(&ts, NULL);
+}
+
+static bool dequeue(t_dma_mt *mt, dma_descriptor_t *desc,
+                    t_dma_completion **completion) {
+  t_mt_slot *slot = &mt->slots[mt->dequeue_pos & mt->mask];
+  const uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (seq != mt->dequeue_pos + 1)
+    return false;
+
+  *desc = slot->desc;
+  *completion = slot->completion;
+  atomic_store_explicit(&slot->seq, mt->dequeue_pos + mt->mask + 1,
+                        memory_order_release);
+  mt->dequeue_pos += 1;
+  return true;
+}
+
+static void complete(t_dma_completion *c, int status) {
+  if (NULL == c)
+    return;
+  if (status)
+    atomic_store_explicit(&c->status, status, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&c->pending, 1, memory_order_release);
+}
+
+// Signal the owners of every descriptor the engine has retired
+static void retire(t_dma_mt *mt, int status) {
+  while ((mt->next_retire <= mt->last_ticket) &&
+         (status || dma_ticket_done(mt->next_retire))) {
+    t_dma_completion **c =
+        &mt->inflight[mt->next_retire & (DMA_DESCRIPTOR_FIFO_DEPTH - 1)];
+    complete(*c, status);
+    *c = NULL;
+    mt->next_retire += 1;
+  }
+}
+
+// Descriptors the engine still owes a completion. Once the engine stops
+// on an error it retires nothing more, so stop polling it.
+static uint32_t engine_inflight(t_dma_mt *mt) {
+  if (atomic_load_explicit(&mt->status, memory_order_relaxed))
+    return 0;
+  return dma_inflight();
+}
+
+static void *submitter_thread(void *args) {
+  t_dma_mt *mt = args;
+  uint32_t backoff_us = 0;
+
+  // The submitter does all the MMIO, so keep it next to the FPGA
+  if (dma_numa_node() >= 0)
+    numa_bind_thread(dma_numa_node());
+
+  while (true) {
+    bool busy = false;
+
+    // Fill the engine's descriptor FIFO from the queue. After an error,
+    // fail everything still queued.
+    dma_descriptor_t desc;
+    t_dma_completion *completion;
+    while ((engine_inflight(mt) < DMA_MAX_DESC_IN_FLIGHT) &&
+           dequeue(mt, &desc, &completion)) {
+      if (atomic_load_explicit(&mt->status, memory_order_relaxed)) {
+        complete(completion, -1);
+        continue;
+      }
+
+      const dma_ticket_t ticket = dma_submit(mt->accel_handle, &desc);
+      if (0 == ticket) {
+        atomic_store_explicit(&mt->status, -1, memory_order_relaxed);
+        retire(mt, -1);
+        complete(completion, -1);
+        continue;
+      }
+
+      mt->inflight[ticket & (DMA_DESCRIPTOR_FIFO_DEPTH - 1)] = completion;
+      mt->last_ticket = ticket;
+      busy = true;
+    }
+
+    if (engine_inflight(mt)) {
+      if (dma_poll(mt->accel_handle) < 0) {
+        atomic_store_explicit(&mt->status, -1, memory_order_relaxed);
+        retire(mt, -1);
+      } else {
+        retire(mt, 0);
+      }
+      busy = true;
+    }
+
+    if (busy) {
+      backoff_us = 0;
+      continue;
+    }
+
+    // Idle. Leave only once every posted descriptor has been handled.
+    if (!atomic_load_explicit(&mt->running, memory_order_acquire) &&
+        (atomic_load_explicit(&mt->enqueue_pos, memory_order_acquire) ==
+         mt->dequeue_pos))
+      break;
+
+    if (backoff_us) {
+      sleep_us(backoff_us);
+      backoff_us = (2 * backoff_us < DMA_WAIT_BACKOFF_MAX_US)
+                       ? 2 * backoff_us
+                       : DMA_WAIT_BACKOFF_MAX_US;
+    } else {
+      sched_yield();
+      backoff_us = DMA_WAIT_BACKOFF_MIN_US;
+    }
+  }
+
+  return NULL;
+}
+
+t_dma_mt *dma_mt_start(fpga_handle accel_handle, uint32_t queue_size) {
+  // The ring is indexed by masking
+  assert(queue_size && !(queue_size & (queue_size - 1)));
+
+  t_dma_mt *mt;
+  if (posix_memalign((void **)&mt, 64, sizeof(t_dma_mt)))
+    return NULL;
+  memset(mt, 0, sizeof(t_dma_mt));
+
+  mt->slots = calloc(queue_size, sizeof(t_mt_slot));
+  if (NULL == mt->slots) {
+    free(mt);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < queue_size; i++)
+    atomic_init(&mt->slots[i].seq, i);
+
+  mt->accel_handle = accel_handle;
+  mt->mask = queue_size - 1;
+  atomic_init(&mt->enqueue_pos, 0);
+  atomic_init(&mt->status, 0);
+  atomic_init(&mt->running, true);
+  mt->next_retire = 1;
+
+  if (pthread_create(&mt->thread, NULL, submitter_thread, mt)) {
+    free(mt->slots);
+    free(mt);
+    return NULL;
+  }
+
+  return mt;
+}
+
+int dma_mt_stop(t_dma_mt *mt) {
+  atomic_store_explicit(&mt->running, false, memory_order_release);
+  pthread_join(mt->thread, NULL);
+
+  const int status = atomic_load(&mt->status);
+  free(mt->slots);
+  free(mt);
+  return status;
+}
+
+void dma_completion_init(t_dma_completion *c) {
+  atomic_init(&c->pending, 0);
+  atomic_init(&c->status, 0);
+}
+
+int dma_mt_post(t_dma_mt *mt, const dma_descriptor_t *desc,
+                t_dma_completion *completion) {
+  if (completion)
+    atomic_fetch_add_explicit(&completion->pending, 1, memory_order_relaxed);
+
+  uint64_t pos = atomic_load_explicit(&mt->enqueue_pos, memory_order_relaxed);
+  t_mt_slot *slot;
+  while (true) {
+    slot = &mt->slots[pos & mt->mask];
+    const uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    const int64_t diff = (int64_t)(seq - pos);
+
+    if (0 == diff) {
+      if (atomic_compare_exchange_weak_explicit(&mt->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // Full. The submitter frees slots as fast as the engine accepts
+      // descriptors, so wait for it.
+      sched_yield();
+      pos = atomic_load_explicit(&mt->enqueue_pos, memory_order_relaxed);
+    } else {
+      // Another producer claimed the slot first
+      pos = atomic_load_explicit(&mt->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  slot->desc = *desc;
+  slot->completion = completion;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+  return 0;
+}
+
+bool dma_completion_done(t_dma_completion *c) {
+  return 0 == atomic_load_explicit(&c->pending, memory_order_acquire);
+}
+
+int dma_completion_wait(t_dma_completion *c) {
+  const uint64_t spin_end_ns = latency_now_ns() + DMA_WAIT_SPIN_NS;
+  uint32_t backoff_us = DMA_WAIT_BACKOFF_MIN_US;
+
+  while (!dma_completion_done(c)) {
+    if (latency_now_ns() < spin_end_ns)
+      continue;
+
+    sleep_us(backoff_us);
+    backoff_us = (2 * backoff_us < DMA_WAIT_BACKOFF_MAX_US)
+                     ? 2 * backoff_us
+                     : DMA_WAIT_BACKOFF_MAX_US;
+  }
+
+  return atomic_load_explicit(&c->status, memory_order_relaxed);
+}
@@ -0,0 +1,237 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Sampling service for the engine's read and write performance counters.
+//
+// DMA_CSR_IDX_RD_SRC_PERF_CNTR and DMA_CSR_IDX_WR_DEST_PERF_CNTR each hold
+// a 20 bit count of active cycles (bits 39:20) and a 20 bit count of data
+// beats (bits 19:0). The cycle count wraps after about 2ms at 470MHz and
+// both are cleared when the engine starts a new descriptor. A background
+// thread samples them more often than they can wrap and folds the deltas
+// into 64 bit totals.
+//
+// The counters only ever show the running or last finished descriptor.
+// When the next one starts before a sample sees the final values of the
+// one before, the tail of that descriptor is lost, and a descriptor that
+// starts and finishes between two samples is lost entirely. A 2MB
+// descriptor takes less time than the default sample period, so a stream
+// of back to back descriptors can lose most of its lines. Both counters
+// lose the same intervals, so utilization and bandwidth remain estimates
+// of the sampled time, but the line and cycle counts are totals only when
+// the final values of every descriptor were sampled. The totals record
+// how many were, and dma_perf_print() reports lost descriptors instead of
+// totals.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+#define PERF_CNTR_BITS 20
+#define PERF_CNTR_MASK ((1u << PERF_CNTR_BITS) - 1)
+// Attempts at a sample that no descriptor boundary splits
+#define PERF_SAMPLE_RETRIES 8
+
+typedef struct {
+  uint32_t valid;
+  uint32_t clk;
+} t_raw_cntr;
+
+static pthread_t s_perf_thread;
+static pthread_mutex_t s_perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool s_perf_running;
+static uint32_t s_perf_period_us;
+
+// State from the previous sample
+static t_raw_cntr s_prev_rd;
+static t_raw_cntr s_prev_wr;
+static uint32_t s_prev_desc_count;
+static bool s_prev_busy;
+
+static t_dma_perf_totals s_totals;
+
+static t_raw_cntr decode_cntr(uint64_t v) {
+  t_raw_cntr c;
+  c.valid = v & PERF_CNTR_MASK;
+  c.clk = (v >> PERF_CNTR_BITS) & PERF_CNTR_MASK;
+  return c;
+}
+
+static void accumulate(t_dma_perf_cntr *total, t_raw_cntr *prev,
+                       t_raw_cntr cur, bool restarted) {
+  if (restarted) {
+    // Counters were cleared by a new descriptor
+    total->valid += cur.valid;
+    total->clk += cur.clk;
+  } else {
+    if (cur.clk < prev->clk)
+      s_totals.num_wraps += 1;
+    total->valid += (cur.valid - prev->valid) & PERF_CNTR_MASK;
+    total->clk += (cur.clk - prev->clk) & PERF_CNTR_MASK;
+  }
+
+  *prev = cur;
+}
+
+// Take one sample. Must be called with s_perf_lock held.
+static void sample(void) {
+  // Status and the counters are separate reads. Re-read status after the
+  // counters and retry if a descriptor finished or started in between,
+  // since the counters may then belong to either one.
+  const uint64_t status_mask =
+      ((uint64_t)DMA_STATUS_DESC_COUNT_MASK << DMA_STATUS_DESC_COUNT_SHIFT) |
+      DMA_STATUS_BUSY;
+  uint64_t status = dma_csr_read(DMA_CSR_IDX_STATUS);
+  t_raw_cntr rd, wr;
+  for (int retry = 0; retry < PERF_SAMPLE_RETRIES; retry++) {
+    rd = decode_cntr(dma_csr_read(DMA_CSR_IDX_RD_SRC_PERF_CNTR));
+    wr = decode_cntr(dma_csr_read(DMA_CSR_IDX_WR_DEST_PERF_CNTR));
+    const uint64_t status_after = dma_csr_read(DMA_CSR_IDX_STATUS);
+    if (!((status ^ status_after) & status_mask))
+      break;
+    status = status_after;
+  }
+
+  const uint32_t desc_count =
+      (status >> DMA_STATUS_DESC_COUNT_SHIFT) & DMA_STATUS_DESC_COUNT_MASK;
+  const uint32_t num_retired =
+      (desc_count - s_prev_desc_count) & DMA_STATUS_DESC_COUNT_MASK;
+
+  // After a sample of a running descriptor, the counters continue if no
+  // descriptor retired, or if exactly one retired and the engine is idle
+  // with the counters still holding its final values. After an idle
+  // sample they continue only if the engine did nothing, since any new
+  // descriptor cleared them.
+  const bool busy = status & DMA_STATUS_BUSY;
+  const bool same_desc =
+      s_prev_busy
+          ? ((num_retired == 0) ||
+             ((num_retired == 1) && !busy && (rd.valid >= s_prev_rd.valid) &&
+              (wr.valid >= s_prev_wr.valid)))
+          : ((num_retired == 0) && !busy);
+
+  accumulate(&s_totals.rd, &s_prev_rd, rd, !same_desc);
+  accumulate(&s_totals.wr, &s_prev_wr, wr, !same_desc);
+  // An idle engine holds the final values of the last descriptor
+  if (num_retired && !busy)
+    s_totals.num_sampled += 1;
+  s_prev_desc_count = desc_count;
+  s_prev_busy = busy;
+  s_totals.num_samples += 1;
+}
+
+static void *perf_thread(void *args) {
+  const struct timespec period = {
+      .tv_sec = s_perf_period_us / 1000000,
+      .tv_nsec = (s_perf_period_us % 1000000) * 1000};
+
+  while (s_perf_running) {
+    pthread_mutex_lock(&s_perf_lock);
+    sample();
+    pthread_mutex_unlock(&s_perf_lock);
+
+    nanosleep(&period, NULL);
+  }
+
+  return NULL;
+}
+
+int dma_perf_start(uint32_t period_us) {
+  if (s_perf_running)
+    return 0;
+
+  pthread_mutex_lock(&s_perf_lock);
+  const uint64_t status = dma_csr_read(DMA_CSR_IDX_STATUS);
+  s_prev_desc_count =
+      (status >> DMA_STATUS_DESC_COUNT_SHIFT) & DMA_STATUS_DESC_COUNT_MASK;
+  s_prev_busy = status & DMA_STATUS_BUSY;
+  s_prev_rd = decode_cntr(dma_csr_read(DMA_CSR_IDX_RD_SRC_PERF_CNTR));
+  s_prev_wr = decode_cntr(dma_csr_read(DMA_CSR_IDX_WR_DEST_PERF_CNTR));
+  s_totals = (t_dma_perf_totals){0};
+  pthread_mutex_unlock(&s_perf_lock);
+
+  s_perf_period_us = period_us;
+  s_perf_running = true;
+  if (pthread_create(&s_perf_thread, NULL, perf_thread, NULL)) {
+    s_perf_running = false;
+    return -1;
+  }
+
+  return 0;
+}
+
+void dma_perf_stop(void) {
+  if (!s_perf_running)
+    return;
+
+  s_perf_running = false;
+  pthread_join(s_perf_thread, NULL);
+}
+
+void dma_perf_get(t_dma_perf_totals *totals) {
+  pthread_mutex_lock(&s_perf_lock);
+  // Bring the totals up to date rather than waiting for the next period
+  if (s_perf_running)
+    sample();
+  *totals = s_totals;
+  totals->num_descs = dma_last_retired();
+  pthread_mutex_unlock(&s_perf_lock);
+}
+
+double dma_perf_bandwidth(const t_dma_perf_cntr *cntr) {
+  if (cntr->clk == 0)
+    return 0.0;
+
+  const double uptime = (double)cntr->valid / cntr->clk;
+  return uptime * MAX_TRPT_BYTES / 1000.0;
+}
+
+void dma_perf_delta(const t_dma_perf_totals *now, const t_dma_perf_totals *then,
+                    t_dma_perf_totals *delta) {
+  delta->rd.valid = now->rd.valid - then->rd.valid;
+  delta->rd.clk = now->rd.clk - then->rd.clk;
+  delta->wr.valid = now->wr.valid - then->wr.valid;
+  delta->wr.clk = now->wr.clk - then->wr.clk;
+  delta->num_samples = now->num_samples - then->num_samples;
+  delta->num_wraps = now->num_wraps - then->num_wraps;
+  delta->num_descs = now->num_descs - then->num_descs;
+  delta->num_sampled = now->num_sampled - then->num_sampled;
+}
+
+void dma_perf_print(const t_dma_perf_totals *totals, FILE *f) {
+  if (totals->num_sampled >= totals->num_descs) {
+    fprintf(f,
+            "Engine read: %ld lines in %ld cycles (%0.1f%% busy, %0.2f GB/s)\n",
+            totals->rd.valid, totals->rd.clk,
+            totals->rd.clk ? 100.0 * totals->rd.valid / totals->rd.clk : 0.0,
+            dma_perf_bandwidth(&totals->rd));
+    fprintf(f,
+            "Engine write: %ld lines in %ld cycles (%0.1f%% busy, %0.2f GB/s)\n",
+            totals->wr.valid, totals->wr.clk,
+            totals->wr.clk ? 100.0 * totals->wr.valid / totals->wr.clk : 0.0,
+            dma_perf_bandwidth(&totals->wr));
+  } else {
+    // Only the sampled intervals are known
+    fprintf(f, "Engine read: %0.1f%% busy, %0.2f GB/s while sampled\n",
+            totals->rd.clk ? 100.0 * totals->rd.valid / totals->rd.clk : 0.0,
+            dma_perf_bandwidth(&totals->rd));
+    fprintf(f, "Engine write: %0.1f%% busy, %0.2f GB/s while sampled\n",
+            totals->wr.clk ? 100.0 * totals->wr.valid / totals->wr.clk : 0.0,
+            dma_perf_bandwidth(&totals->wr));
+    fprintf(f,
+            "Final counts of %ld of %ld descriptors were not sampled, so "
+            "line and cycle totals are unknown\n",
+            totals->num_descs - totals->num_sampled, totals->num_descs);
+  }
+  fprintf(f, "Counter samples: %ld, wraps: %ld\n", totals->num_samples,
+          totals->num_wraps);
+}
@@ -0,0 +1,186 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Scatter-gather DMA between arbitrary user buffers and device memory.
+// The user buffer is pinned a chunk at a time and the engine reads or
+// writes it in place. A small ring of pinned chunks keeps the descriptor
+// FIFO busy while older chunks drain and are unpinned.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+typedef struct {
+  uint64_t wsid;
+  // Page aligned virtual address and IOVA of the pinned region
+  uint64_t base;
+  uint64_t iova;
+  // Last descriptor that touches the chunk
+  dma_ticket_t last_ticket;
+} t_sg_chunk;
+
+static fpga_result pin_chunk(fpga_handle accel_handle, uint64_t base,
+                             uint64_t size, t_sg_chunk *chunk) {
+  fpga_result r;
+  void *addr = (void *)base;
+
+  // The CSR model takes host virtual addresses as IOVAs
+  if (dma_is_csr_model()) {
+    chunk->wsid = 0;
+    chunk->iova = base;
+    chunk->base = base;
+    chunk->last_ticket = 0;
+    return FPGA_OK;
+  }
+
+  r = fpgaPrepareBuffer(accel_handle, size, &addr, &chunk->wsid,
+                        FPGA_BUF_PREALLOCATED);
+  if (FPGA_OK != r)
+    return r;
+
+  r = fpgaGetIOAddress(accel_handle, chunk->wsid, &chunk->iova);
+  if (FPGA_OK != r) {
+    fpgaReleaseBuffer(accel_handle, chunk->wsid);
+    return r;
+  }
+
+  chunk->base = base;
+  chunk->last_ticket = 0;
+  return FPGA_OK;
+}
+
+// Unpin a chunk once every descriptor that references it has retired.
+static int release_chunk(fpga_handle accel_handle, t_sg_chunk *chunk) {
+  int status = 0;
+
+  if (chunk->last_ticket && dma_wait(accel_handle, chunk->last_ticket, false))
+    status = -1;
+
+  if (!dma_is_csr_model())
+    fpgaReleaseBuffer(accel_handle, chunk->wsid);
+  return status;
+}
+
+// End of the chunk starting at va. Whole 1GB regions are pinned at once,
+// anything else up to the next 2MB boundary.
+static uint64_t chunk_end(uint64_t va, uint64_t end) {
+  uint64_t next;
+
+  if (((va & (DMA_SG_HUGE_CHUNK_SIZE - 1)) == 0) &&
+      ((end - va) >= DMA_SG_HUGE_CHUNK_SIZE))
+    next = va + DMA_SG_HUGE_CHUNK_SIZE;
+  else
+    next = (va + DMA_SG_CHUNK_SIZE) & ~(DMA_SG_CHUNK_SIZE - 1);
+
+  return (next < end) ? next : end;
+}
+
+int dma_sg_transfer(fpga_handle accel_handle, e_dma_mode mode, void *host_buf,
+                    uint64_t dev_addr, uint64_t len) {
+  const uint64_t buf_va = (uint64_t)host_buf;
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+  if ((mode != host_to_ddr) && (mode != ddr_to_host)) {
+    fprintf(stderr, "Error: scatter-gather DMA requires a host transfer\n");
+    return -1;
+  }
+  if ((buf_va | dev_addr | len) % DMA_LINE_SIZE) {
+    fprintf(stderr, "Error: scatter-gather DMA must be %d byte aligned\n",
+            DMA_LINE_SIZE);
+    return -1;
+  }
+  if ((dev_addr + len) > (DMA_FPGA_NUM_MEM_BANKS * DMA_FPGA_MEM_BANK_SIZE)) {
+    fprintf(stderr, "Error: scatter-gather DMA beyond end of device memory\n");
+    return -1;
+  }
+
+  // Pinning works on whole pages. The pages around an unaligned buffer are
+  // mapped already since the buffer lives in them.
+  uint64_t pin_va = buf_va & ~(page_size - 1);
+  const uint64_t pin_end = (buf_va + len + page_size - 1) & ~(page_size - 1);
+
+  t_sg_chunk chunks[DMA_SG_MAX_PINNED_CHUNKS];
+  uint32_t head = 0;
+  uint32_t num_pinned = 0;
+  int status = 0;
+
+  while ((pin_va < pin_end) && (status == 0)) {
+    // Recycle the oldest chunk when the ring is full
+    if (num_pinned == DMA_SG_MAX_PINNED_CHUNKS) {
+      status = release_chunk(accel_handle, &chunks[head]);
+      head = (head + 1) % DMA_SG_MAX_PINNED_CHUNKS;
+      num_pinned -= 1;
+      if (status)
+        break;
+    }
+
+    t_sg_chunk *chunk =
+        &chunks[(head + num_pinned) % DMA_SG_MAX_PINNED_CHUNKS];
+    const uint64_t pin_next = chunk_end(pin_va, pin_end);
+    fpga_result r = pin_chunk(accel_handle, pin_va, pin_next - pin_va, chunk);
+    if (FPGA_OK != r) {
+      fprintf(stderr, "Error pinning scatter-gather chunk: %s\n",
+              fpgaErrStr(r));
+      status = -1;
+      break;
+    }
+    num_pinned += 1;
+
+    // Portion of the user buffer covered by this chunk
+    uint64_t va = (buf_va > pin_va) ? buf_va : pin_va;
+    const uint64_t va_end =
+        ((buf_va + len) < pin_next) ? (buf_va + len) : pin_next;
+
+    while (va < va_end) {
+      const uint64_t dev = dev_addr + (va - buf_va);
+      uint64_t n = va_end - va;
+      if (n > DMA_MAX_DESC_BYTES)
+        n = DMA_MAX_DESC_BYTES;
+
+      // A descriptor addresses a single local memory bank
+      const uint64_t bank_left =
+          DMA_FPGA_MEM_BANK_SIZE - (dev & (DMA_FPGA_MEM_BANK_SIZE - 1));
+      if (n > bank_left)
+        n = bank_left;
+
+      const uint64_t host = (chunk->iova + (va - chunk->base)) | DMA_HOST_MASK;
+      const uint64_t ddr = dma_fpga_mem_addr(dev);
+
+      dma_descriptor_t desc;
+      if (mode == host_to_ddr)
+        dma_init_descriptor(&desc, mode, host, ddr, n / DMA_LINE_SIZE);
+      else
+        dma_init_descriptor(&desc, mode, ddr, host, n / DMA_LINE_SIZE);
+
+      chunk->last_ticket = dma_submit(accel_handle, &desc);
+      if (chunk->last_ticket == 0) {
+        status = -1;
+        break;
+      }
+
+      va += n;
+    }
+
+    pin_va = pin_next;
+  }
+
+  // The engine must be finished with every chunk before it is unpinned
+  if (dma_wait_idle(accel_handle, false))
+    status = -1;
+
+  while (num_pinned) {
+    release_chunk(accel_handle, &chunks[head]);
+    head = (head + 1) % DMA_SG_MAX_PINNED_CHUNKS;
+    num_pinned -= 1;
+  }
+
+  return status;
+}
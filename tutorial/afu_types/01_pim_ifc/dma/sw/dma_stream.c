@@ -0,0 +1,240 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Streaming host to DDR transfers through a ring of pinned staging
+// buffers. The producer fills one buffer while earlier buffers are in
+// flight to device memory. When every buffer is still in flight the
+// producer blocks on the oldest, which limits how far it can run ahead of
+// the engine.
+//
+// Data is written to a ring in device memory, wrapping when it reaches
+// the end.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+typedef struct {
+  volatile void *ptr;
+  uint64_t wsid;
+  uint64_t iova;
+  // Last descriptor reading the buffer, 0 when idle
+  dma_ticket_t ticket;
+} t_stream_buf;
+
+struct dma_stream {
+  fpga_handle accel_handle;
+  uint32_t num_bufs;
+  uint64_t buf_size;
+  t_stream_buf *bufs;
+  // Buffer handed to the producer by the last dma_stream_get_buf()
+  uint32_t cur;
+  bool cur_valid;
+
+  uint64_t dev_base;
+  uint64_t dev_size;
+  uint64_t dev_offset;
+
+  t_dma_stream_stats stats;
+};
+
+t_dma_stream *dma_stream_open(fpga_handle accel_handle, uint32_t num_bufs,
+                              uint64_t buf_size, uint64_t dev_addr,
+                              uint64_t dev_size) {
+  assert(num_bufs > 0);
+  if ((0 == buf_size) || (buf_size > DMA_MAX_DESC_BYTES) ||
+      (buf_size % DMA_LINE_SIZE)) {
+    fprintf(stderr, "DMA stream buffer size %lu is not a multiple of %d "
+                    "bytes up to %d\n",
+            buf_size, DMA_LINE_SIZE, DMA_MAX_DESC_BYTES);
+    return NULL;
+  }
+  assert((dev_size >= buf_size) && (dev_size % buf_size == 0));
+  // The device ring must not cross a bank
+  assert((dev_addr / DMA_FPGA_MEM_BANK_SIZE) ==
+         ((dev_addr + dev_size - 1) / DMA_FPGA_MEM_BANK_SIZE));
+
+  t_dma_stream *s = calloc(1, sizeof(t_dma_stream));
+  if (NULL == s)
+    return NULL;
+
+  s->bufs = calloc(num_bufs, sizeof(t_stream_buf));
+  if (NULL == s->bufs) {
+    free(s);
+    return NULL;
+  }
+
+  s->accel_handle = accel_handle;
+  s->num_bufs = num_bufs;
+  s->buf_size = buf_size;
+  s->dev_base = dev_addr;
+  s->dev_size = dev_size;
+
+  for (uint32_t i = 0; i < num_bufs; i++) {
+    t_stream_buf *b = &s->bufs[i];
+    b->ptr = alloc_io_shared_buffer(accel_handle, buf_size, &b->wsid, &b->iova);
+    if (NULL == b->ptr) {
+      dma_stream_close(s);
+      return NULL;
+    }
+  }
+
+  return s;
+}
+
+void *dma_stream_get_buf(t_dma_stream *s) {
+  assert(!s->cur_valid);
+  t_stream_buf *b = &s->bufs[s->cur];
+
+  // Backpressure: the oldest buffer must drain before it is refilled
+  if (b->ticket && !dma_ticket_done(b->ticket)) {
+    const uint64_t start_ns = latency_now_ns();
+    s->stats.num_stalls += 1;
+    if (dma_wait(s->accel_handle, b->ticket, false))
+      return NULL;
+    s->stats.stall_ns += latency_now_ns() - start_ns;
+  }
+  b->ticket = 0;
+
+  s->cur_valid = true;
+  return (void *)b->ptr;
+}
+
+int dma_stream_put_buf(t_dma_stream *s, uint64_t len) {
+  assert(s->cur_valid);
+  assert((len <= s->buf_size) && (len % DMA_LINE_SIZE == 0));
+  t_stream_buf *b = &s->bufs[s->cur];
+
+  s->cur_valid = false;
+  s->cur = (s->cur + 1) % s->num_bufs;
+  if (0 == len)
+    return 0;
+
+  if (s->dev_offset + len > s->dev_size)
+    s->dev_offset = 0;
+
+  dma_descriptor_t desc;
+  dma_init_descriptor(&desc, host_to_ddr, b->iova | DMA_HOST_MASK,
+                      dma_fpga_mem_addr(s->dev_base + s->dev_offset),
+                      len / DMA_LINE_SIZE);
+  b->ticket = dma_submit(s->accel_handle, &desc);
+  if (0 == b->ticket)
+    return -1;
+
+  s->dev_offset += len;
+  s->stats.bytes += len;
+  s->stats.num_bufs += 1;
+  return 0;
+}
+
+void dma_stream_get_stats(const t_dma_stream *s, t_dma_stream_stats *stats) {
+  *stats = s->stats;
+}
+
+int dma_stream_close(t_dma_stream *s) {
+  int status = 0;
+
+  for (uint32_t i = 0; i < s->num_bufs; i++) {
+    t_stream_buf *b = &s->bufs[i];
+    if (NULL == b->ptr)
+      continue;
+
+    if (b->ticket && dma_wait(s->accel_handle, b->ticket, false))
+      status = -1;
+    free_io_shared_buffer(s->accel_handle, b->ptr, s->buf_size, b->wsid,
+                          b->iova);
+  }
+
+  free(s->bufs);
+  free(s);
+  return status;
+}
+
+int run_stream_test(fpga_handle accel_handle, bool is_ase_sim,
+                    uint64_t buf_size, uint32_t seconds, bool verbose) {
+  int status = 0;
+
+  const uint64_t dev_size = DMA_STREAM_DEV_RING_BUFS * buf_size;
+  uint64_t dev_addr;
+  if (alloc_fpga_mem_buffer(dev_size, &dev_addr) != FPGA_OK) {
+    fprintf(stderr, "Error allocating device memory\n");
+    return 1;
+  }
+
+  t_dma_stream *s = dma_stream_open(accel_handle, DMA_STREAM_NUM_BUFS,
+                                    buf_size, dev_addr, dev_size);
+  if (NULL == s) {
+    fprintf(stderr, "Error opening DMA stream\n");
+    free_fpga_mem_buffer(dev_addr);
+    return 1;
+  }
+
+  printf("Streaming %lu byte buffers through %d staging buffers for %u s\n",
+         buf_size, DMA_STREAM_NUM_BUFS, seconds);
+
+  const uint64_t start_ns = latency_now_ns();
+  const uint64_t end_ns = start_ns + seconds * 1000000000UL;
+  uint64_t report_ns = start_ns;
+  uint64_t report_bytes = 0;
+  uint64_t word = 0;
+  t_dma_stream_stats stats;
+
+  while (latency_now_ns() < end_ns) {
+    uint64_t *buf = dma_stream_get_buf(s);
+    if (NULL == buf) {
+      status = -1;
+      break;
+    }
+
+    // Stand-in for a producer generating data
+    for (uint64_t i = 0; i < buf_size / sizeof(uint64_t); i++)
+      buf[i] = word++;
+
+    if (dma_stream_put_buf(s, buf_size)) {
+      status = -1;
+      break;
+    }
+
+    // Report once a second
+    const uint64_t now_ns = latency_now_ns();
+    if (now_ns - report_ns >= 1000000000UL) {
+      dma_stream_get_stats(s, &stats);
+      printf("  %4lu s: %0.2f GB/s\n", (now_ns - start_ns) / 1000000000UL,
+             (double)(stats.bytes - report_bytes) / (now_ns - report_ns));
+      report_bytes = stats.bytes;
+      report_ns = now_ns;
+    }
+  }
+
+  dma_stream_get_stats(s, &stats);
+  if (dma_stream_close(s))
+    status = -1;
+  const uint64_t elapsed_ns = latency_now_ns() - start_ns;
+
+  printf("Streamed %lu bytes in %0.1f s: %0.2f GB/s sustained\n", stats.bytes,
+         elapsed_ns / 1e9, (double)stats.bytes / elapsed_ns);
+  printf("Producer stalled %lu times waiting for a free buffer, %0.1f%% of "
+         "the run\n",
+         stats.num_stalls, 100.0 * stats.stall_ns / elapsed_ns);
+
+  free_fpga_mem_buffer(dev_addr);
+  return status;
+}
+
+int dma_stream_bench(fpga_handle accel_handle, bool is_ase_sim,
+                     uint64_t buf_size, uint32_t seconds, bool verbose) {
+  dma_engine_init(accel_handle, is_ase_sim);
+  int status = run_stream_test(accel_handle, is_ase_sim, buf_size, seconds,
+                               verbose);
+  dma_engine_release(verbose);
+
+  return status;
+}
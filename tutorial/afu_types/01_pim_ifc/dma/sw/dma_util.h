@@ -4,6 +4,10 @@
 #ifndef __DMA_UTIL_H__
 #define __DMA_UTIL__H__
 
+#include <stdatomic.h>
+
+#include "latency_hist.h"
+
 typedef enum dma_mode {
    stand_by    = 0x0,
    host_to_ddr = 0x1,
@@ -18,6 +22,40 @@ typedef struct __attribute__((__packed__))  {
    uint32_t control;
 } dma_descriptor_t;
 
+// Totals from the read and write engine performance counters
+typedef struct {
+  uint64_t valid; // Data beats (DMA_LINE_SIZE bytes each)
+  uint64_t clk;   // Cycles while the engine was moving data
+} t_dma_perf_cntr;
+
+typedef struct {
+  t_dma_perf_cntr rd;
+  t_dma_perf_cntr wr;
+  uint64_t num_samples;
+  uint64_t num_wraps;
+  // Descriptors retired by the host and those whose final counter values
+  // were sampled. The line and cycle counts are complete only when the
+  // two match.
+  uint64_t num_descs;
+  uint64_t num_sampled;
+} t_dma_perf_totals;
+
+// Sequence number assigned to a submitted descriptor. Tickets increase
+// monotonically from 1, so 0 never names a real descriptor.
+typedef uint64_t dma_ticket_t;
+
+// Map the CSRs, synchronize with the engine's completion count and start
+// the buffer pool and performance counter service. dma_engine_release()
+// undoes it and, when verbose, prints buffer and device memory statistics.
+void dma_engine_init(fpga_handle accel_handle, bool is_ase_sim);
+void dma_engine_release(bool verbose);
+
+// Is dma_engine_init() using the CSR model? See dma_use_csr_model().
+bool dma_is_csr_model(void);
+
+// Read a CSR by index using mapped MMIO when available
+uint64_t dma_csr_read(uint32_t idx);
+
 void mmio_read64( fpga_handle accel_handle, 
                   uint64_t addr, 
                   uint64_t *data, 
@@ -31,6 +69,75 @@ void send_descriptor( fpga_handle accel_handle,
                       uint64_t mmio_dst, 
                       dma_descriptor_t desc);
 
+// Mapped CSR space, or NULL when MMIO goes through the OPAE library (ASE)
+// or the CSR model.
+volatile uint64_t *dma_mmio_base(void);
+
+// NUMA node of the FPGA, found by dma_engine_init(), or -1 when unknown.
+// Pinned buffers are allocated from it and the initializing thread is
+// bound to it.
+int dma_numa_node(void);
+
+// Store a descriptor to the CSR window of a mapped CSR space. The CSRs are
+// behind a 64 bit AXI-lite port and the descriptor window is not 32 byte
+// aligned, so wide or write-combined stores would be split or misrouted.
+// Ordered 64 bit stores are used instead, with the control word last since
+// writing it with DESCRIPTOR_GO set pushes the descriptor into the FIFO.
+static inline void dma_store_descriptor(volatile uint64_t *csrs,
+                                        const dma_descriptor_t *desc) {
+  csrs[DMA_CSR_IDX_SRC_ADDR] = desc->src_address;
+  csrs[DMA_CSR_IDX_DEST_ADDR] = desc->dest_address;
+  csrs[DMA_CSR_IDX_LENGTH] = desc->len;
+  csrs[DMA_CSR_IDX_DESCRIPTOR_CONTROL] = desc->control;
+}
+
+// Convert a linear device memory address (bank * DMA_FPGA_MEM_BANK_SIZE +
+// offset) to the bank-selecting encoding used in descriptors.
+uint64_t dma_fpga_mem_addr(uint64_t dev_addr);
+
+void dma_init_descriptor(dma_descriptor_t *desc,
+                         e_dma_mode mode,
+                         uint64_t src,
+                         uint64_t dest,
+                         uint32_t len);
+
+// Queue a single descriptor and return its ticket without waiting for the
+// transfer. Blocks only while the descriptor FIFO is full. Returns 0 on error.
+dma_ticket_t dma_submit(fpga_handle accel_handle,
+                        const dma_descriptor_t *desc);
+
+// Retire descriptors the engine has finished. Returns the number retired
+// or -1 if the engine stopped on an error.
+int dma_poll(fpga_handle accel_handle);
+
+// Has the descriptor named by ticket been retired? Call dma_poll() to
+// refresh completion state.
+bool dma_ticket_done(dma_ticket_t ticket);
+
+// Number of descriptors submitted and not yet retired.
+uint32_t dma_inflight(void);
+
+// Ticket of the most recently retired descriptor, 0 if none has retired.
+dma_ticket_t dma_last_retired(void);
+
+// Wait until the descriptor named by ticket, and all before it, retire.
+int dma_wait(fpga_handle accel_handle, dma_ticket_t ticket, bool verbose);
+
+// Submit to retire latency of every descriptor since the last reset.
+// Retirement is observed when the host polls, so latency includes the
+// polling delay.
+void dma_latency_reset(void);
+const t_latency_hist *dma_latency(void);
+
+// Queue n descriptors, keeping the engine's descriptor FIFO as full as
+// possible. Returns without waiting for the transfers to finish.
+int dma_submit_batch(fpga_handle accel_handle,
+                     const dma_descriptor_t *descs,
+                     uint32_t n);
+
+// Wait until every submitted descriptor has been retired by the engine.
+int dma_wait_idle(fpga_handle accel_handle, bool verbose);
+
 void dma_transfer(fpga_handle accel_handle, 
                   e_dma_mode mode,
                   uint64_t src, 
@@ -38,13 +145,144 @@ void dma_transfer(fpga_handle accel_handle,
                   int len,
                   bool verbose);
 
+// Move len bytes between an arbitrary user buffer and device memory at the
+// linear address dev_addr. The buffer is pinned in place a chunk at a time
+// and streamed through the engine, so no bounce copy is made. mode must be
+// host_to_ddr or ddr_to_host. The buffer, dev_addr and len must be
+// DMA_LINE_SIZE aligned.
+int dma_sg_transfer(fpga_handle accel_handle,
+                    e_dma_mode mode,
+                    void *host_buf,
+                    uint64_t dev_addr,
+                    uint64_t len);
+
+// Copy len bytes of device memory from linear address src to dst and wait
+// for the copy to finish. The regions must not overlap and, like all
+// transfers, must be DMA_LINE_SIZE aligned. The data is staged through a
+// pinned host buffer.
+int dma_device_memcpy(fpga_handle accel_handle,
+                      uint64_t dst,
+                      uint64_t src,
+                      uint64_t len);
+
+// Host to DDR stream through a ring of num_bufs pinned staging buffers of
+// buf_size bytes, a multiple of DMA_LINE_SIZE up to DMA_MAX_DESC_BYTES.
+// Returns NULL for other sizes. Data is written to a ring of dev_size
+// bytes at linear device address dev_addr, which must be in a single
+// bank. The producer alternates dma_stream_get_buf(), which blocks while
+// every staging buffer is in flight, and dma_stream_put_buf(), which
+// queues the first len bytes of the buffer without waiting.
+typedef struct dma_stream t_dma_stream;
+
+typedef struct {
+  uint64_t bytes;
+  uint64_t num_bufs;
+  // Times and total time the producer waited for a free staging buffer
+  uint64_t num_stalls;
+  uint64_t stall_ns;
+} t_dma_stream_stats;
+
+t_dma_stream *dma_stream_open(fpga_handle accel_handle,
+                              uint32_t num_bufs,
+                              uint64_t buf_size,
+                              uint64_t dev_addr,
+                              uint64_t dev_size);
+
+void *dma_stream_get_buf(t_dma_stream *s);
+
+int dma_stream_put_buf(t_dma_stream *s, uint64_t len);
+
+void dma_stream_get_stats(const t_dma_stream *s, t_dma_stream_stats *stats);
+
+// Wait for buffers in flight and release the stream
+int dma_stream_close(t_dma_stream *s);
+
+// Multi-threaded submission. dma_mt_start() starts a submitter thread that
+// owns the engine; from then on descriptors must only be queued with
+// dma_mt_post(), which any thread may call. Posting is lock free and
+// blocks only while the queue of queue_size (a power of two) entries is
+// full. dma_mt_stop() must be called after every producer has finished
+// posting. It waits for all posted descriptors and returns -1 if any
+// failed. Once the engine stops on an error, every descriptor still queued
+// or posted later fails with -1.
+typedef struct dma_mt t_dma_mt;
+
+// Counts descriptors posted with the completion that have not yet retired.
+// A thread may post many descriptors with one completion and wait once.
+typedef struct {
+  _Atomic uint32_t pending;
+  _Atomic int status;
+} t_dma_completion;
+
+t_dma_mt *dma_mt_start(fpga_handle accel_handle, uint32_t queue_size);
+
+int dma_mt_stop(t_dma_mt *mt);
+
+// completion may be NULL when the caller does not need to know when the
+// descriptor retires.
+int dma_mt_post(t_dma_mt *mt,
+                const dma_descriptor_t *desc,
+                t_dma_completion *completion);
+
+void dma_completion_init(t_dma_completion *c);
+
+bool dma_completion_done(t_dma_completion *c);
+
+// Wait for every descriptor posted with c to retire. Returns -1 if any of
+// them failed.
+int dma_completion_wait(t_dma_completion *c);
+
+// Start a thread that samples the engine performance counters every
+// period_us microseconds, which must be shorter than the ~2ms the 20 bit
+// cycle counters take to wrap.
+int dma_perf_start(uint32_t period_us);
+void dma_perf_stop(void);
+
+// Current totals, including a fresh sample. Call from the thread that
+// submits descriptors, after waiting for the ones of interest to retire.
+void dma_perf_get(t_dma_perf_totals *totals);
+
+// Totals accumulated between two dma_perf_get() calls
+void dma_perf_delta(const t_dma_perf_totals *now,
+                    const t_dma_perf_totals *then,
+                    t_dma_perf_totals *delta);
+
+// Bandwidth in GB/s while the engine was active
+double dma_perf_bandwidth(const t_dma_perf_cntr *cntr);
+
+void dma_perf_print(const t_dma_perf_totals *totals, FILE *f);
+
+// Host memory model of the CSRs (dma_model.c), used by dma.c in place of
+// the AFU after dma_use_csr_model(). Accesses are serialized, since the
+// performance counter sampler reads CSRs from its own thread.
+typedef struct t_dma_model t_dma_model;
+
+t_dma_model *dma_model_create(void);
+void dma_model_destroy(t_dma_model *m);
+uint64_t dma_model_read_csr(t_dma_model *m, uint32_t idx);
+void dma_model_write_csr(t_dma_model *m, uint32_t idx, uint64_t v);
+
+// Get a pinned buffer shared with the FPGA from the buffer pool. Buffers
+// are recycled by free_io_shared_buffer() without being unpinned.
 volatile void* alloc_io_shared_buffer(fpga_handle accel_handle,
                                    ssize_t size,
                                    uint64_t *wsid,
                                    uint64_t *io_addr);
 
+void free_io_shared_buffer(fpga_handle accel_handle,
+                           volatile void *buf,
+                           ssize_t size,
+                           uint64_t wsid,
+                           uint64_t io_addr);
+
+// Allocate size bytes of device memory and return its linear address.
+// Returns FPGA_NO_MEMORY when no bank has a large enough free block.
 fpga_result alloc_fpga_mem_buffer(size_t size, 
                                   uint64_t *addr);
 
+fpga_result free_fpga_mem_buffer(uint64_t addr);
+
+void print_fpga_mem_stats(FILE *f);
+
 
 #endif // __DMA_UTIL__H__
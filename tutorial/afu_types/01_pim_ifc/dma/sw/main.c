@@ -21,8 +21,17 @@
 #include "dma.h"
 
 
-static uint32_t transfer_size = 8192;
+static uint64_t transfer_size = 8192;
+static bool transfer_size_set = false;
+static const char *sweep_csv = NULL;
+static bool desc_bench = false;
+static bool mt_bench = false;
+static bool mt_error_test = false;
+static bool numa_bench = false;
+static uint32_t stream_seconds = 0;
+static bool csr_model = false;
 static bool verbose = false;
+static const char *latency_json = NULL;
 
 //
 // Print help
@@ -31,6 +40,9 @@ static void help(void) {
   printf("\n"
          "Usage:\n"
          "    dma [-h] [--transfer-size=<num bytes>]\n"
+         "             [--latency-json=<file>] [--sweep=<csv file>]\n"
+         "             [--desc-bench] [--mt-bench] [--mt-error-test]\n"
+         "             [--numa-bench] [--stream=<seconds>] [--csr-model]\n"
          "             [--verbose]\n"
          "                     \n"
          "\n"
@@ -39,6 +51,46 @@ static void help(void) {
          "      -s,--transfer-size          Size, in bytes, of data to move "
          "with each dma.\n"
          "                                  transfer. (Default: 8KB)\n"
+         "                                  Sizes above 2MB use scatter-gather\n"
+         "                                  DMA directly from a user buffer.\n"
+         "      -j,--latency-json           Write a histogram of descriptor "
+         "submit to\n"
+         "                                  completion latency to <file> as "
+         "JSON.\n"
+         "      -w,--sweep                  Benchmark transfer sizes from 64B "
+         "to 1GB (64KB\n"
+         "                                  in ASE), or to --transfer-size, "
+         "in each mode\n"
+         "                                  and at several queue depths. "
+         "Results are\n"
+         "                                  written to <csv file>, "
+         "\"-\" for stdout.\n"
+         "      -d,--desc-bench             Measure the descriptor push rate "
+         "through\n"
+         "                                  the OPAE library and mapped MMIO.\n"
+         "      -m,--mt-bench               Measure descriptor rate with 1 "
+         "to 64 threads\n"
+         "                                  posting to the shared submission "
+         "queue.\n"
+         "      -e,--mt-error-test          Check that an engine error reaches "
+         "threads\n"
+         "                                  posting to the shared submission "
+         "queue.\n"
+         "                                  Needs --csr-model.\n"
+         "      -n,--numa-bench             Compare bandwidth with host "
+         "buffers on the\n"
+         "                                  FPGA's NUMA node and on a remote "
+         "node.\n"
+         "      -t,--stream                 Stream host to DDR through "
+         "rotating staging\n"
+         "                                  buffers of --transfer-size "
+         "bytes (default 2MB)\n"
+         "                                  for <seconds> and report "
+         "sustained bandwidth.\n"
+         "      -M,--csr-model              Send descriptors to a host memory "
+         "model of the\n"
+         "                                  CSRs instead of the FPGA. No FPGA "
+         "is needed.\n"
          "      -v,--verbose                Verbose.  Shows debug messages and "
          "prints out source \n"
          "                                  before the transfer and "
@@ -97,12 +149,20 @@ double evaluate_expression(const char *expr) {
 //
 // Parse command line arguments
 //
-#define GETOPT_STRING ":hs:v"
+#define GETOPT_STRING ":hs:j:w:dment:Mv"
 static int
 parse_args(int argc, char *argv[])
 {
   struct option longopts[] = {{"help", no_argument, NULL, 'h'},
                               {"transfer-size", required_argument, NULL, 's'},
+                              {"latency-json", required_argument, NULL, 'j'},
+                              {"sweep", required_argument, NULL, 'w'},
+                              {"desc-bench", no_argument, NULL, 'd'},
+                              {"mt-bench", no_argument, NULL, 'm'},
+                              {"mt-error-test", no_argument, NULL, 'e'},
+                              {"numa-bench", no_argument, NULL, 'n'},
+                              {"stream", required_argument, NULL, 't'},
+                              {"csr-model", no_argument, NULL, 'M'},
                               {"verbose", no_argument, NULL, 'v'},
                               {0, 0, 0, 0}};
 
@@ -124,7 +184,45 @@ parse_args(int argc, char *argv[])
       return -1;
 
     case 's': /* transfer-size */
-      transfer_size = (uint32_t)evaluate_expression(tmp_optarg);
+      transfer_size = (uint64_t)evaluate_expression(tmp_optarg);
+      transfer_size_set = true;
+      break;
+
+    case 'j': /* latency-json */
+      latency_json = tmp_optarg;
+      break;
+
+    case 'w': /* sweep */
+      sweep_csv = tmp_optarg;
+      break;
+
+    case 'd': /* desc-bench */
+      desc_bench = true;
+      break;
+
+    case 'm': /* mt-bench */
+      mt_bench = true;
+      break;
+
+    case 'e': /* mt-error-test */
+      mt_error_test = true;
+      break;
+
+    case 'n': /* numa-bench */
+      numa_bench = true;
+      break;
+
+    case 't': /* stream */
+      stream_seconds = strtoul(tmp_optarg, &endptr, 0);
+      if (*endptr || (0 == stream_seconds)) {
+        fprintf(stderr, "Stream duration must be a positive number of "
+                        "seconds\n");
+        return -1;
+      }
+      break;
+
+    case 'M': /* csr-model */
+      csr_model = true;
       break;
 
     case 'v': /* verbose (debug) */
@@ -147,6 +245,17 @@ parse_args(int argc, char *argv[])
     return -1;
   }
 
+  // Stream staging buffers are each moved by a single descriptor
+  if (stream_seconds && transfer_size_set &&
+      ((0 == transfer_size) || (transfer_size > DMA_MAX_DESC_BYTES) ||
+       (transfer_size % DMA_LINE_SIZE))) {
+    fprintf(stderr, "--stream needs a --transfer-size that is a multiple of "
+                    "%d bytes and at most %d bytes\n",
+            DMA_LINE_SIZE, DMA_MAX_DESC_BYTES);
+    help();
+    return -1;
+  }
+
   return 0;
 }
 
@@ -209,16 +318,20 @@ static fpga_handle connect_to_accel(const char *accel_uuid, bool *is_ase_sim)
 
 int main(int argc, char *argv[]) {
   fpga_result r;
-  fpga_handle accel_handle;
-  bool is_ase_sim;
+  fpga_handle accel_handle = NULL;
+  bool is_ase_sim = false;
 
   if (parse_args(argc, argv) < 0)
     return 1;
 
-  // Find and connect to the accelerator(s)
-  accel_handle = connect_to_accel(AFU_ACCEL_UUID, &is_ase_sim);
-  if (NULL == accel_handle)
-    return 0;
+  // Find and connect to the accelerator(s). The CSR model needs no FPGA.
+  if (csr_model) {
+    dma_use_csr_model(true);
+  } else {
+    accel_handle = connect_to_accel(AFU_ACCEL_UUID, &is_ase_sim);
+    if (NULL == accel_handle)
+      return 0;
+  }
 
   if (is_ase_sim) {
     printf("Running in ASE mode\n");
@@ -226,10 +339,32 @@ int main(int argc, char *argv[]) {
 
   // Run tests
   int status = 0;
-  status = dma(accel_handle, is_ase_sim, transfer_size, verbose);
+  if (stream_seconds) {
+    const uint64_t buf_size = transfer_size_set ? transfer_size
+                                                : DMA_MAX_DESC_BYTES;
+    status = dma_stream_bench(accel_handle, is_ase_sim, buf_size,
+                              stream_seconds, verbose);
+  } else if (numa_bench) {
+    status = dma_numa_bench(accel_handle, is_ase_sim, verbose);
+  } else if (mt_error_test) {
+    status = dma_mt_error_test(accel_handle, is_ase_sim, verbose);
+  } else if (mt_bench) {
+    status = dma_mt_bench(accel_handle, is_ase_sim, verbose);
+  } else if (desc_bench) {
+    status = dma_desc_bench(accel_handle, is_ase_sim, verbose);
+  } else if (sweep_csv) {
+    uint64_t max_size = is_ase_sim ? DMA_SWEEP_MAX_SIZE_ASE : DMA_SWEEP_MAX_SIZE;
+    if (transfer_size_set)
+      max_size = transfer_size;
+    status = dma_sweep(accel_handle, is_ase_sim, max_size, verbose, sweep_csv);
+  } else {
+    status = dma(accel_handle, is_ase_sim, transfer_size, verbose,
+                 latency_json);
+  }
 
   // Done
-  fpgaClose(accel_handle);
+  if (accel_handle)
+    fpgaClose(accel_handle);
 
   return status;
 }
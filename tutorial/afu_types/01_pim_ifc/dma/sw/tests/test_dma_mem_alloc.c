@@ -0,0 +1,224 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Host-only tests of the device memory allocator in dma_mem_alloc.c:
+// alignment and overlap under random alloc/free, buddy merging after
+// fragmentation, bank placement and alloc/free throughput. No FPGA is
+// needed, since the allocator only tracks addresses.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <opae/fpga.h>
+#include "dma.h"
+#include "dma_util.h"
+
+#define MAX_LIVE 4096
+#define RANDOM_ITERS 200000
+#define THROUGHPUT_ITERS 1000000
+
+static int failures = 0;
+
+#define CHECK(cond)                                                       \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      printf("  FAIL %s:%d: %s\n", __func__, __LINE__, #cond);           \
+      failures += 1;                                                      \
+    }                                                                     \
+  } while (0)
+
+static uint64_t bank_of(uint64_t addr) { return addr / DMA_FPGA_MEM_BANK_SIZE; }
+
+// Size of the block handed out for a request of size bytes
+static uint64_t block_size(uint64_t size) {
+  uint64_t b = DMA_FPGA_MEM_MIN_BLOCK;
+  while (b < size)
+    b *= 2;
+  return b;
+}
+
+// Every bank can hand out its whole size, so nothing is allocated or
+// left fragmented
+static void check_all_free(void) {
+  uint64_t addr[DMA_FPGA_NUM_MEM_BANKS];
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++)
+    CHECK(FPGA_OK == alloc_fpga_mem_buffer(DMA_FPGA_MEM_BANK_SIZE, &addr[b]));
+  CHECK(FPGA_NO_MEMORY == alloc_fpga_mem_buffer(DMA_FPGA_MEM_MIN_BLOCK, &addr[0]));
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(addr[b]));
+}
+
+static void test_invalid(void) {
+  uint64_t addr;
+  CHECK(FPGA_INVALID_PARAM == alloc_fpga_mem_buffer(0, &addr));
+  CHECK(FPGA_INVALID_PARAM == alloc_fpga_mem_buffer(DMA_FPGA_MEM_BANK_SIZE + 1, &addr));
+
+  CHECK(FPGA_OK == alloc_fpga_mem_buffer(3 * DMA_FPGA_MEM_MIN_BLOCK, &addr));
+  // Not the start of the block, then a double free
+  CHECK(FPGA_INVALID_PARAM == free_fpga_mem_buffer(addr + DMA_FPGA_MEM_MIN_BLOCK));
+  CHECK(FPGA_OK == free_fpga_mem_buffer(addr));
+  CHECK(FPGA_INVALID_PARAM == free_fpga_mem_buffer(addr));
+  CHECK(FPGA_INVALID_PARAM ==
+        free_fpga_mem_buffer(DMA_FPGA_NUM_MEM_BANKS * DMA_FPGA_MEM_BANK_SIZE));
+}
+
+// Random sizes, from under a block to tens of MB, allocated and freed in
+// random order. Blocks must be aligned to their size and never overlap.
+static void test_random(void) {
+  static uint64_t addr[MAX_LIVE];
+  static uint64_t size[MAX_LIVE];
+  uint32_t n = 0;
+
+  srand(1);
+  for (uint32_t it = 0; it < RANDOM_ITERS; it++) {
+    if ((n < MAX_LIVE) && ((n == 0) || (rand() & 1))) {
+      const uint64_t s = (rand() % 3 == 0) ? 1 + rand() % (64 << 20)
+                                           : 1 + rand() % 100000;
+      if (FPGA_OK != alloc_fpga_mem_buffer(s, &addr[n]))
+        continue;
+      size[n] = block_size(s);
+
+      const uint64_t off = addr[n] % DMA_FPGA_MEM_BANK_SIZE;
+      CHECK((off % size[n]) == 0);
+      CHECK(bank_of(addr[n]) == bank_of(addr[n] + size[n] - 1));
+      for (uint32_t j = 0; j < n; j++) {
+        if ((addr[j] < addr[n] + size[n]) && (addr[n] < addr[j] + size[j])) {
+          CHECK(!"overlapping blocks");
+          return;
+        }
+      }
+      n += 1;
+    } else {
+      const uint32_t k = rand() % n;
+      CHECK(FPGA_OK == free_fpga_mem_buffer(addr[k]));
+      n -= 1;
+      addr[k] = addr[n];
+      size[k] = size[n];
+    }
+  }
+
+  while (n)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(addr[--n]));
+  check_all_free();
+}
+
+// Fill the free end of bank 0 with minimum blocks and free every other
+// one. Half of them are free, but no two free blocks are buddies, so
+// nothing larger than a minimum block fits. Freeing the rest must merge
+// them back.
+static void test_fragmentation(void) {
+  const uint64_t per_bank = DMA_FPGA_MEM_BANK_SIZE / DMA_FPGA_MEM_MIN_BLOCK;
+  const uint32_t n = 8192;
+  static uint64_t addr[8192];
+
+  // Take the other banks so that everything lands in bank 0
+  uint64_t banks[DMA_FPGA_NUM_MEM_BANKS];
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++)
+    CHECK(FPGA_OK == alloc_fpga_mem_buffer(DMA_FPGA_MEM_BANK_SIZE, &banks[b]));
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++) {
+    if (bank_of(banks[b]) == 0)
+      CHECK(FPGA_OK == free_fpga_mem_buffer(banks[b]));
+  }
+  // Leave only n minimum blocks of bank 0 free
+  uint64_t rest[64];
+  uint32_t num_rest = 0;
+  for (uint64_t s = DMA_FPGA_MEM_BANK_SIZE / 2;
+       s >= n * DMA_FPGA_MEM_MIN_BLOCK; s /= 2) {
+    CHECK(FPGA_OK == alloc_fpga_mem_buffer(s, &rest[num_rest]));
+    num_rest += 1;
+  }
+  CHECK(per_bank > n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    CHECK(FPGA_OK == alloc_fpga_mem_buffer(DMA_FPGA_MEM_MIN_BLOCK, &addr[i]));
+    CHECK(bank_of(addr[i]) == 0);
+  }
+  uint64_t a;
+  CHECK(FPGA_NO_MEMORY == alloc_fpga_mem_buffer(DMA_FPGA_MEM_MIN_BLOCK, &a));
+
+  for (uint32_t i = 0; i < n; i += 2)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(addr[i]));
+  CHECK(FPGA_NO_MEMORY == alloc_fpga_mem_buffer(2 * DMA_FPGA_MEM_MIN_BLOCK, &a));
+  CHECK(FPGA_OK == alloc_fpga_mem_buffer(DMA_FPGA_MEM_MIN_BLOCK, &a));
+  CHECK(FPGA_OK == free_fpga_mem_buffer(a));
+
+  print_fpga_mem_stats(stdout);
+
+  for (uint32_t i = 1; i < n; i += 2)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(addr[i]));
+  CHECK(FPGA_OK == alloc_fpga_mem_buffer(n * DMA_FPGA_MEM_MIN_BLOCK, &a));
+  CHECK(FPGA_OK == free_fpga_mem_buffer(a));
+
+  for (uint32_t i = 0; i < num_rest; i++)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(rest[i]));
+  for (int b = 0; b < DMA_FPGA_NUM_MEM_BANKS; b++) {
+    if (bank_of(banks[b]) != 0)
+      CHECK(FPGA_OK == free_fpga_mem_buffer(banks[b]));
+  }
+  check_all_free();
+}
+
+// Small allocations pack into the lowest bank. Large ones rotate through
+// the banks, so consecutive buffers use different DDR channels.
+static void test_bank_placement(void) {
+  uint64_t small[16];
+  for (int i = 0; i < 16; i++) {
+    CHECK(FPGA_OK == alloc_fpga_mem_buffer(DMA_FPGA_MEM_INTERLEAVE_MIN / 2, &small[i]));
+    CHECK(bank_of(small[i]) == 0);
+  }
+
+  uint64_t large[2 * DMA_FPGA_NUM_MEM_BANKS];
+  for (int i = 0; i < 2 * DMA_FPGA_NUM_MEM_BANKS; i++) {
+    CHECK(FPGA_OK == alloc_fpga_mem_buffer(DMA_FPGA_MEM_INTERLEAVE_MIN, &large[i]));
+    if (i > 0) {
+      CHECK(bank_of(large[i]) ==
+            (bank_of(large[i - 1]) + 1) % DMA_FPGA_NUM_MEM_BANKS);
+    }
+  }
+
+  for (int i = 0; i < 16; i++)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(small[i]));
+  for (int i = 0; i < 2 * DMA_FPGA_NUM_MEM_BANKS; i++)
+    CHECK(FPGA_OK == free_fpga_mem_buffer(large[i]));
+  check_all_free();
+}
+
+// Reported, not checked: the rate depends on the host
+static void test_throughput(void) {
+  static uint64_t addr[64];
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t it = 0; it < THROUGHPUT_ITERS / 64; it++) {
+    for (int i = 0; i < 64; i++) {
+      const size_t s = (size_t)DMA_FPGA_MEM_MIN_BLOCK << (i % 12);
+      if (FPGA_OK != alloc_fpga_mem_buffer(s, &addr[i])) {
+        CHECK(!"allocation failed");
+        return;
+      }
+    }
+    for (int i = 0; i < 64; i++)
+      free_fpga_mem_buffer(addr[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  const double sec = end.tv_sec - start.tv_sec + 1e-9 * (end.tv_nsec - start.tv_nsec);
+  printf("  %0.2f M alloc/free pairs per second\n", THROUGHPUT_ITERS / sec * 1e-6);
+  check_all_free();
+}
+
+int main(void) {
+  test_invalid();
+  test_random();
+  test_fragmentation();
+  test_bank_placement();
+  test_throughput();
+
+  printf("dma_mem_alloc: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+// Copyright (C) 2022 Intel Corporation
+// SPDX-License-Identifier: MIT
+
+//
+// Host-only test of the latency histogram's bucket boundaries. Each value
+// is recorded alone and must land in exactly one bucket whose range
+// holds it, within the histogram's precision. Values past the last
+// power of two are counted in the last bucket.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency_hist.h"
+
+// Guard words after the histogram catch writes past buckets[]
+typedef struct {
+  t_latency_hist h;
+  uint64_t guard[LATENCY_HIST_SUB_BUCKETS];
+} t_guarded_hist;
+
+static int failures = 0;
+
+#define CHECK(cond, v)                                                    \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      printf("  FAIL value %lu: %s\n", (unsigned long)(v), #cond);       \
+      failures += 1;                                                      \
+    }                                                                     \
+  } while (0)
+
+
+// Record v alone and return the index of the bucket that counted it
+static int64_t record_one(t_guarded_hist *g, uint64_t v) {
+  latency_hist_reset(&g->h);
+  memset(g->guard, 0, sizeof(g->guard));
+  latency_hist_record(&g->h, v);
+
+  int64_t idx = -1;
+  uint32_t num_set = 0;
+  for (uint32_t i = 0; i < LATENCY_HIST_NUM_BUCKETS; i += 1) {
+    if (g->h.buckets[i]) {
+      idx = i;
+      num_set += 1;
+    }
+  }
+  for (uint32_t i = 0; i < LATENCY_HIST_SUB_BUCKETS; i += 1)
+    CHECK(g->guard[i] == 0, v);
+  CHECK(num_set == 1, v);
+  return idx;
+}
+
+
+static void check_value(t_guarded_hist *g, uint64_t v, int64_t *last_idx) {
+  const int64_t idx = record_one(g, v);
+  CHECK(idx >= *last_idx, v);
+  *last_idx = idx;
+
+  // Pair v with a huge value so that the median reports the upper edge
+  // of v's bucket instead of being clipped to v by the maximum.
+  latency_hist_record(&g->h, UINT64_MAX);
+  const uint64_t high = latency_hist_percentile(&g->h, 50.0);
+
+  if (v < (2UL << LATENCY_HIST_MAX_BITS)) {
+    CHECK(high >= v, v);
+    CHECK(high - v <= v / LATENCY_HIST_SUB_BUCKETS, v);
+  } else {
+    CHECK(idx == LATENCY_HIST_NUM_BUCKETS - 1, v);
+    CHECK(high < v, v);
+  }
+}
+
+
+int main(void) {
+  t_guarded_hist *g = malloc(sizeof(t_guarded_hist));
+  if (NULL == g) return 1;
+
+  int64_t last_idx = 0;
+
+  // Every power of two and its neighbors, in increasing order. They
+  // include each boundary between bucket groups and the edge of the
+  // recorded range.
+  check_value(g, 0, &last_idx);
+  check_value(g, 1, &last_idx);
+  check_value(g, 2, &last_idx);
+  for (uint32_t b = 2; b < 64; b += 1) {
+    const uint64_t p = 1UL << b;
+    check_value(g, p - 1, &last_idx);
+    check_value(g, p, &last_idx);
+    if (b < 63) check_value(g, p + 1, &last_idx);
+  }
+  check_value(g, UINT64_MAX, &last_idx);
+
+  free(g);
+
+  printf("latency_hist boundaries: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}